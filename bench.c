@@ -0,0 +1,1183 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "block.h"
+#include "cache.h"
+#include "jbod.h"
+#include "mdadm.h"
+#include "net.h"
+#include "stats.h"
+
+/* runs the benchmarks the changes to the driver were measured with, one mode
+ * per run, and prints what it measured. the modes that need a device mount the
+ * array of jbod_server themselves and leave it unmounted, what they write
+ * overwrites what it held. the numbers depend on the machine and the server,
+ * what matters is how the columns of one run compare. */
+
+static uint8_t buf[MDADM_ARRAY_SIZE];
+static jbod_node_t server = { .ip = JBOD_SERVER, .port = JBOD_PORT };
+
+/* the cache as it was before it was hashed: every lookup and insert walks the
+ * whole entry array, and the insert walks it twice. kept as the baseline of the
+ * cache mode. */
+typedef struct {
+  bool valid;
+  int disk_num;
+  int block_num;
+  uint8_t block[JBOD_BLOCK_SIZE];
+  int access_time;
+} scan_entry_t;
+
+static scan_entry_t *scan_cache = NULL;
+static int scan_size = 0;
+static int scan_clock = 0;
+
+static int scan_lookup(int disk_num, int block_num, uint8_t *buf) {
+  for (int index = 0; index < scan_size; index++){
+    if (scan_cache[index].disk_num == disk_num && scan_cache[index].block_num == block_num && scan_cache[index].valid == true){
+      memcpy(buf, scan_cache[index].block, JBOD_BLOCK_SIZE);
+      scan_clock ++;
+      scan_cache[index].access_time = scan_clock;
+      return 1;
+    }
+  }
+  return -1;
+}
+
+static int scan_insert(int disk_num, int block_num, const uint8_t *buf) {
+  int victim = 0;
+
+  for (int index = 0; index < scan_size; index++){
+    if (scan_cache[index].disk_num == disk_num && scan_cache[index].block_num == block_num && scan_cache[index].valid == true){
+      return -1;
+    }
+  }
+
+  for (int index = 0; index < scan_size; index++){
+    if (scan_cache[index].valid == false){
+      victim = index;
+      break;
+    }
+    if (scan_cache[index].access_time < scan_cache[victim].access_time){
+      victim = index;
+    }
+  }
+
+  memcpy(scan_cache[victim].block, buf, JBOD_BLOCK_SIZE);
+  scan_clock ++;
+  scan_cache[victim].access_time = scan_clock;
+  scan_cache[victim].disk_num = disk_num;
+  scan_cache[victim].block_num = block_num;
+  scan_cache[victim].valid = true;
+  return 1;
+}
+
+//xorshift, so every run and every cache sees the same sequence
+static uint32_t next_random(uint32_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+/* looks up |num_ops| blocks drawn from twice as many as fit the cache of
+ * |num_entries| entries and inserts the misses, returns the ns per operation */
+static double cache_workload(int num_entries, int num_ops, bool scan) {
+  uint8_t block[JBOD_BLOCK_SIZE];
+  uint32_t state = 2463534242u;
+  uint32_t num_keys = 2 * (uint32_t) num_entries;
+
+  memset(block, 0xa5, sizeof(block));
+  uint64_t start = stats_now();
+
+  for (int op = 0; op < num_ops; op++){
+    uint32_t key = next_random(&state) % num_keys * 7919 % (JBOD_NUM_DISKS * JBOD_NUM_BLOCKS_PER_DISK);
+    int disk_num = key / JBOD_NUM_BLOCKS_PER_DISK;
+    int block_num = key % JBOD_NUM_BLOCKS_PER_DISK;
+
+    if (scan){
+      if (scan_lookup(disk_num, block_num, block) == -1){
+        scan_insert(disk_num, block_num, block);
+      }
+    }
+    else if (cache_lookup(disk_num, block_num, block) == -1){
+      cache_insert(disk_num, block_num, block);
+    }
+  }
+
+  return (double) (stats_now() - start) / num_ops;
+}
+
+static int bench_cache(void) {
+  const int sizes[] = { 16, 256, 4096 };
+
+  printf("%8s %14s %14s %8s\n", "entries", "scan ns/op", "hashed ns/op", "speedup");
+  for (int i = 0; i < 3; i++){
+    int num_ops = sizes[i] >= 4096 ? 50000 : 500000;
+
+    scan_cache = calloc(sizes[i], sizeof(scan_entry_t));
+    scan_size = sizes[i];
+    scan_clock = 0;
+    if (scan_cache == NULL || cache_create(sizes[i]) != 1){
+      fprintf(stderr, "error, failed to create a cache of %d entries\n", sizes[i]);
+      free(scan_cache);
+      return -1;
+    }
+
+    double scan_ns = cache_workload(sizes[i], num_ops, true);
+    double hashed_ns = cache_workload(sizes[i], num_ops, false);
+    printf("%8d %14.1f %14.1f %7.1fx\n", sizes[i], scan_ns, hashed_ns, scan_ns / hashed_ns);
+
+    cache_destroy();
+    free(scan_cache);
+    scan_cache = NULL;
+  }
+  return 0;
+}
+
+/* the workloads of the policies mode, over blocks numbered 0 to 4095 across
+ * the disks: a hot set of 256 blocks hit at random with a scan of the whole
+ * array after every 512 hot accesses, the hot set alone, and a loop over
+ * 768 blocks, half again the cache */
+typedef enum {
+  WORKLOAD_HOT_AND_SCANS,
+  WORKLOAD_HOT,
+  WORKLOAD_LOOP,
+  NUM_WORKLOADS,
+} policy_workload_t;
+
+//the percentage of the accesses to hot blocks (every access without a hot set) that hit
+static double policy_hit_rate(cache_policy_t policy, policy_workload_t workload) {
+  uint8_t block[JBOD_BLOCK_SIZE];
+  uint32_t state = 2463534242u;
+  uint64_t hits = 0;
+  uint64_t counted = 0;
+
+  memset(block, 0xa5, sizeof(block));
+  if (cache_create_with_policy(512, policy) != 1){
+    return -1;
+  }
+
+  for (int round = 0; round < 256; round++){
+    for (int i = 0; i < 512; i++){
+      uint32_t key = workload == WORKLOAD_LOOP ? (round * 512 + i) % 768 : next_random(&state) % 256 * 16;
+      bool hit = cache_lookup(key % JBOD_NUM_DISKS, key / JBOD_NUM_DISKS, block) == 1;
+
+      if (!hit){
+        cache_insert(key % JBOD_NUM_DISKS, key / JBOD_NUM_DISKS, block);
+      }
+      //the first round only warms the cache up
+      if (round > 0){
+        hits += hit;
+        counted ++;
+      }
+    }
+    for (uint32_t key = 0; workload == WORKLOAD_HOT_AND_SCANS && key < JBOD_NUM_DISKS * JBOD_NUM_BLOCKS_PER_DISK; key++){
+      if (cache_lookup(key % JBOD_NUM_DISKS, key / JBOD_NUM_DISKS, block) == -1){
+        cache_insert(key % JBOD_NUM_DISKS, key / JBOD_NUM_DISKS, block);
+      }
+    }
+  }
+
+  cache_destroy();
+  return 100.0 * hits / counted;
+}
+
+static int bench_policies(void) {
+  const char *names[] = { "hot set and scans", "hot set", "loop of 1.5x the cache" };
+  const cache_policy_t policies[] = { CACHE_POLICY_LRU, CACHE_POLICY_CLOCK, CACHE_POLICY_2Q, CACHE_POLICY_ARC };
+
+  printf("%-24s %8s %8s %8s %8s\n", "hit % with 512 entries", "lru", "clock", "2q", "arc");
+  for (int workload = 0; workload < NUM_WORKLOADS; workload++){
+    printf("%-24s", names[workload]);
+    for (int i = 0; i < 4; i++){
+      double hit_rate = policy_hit_rate(policies[i], (policy_workload_t) workload);
+
+      if (hit_rate < 0){
+        fprintf(stderr, "\nerror, failed to create the cache\n");
+        return -1;
+      }
+      printf(" %8.1f", hit_rate);
+    }
+    printf("\n");
+  }
+  return 0;
+}
+
+//connects to the server over |connections| sockets and mounts the array as |layout|, the statistics start from there
+static int bench_mount_layout(int connections, mdadm_layout_t layout, uint32_t stripe_blocks) {
+  if (!jbod_connect_nodes(&server, 1, connections)){
+    fprintf(stderr, "error, failed to connect to %s:%d\n", server.ip, server.port);
+    return -1;
+  }
+  if (mdadm_mount_layout(layout, stripe_blocks) != 1){
+    fprintf(stderr, "error, failed to mount\n");
+    jbod_disconnect();
+    return -1;
+  }
+  stats_reset();
+  return 1;
+}
+
+static int bench_mount(int connections) {
+  return bench_mount_layout(connections, MDADM_LAYOUT_LINEAR, 0);
+}
+
+static void bench_unmount(void) {
+  mdadm_unmount();
+  jbod_disconnect();
+}
+
+//the jbod commands sent since the statistics were reset, a range command counts as one
+static uint64_t jbod_commands(void) {
+  stats_snapshot_t snapshot;
+  uint64_t num_commands = 0;
+
+  stats_snapshot(&snapshot);
+  for (int histogram = 0; histogram < STATS_MDADM_READ; histogram++){
+    num_commands += snapshot.latency[histogram].count;
+  }
+  return num_commands;
+}
+
+static uint32_t bench_op(int disk_num, int block_num, jbod_cmd_t cmd) {
+  return (uint32_t) cmd << 14 | (uint32_t) block_num << 20 | (uint32_t) disk_num << 28;
+}
+
+/* the write path before it skipped read-modify-write: every block the write
+ * touches is seeked and read, then seeked again and written, one command at a
+ * time. returns the number of commands it sent or -1. */
+static int old_write(uint32_t addr, uint32_t len, const uint8_t *data) {
+  uint8_t block[JBOD_BLOCK_SIZE];
+  int num_commands = 0;
+
+  for (uint32_t done = 0; done < len; ){
+    uint32_t curr_addr = addr + done;
+    int disk_num = curr_addr / JBOD_DISK_SIZE;
+    int block_num = curr_addr % JBOD_DISK_SIZE / JBOD_BLOCK_SIZE;
+    uint32_t offset = curr_addr % JBOD_BLOCK_SIZE;
+    uint32_t n = JBOD_BLOCK_SIZE - offset < len - done ? JBOD_BLOCK_SIZE - offset : len - done;
+
+    if (jbod_client_operation(bench_op(disk_num, block_num, JBOD_SEEK_TO_DISK), NULL) != 0 ||
+        jbod_client_operation(bench_op(disk_num, block_num, JBOD_SEEK_TO_BLOCK), NULL) != 0 ||
+        jbod_client_operation(bench_op(disk_num, block_num, JBOD_READ_BLOCK), block) != 0){
+      return -1;
+    }
+    memcpy(block + offset, data + done, n);
+    if (jbod_client_operation(bench_op(disk_num, block_num, JBOD_SEEK_TO_DISK), NULL) != 0 ||
+        jbod_client_operation(bench_op(disk_num, block_num, JBOD_SEEK_TO_BLOCK), NULL) != 0 ||
+        jbod_client_operation(bench_op(disk_num, block_num, JBOD_WRITE_BLOCK), block) != 0){
+      return -1;
+    }
+    num_commands += 6;
+    done += n;
+  }
+  return num_commands;
+}
+
+/* writes the array in calls of 1 KiB starting |skew| bytes into it, with the
+ * old write path or with mdadm_write, and prints the commands per MiB */
+static int write_ops_row(const char *name, uint32_t skew, bool old) {
+  uint32_t num_bytes = MDADM_ARRAY_SIZE - 1024;
+  uint64_t start;
+
+  if (bench_mount(1) != 1){
+    return -1;
+  }
+
+  start = stats_now();
+  for (uint32_t addr = skew; addr < skew + num_bytes; addr += 1024){
+    if ((old ? old_write(addr, 1024, buf + addr) : mdadm_write(addr, 1024, buf + addr)) == -1){
+      fprintf(stderr, "error, failed to write at %u\n", addr);
+      bench_unmount();
+      return -1;
+    }
+  }
+  double elapsed = (stats_now() - start) / 1e9;
+
+  stats_snapshot_t snapshot;
+  stats_snapshot(&snapshot);
+  double mib = num_bytes / (1024.0 * 1024.0);
+  printf("%-34s %14.0f %14.0f %10.2f\n", name, jbod_commands() / mib,
+         snapshot.counters[STATS_ROUND_TRIPS] / mib, mib / elapsed);
+
+  bench_unmount();
+  return 0;
+}
+
+static int bench_write_ops(void) {
+  for (uint32_t i = 0; i < MDADM_ARRAY_SIZE; i++){
+    buf[i] = (uint8_t) (i ^ (i >> 8) ^ (i >> 16));
+  }
+
+  printf("%-34s %14s %14s %10s\n", "1 KiB writes", "commands/MiB", "round trips/MiB", "MiB/s");
+  if (write_ops_row("read-modify-write of every block", 0, true) != 0 ||
+      write_ops_row("mdadm_write, block aligned", 0, false) != 0 ||
+      write_ops_row("mdadm_write, 100 bytes off", 100, false) != 0){
+    return -1;
+  }
+  return 0;
+}
+
+/* reads disk 0 over and over in pipelined batches of |depth| JBOD_READ_BLOCK
+ * commands, or one jbod_client_operation at a time with a |depth| of 0, and
+ * returns the commands per second or -1 */
+static double pipeline_rate(int depth) {
+  jbod_request_t reqs[JBOD_PIPELINE_DEPTH];
+  int num_reads = 64 * JBOD_NUM_BLOCKS_PER_DISK;
+  int batch = depth > 0 ? depth : 1;
+  uint64_t start = stats_now();
+
+  stats_reset();
+  for (int done = 0; done < num_reads; done += batch){
+    //the block pointer wraps to the next disk at the end of this one
+    if (done % JBOD_NUM_BLOCKS_PER_DISK == 0 &&
+        (jbod_client_operation(bench_op(0, 0, JBOD_SEEK_TO_DISK), NULL) != 0 ||
+         jbod_client_operation(bench_op(0, 0, JBOD_SEEK_TO_BLOCK), NULL) != 0)){
+      return -1;
+    }
+
+    if (depth == 0){
+      if (jbod_client_operation(bench_op(0, 0, JBOD_READ_BLOCK), buf) != 0){
+        return -1;
+      }
+      continue;
+    }
+    for (int i = 0; i < depth; i++){
+      reqs[i] = (jbod_request_t) { .op = bench_op(0, 0, JBOD_READ_BLOCK), .block = buf + i * JBOD_BLOCK_SIZE, .ret = 0, .node = 0 };
+    }
+    if (jbod_client_pipeline(reqs, depth) != 0){
+      return -1;
+    }
+  }
+
+  return jbod_commands() / ((stats_now() - start) / 1e9);
+}
+
+static int bench_pipeline(void) {
+  const int depths[] = { 0, 1, 4, 16, 64 };
+  double base = 0;
+
+  if (bench_mount(1) != 1){
+    return -1;
+  }
+
+  printf("%-24s %14s %8s\n", "depth", "commands/s", "speedup");
+  for (int i = 0; i < 5; i++){
+    double rate = pipeline_rate(depths[i]);
+    char name[32];
+
+    if (rate < 0){
+      fprintf(stderr, "error, the reads at depth %d failed\n", depths[i]);
+      bench_unmount();
+      return -1;
+    }
+    if (i == 0){
+      base = rate;
+      snprintf(name, sizeof(name), "jbod_client_operation");
+    }
+    else{
+      snprintf(name, sizeof(name), "%d", depths[i]);
+    }
+    printf("%-24s %14.0f %7.1fx\n", name, rate, rate / base);
+  }
+
+  bench_unmount();
+  return 0;
+}
+
+/* the packet layer before it gathered and buffered: a packet goes out in one
+ * write of its header and its block staged behind it, and a response is read
+ * as its header and then its block. |old_syscalls| counts its reads and writes. */
+static uint64_t old_syscalls = 0;
+
+static bool old_transfer(int fd, uint8_t *data, int len, bool writing) {
+  for (int done = 0; done < len; ){
+    int curr_bytes = writing ? write(fd, data + done, len - done) : read(fd, data + done, len - done);
+    old_syscalls ++;
+    if (curr_bytes <= 0){
+      return false;
+    }
+    done += curr_bytes;
+  }
+  return true;
+}
+
+static int old_operation(int fd, uint32_t op, uint8_t *block) {
+  uint8_t packet[HEADER_LEN + JBOD_BLOCK_SIZE];
+  bool is_write = ((op >> 14) & 0x3f) == JBOD_WRITE_BLOCK;
+  uint16_t len = htons(HEADER_LEN + (is_write ? JBOD_BLOCK_SIZE : 0));
+  uint32_t net_op = htonl(op);
+  uint16_t ret = 0;
+
+  memcpy(packet, &len, sizeof(len));
+  memcpy(packet + 2, &net_op, sizeof(net_op));
+  memcpy(packet + 6, &ret, sizeof(ret));
+  if (is_write){
+    memcpy(packet + HEADER_LEN, block, JBOD_BLOCK_SIZE);
+  }
+  if (!old_transfer(fd, packet, ntohs(len), true) || !old_transfer(fd, packet, HEADER_LEN, false)){
+    return -1;
+  }
+
+  memcpy(&len, packet, sizeof(len));
+  memcpy(&ret, packet + 6, sizeof(ret));
+  if (ntohs(len) == HEADER_LEN + JBOD_BLOCK_SIZE && !old_transfer(fd, block, JBOD_BLOCK_SIZE, false)){
+    return -1;
+  }
+  return ret == 0 ? 0 : -1;
+}
+
+//reads every block of the array with the old packet layer over a socket of its own
+static int old_read_array(void) {
+  struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(server.port) };
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  int result = 0;
+
+  if (fd == -1 || inet_aton(server.ip, &addr.sin_addr) == 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1){
+    if (fd != -1){
+      close(fd);
+    }
+    return -1;
+  }
+
+  //the array may have been left mounted, that error is harmless
+  old_operation(fd, bench_op(0, 0, JBOD_MOUNT), NULL);
+  for (int disk_num = 0; disk_num < JBOD_NUM_DISKS && result == 0; disk_num++){
+    if (old_operation(fd, bench_op(disk_num, 0, JBOD_SEEK_TO_DISK), NULL) != 0 ||
+        old_operation(fd, bench_op(disk_num, 0, JBOD_SEEK_TO_BLOCK), NULL) != 0){
+      result = -1;
+    }
+    for (int block_num = 0; block_num < JBOD_NUM_BLOCKS_PER_DISK && result == 0; block_num++){
+      result = old_operation(fd, bench_op(disk_num, block_num, JBOD_READ_BLOCK), buf + (disk_num * JBOD_NUM_BLOCKS_PER_DISK + block_num) * JBOD_BLOCK_SIZE);
+    }
+  }
+  old_operation(fd, bench_op(0, 0, JBOD_UNMOUNT), NULL);
+
+  close(fd);
+  return result;
+}
+
+//reads every block of the array with jbod_client_operation, or pipelined 64 deep with |pipelined|
+static int client_read_array(bool pipelined) {
+  jbod_request_t reqs[JBOD_PIPELINE_DEPTH];
+
+  for (int disk_num = 0; disk_num < JBOD_NUM_DISKS; disk_num++){
+    if (jbod_client_operation(bench_op(disk_num, 0, JBOD_SEEK_TO_DISK), NULL) != 0 ||
+        jbod_client_operation(bench_op(disk_num, 0, JBOD_SEEK_TO_BLOCK), NULL) != 0){
+      return -1;
+    }
+    for (int block_num = 0; block_num < JBOD_NUM_BLOCKS_PER_DISK; block_num += pipelined ? JBOD_PIPELINE_DEPTH : 1){
+      uint8_t *block = buf + (disk_num * JBOD_NUM_BLOCKS_PER_DISK + block_num) * JBOD_BLOCK_SIZE;
+
+      if (!pipelined){
+        if (jbod_client_operation(bench_op(disk_num, block_num, JBOD_READ_BLOCK), block) != 0){
+          return -1;
+        }
+        continue;
+      }
+      for (int i = 0; i < JBOD_PIPELINE_DEPTH; i++){
+        reqs[i] = (jbod_request_t) { .op = bench_op(disk_num, block_num + i, JBOD_READ_BLOCK), .block = block + i * JBOD_BLOCK_SIZE, .ret = 0, .node = 0 };
+      }
+      if (jbod_client_pipeline(reqs, JBOD_PIPELINE_DEPTH) != 0){
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+static int bench_syscalls(void) {
+  const char *names[] = { "jbod_client_operation", "pipelined 64 deep", "mdadm_read_large of the array" };
+  double num_blocks = JBOD_NUM_DISKS * JBOD_NUM_BLOCKS_PER_DISK;
+
+  if (old_read_array() != 0){
+    fprintf(stderr, "error, failed to read the array with the old packet layer\n");
+    return -1;
+  }
+  printf("%-32s %14s\n", "reading the whole array", "syscalls/block");
+  printf("%-32s %14.2f\n", "old packet layer", old_syscalls / num_blocks);
+
+  if (bench_mount(1) != 1){
+    return -1;
+  }
+  for (int i = 0; i < 3; i++){
+    uint64_t before = jbod_client_syscalls();
+    int result = i < 2 ? client_read_array(i == 1) : (mdadm_read_large(0, MDADM_ARRAY_SIZE, buf) == MDADM_ARRAY_SIZE ? 0 : -1);
+
+    if (result != 0){
+      fprintf(stderr, "error, failed to read the array with %s\n", names[i]);
+      bench_unmount();
+      return -1;
+    }
+    printf("%-32s %14.2f\n", names[i], (jbod_client_syscalls() - before) / num_blocks);
+  }
+
+  bench_unmount();
+  return 0;
+}
+
+/* the asynchronous requests of a run that have not finished yet */
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int remaining;
+  int failed;
+} bench_waiter_t;
+
+static bench_waiter_t waiter = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0 };
+
+static void request_done(int result, void *arg) {
+  (void) arg;
+  pthread_mutex_lock(&waiter.lock);
+  if (result == -1){
+    waiter.failed ++;
+  }
+  waiter.remaining --;
+  pthread_cond_signal(&waiter.cond);
+  pthread_mutex_unlock(&waiter.lock);
+}
+
+//returns the number of requests that failed once all have finished
+static int wait_requests(void) {
+  int failed;
+
+  pthread_mutex_lock(&waiter.lock);
+  while (waiter.remaining > 0){
+    pthread_cond_wait(&waiter.cond, &waiter.lock);
+  }
+  failed = waiter.failed;
+  waiter.failed = 0;
+  pthread_mutex_unlock(&waiter.lock);
+  return failed;
+}
+
+//reads every disk with a request of its own, all at once
+static int read_disks_async(void) {
+  for (int disk_num = 0; disk_num < JBOD_NUM_DISKS; disk_num++){
+    pthread_mutex_lock(&waiter.lock);
+    waiter.remaining ++;
+    pthread_mutex_unlock(&waiter.lock);
+
+    if (mdadm_read_async(disk_num * JBOD_DISK_SIZE, JBOD_DISK_SIZE, buf + disk_num * JBOD_DISK_SIZE, request_done, NULL) != 1){
+      request_done(-1, NULL);
+    }
+  }
+  return wait_requests() == 0 ? 0 : -1;
+}
+
+/* reads the array over pools of 1 to 16 connections, one mdadm_read_async
+ * per disk at a time, so the disks can be served side by side. the stock
+ * jbod_server serves a single connection. server.c serves a pool, but only
+ * overlaps the disks when it is started with service times (-T). */
+static int bench_pool(void) {
+  double base = 0;
+
+  printf("%-12s %10s %8s\n", "connections", "MiB/s", "speedup");
+  for (int connections = 1; connections <= JBOD_MAX_CONNECTIONS; connections *= 2){
+    int rounds = 8;
+
+    if (bench_mount(connections) != 1){
+      if (connections == 1){
+        return -1;
+      }
+      printf("%-12d the server does not serve %d connections\n", connections, connections);
+      break;
+    }
+
+    uint64_t start = stats_now();
+    for (int round = 0; round < rounds; round++){
+      if (read_disks_async() != 0){
+        fprintf(stderr, "error, failed to read the array over %d connections\n", connections);
+        bench_unmount();
+        return -1;
+      }
+    }
+    double rate = rounds * (MDADM_ARRAY_SIZE / (1024.0 * 1024.0)) / ((stats_now() - start) / 1e9);
+    bench_unmount();
+
+    if (connections == 1){
+      base = rate;
+    }
+    printf("%-12d %10.2f %7.1fx\n", connections, rate, rate / base);
+  }
+  return 0;
+}
+
+/* moves the whole array in sequential transfers of |size| bytes, with
+ * mdadm_write/mdadm_read for 1 KiB and the _large calls above it, and returns
+ * the MiB/s or -1 */
+static double sequential_rate(uint32_t size, bool is_write) {
+  int rounds = 4;
+  uint64_t start = stats_now();
+
+  for (int round = 0; round < rounds; round++){
+    for (uint32_t addr = 0; addr < MDADM_ARRAY_SIZE; addr += size){
+      int result;
+
+      if (size <= 1024){
+        result = is_write ? mdadm_write(addr, size, buf + addr) : mdadm_read(addr, size, buf + addr);
+      }
+      else{
+        result = is_write ? mdadm_write_large(addr, size, buf + addr) : mdadm_read_large(addr, size, buf + addr);
+      }
+      if (result != (int) size){
+        return -1;
+      }
+    }
+  }
+  return rounds * (MDADM_ARRAY_SIZE / (1024.0 * 1024.0)) / ((stats_now() - start) / 1e9);
+}
+
+static int bench_large(void) {
+  const uint32_t sizes[] = { 1024, 4096, 65536, MDADM_ARRAY_SIZE };
+
+  if (bench_mount(1) != 1){
+    return -1;
+  }
+
+  printf("%-10s %12s %12s\n", "transfer", "read MiB/s", "write MiB/s");
+  for (int i = 0; i < 4; i++){
+    double write_rate = sequential_rate(sizes[i], true);
+    double read_rate = sequential_rate(sizes[i], false);
+
+    if (write_rate < 0 || read_rate < 0){
+      fprintf(stderr, "error, the transfers of %u bytes failed\n", sizes[i]);
+      bench_unmount();
+      return -1;
+    }
+    printf("%-6u KiB %12.2f %12.2f\n", sizes[i] / 1024, read_rate, write_rate);
+  }
+
+  bench_unmount();
+  return 0;
+}
+
+/* writes 4 MiB in aligned 1 KiB calls at random places of the first
+ * |span| bytes of the array through a cache of 1024 entries, in write-back
+ * mode or not, flushes, and prints the blocks sent to the device per block
+ * written */
+static int write_back_row(const char *name, uint32_t span, bool write_back) {
+  uint32_t state = 2463534242u;
+  int num_writes = 4096;
+
+  if (cache_create(1024) != 1 || (write_back && cache_set_write_back(true) != 1)){
+    fprintf(stderr, "error, failed to create the cache\n");
+    return -1;
+  }
+  if (bench_mount(1) != 1){
+    cache_destroy();
+    return -1;
+  }
+
+  uint64_t start = stats_now();
+  for (int i = 0; i < num_writes; i++){
+    uint32_t addr = next_random(&state) % (span / 1024) * 1024;
+
+    if (mdadm_write(addr, 1024, buf + addr) != 1024){
+      fprintf(stderr, "error, failed to write at %u\n", addr);
+      bench_unmount();
+      cache_destroy();
+      return -1;
+    }
+  }
+  //what is still dirty counts too
+  int flushed = mdadm_flush();
+  double elapsed = (stats_now() - start) / 1e9;
+
+  stats_snapshot_t snapshot;
+  stats_snapshot(&snapshot);
+  printf("%-26s %-14s %16.3f %10.2f\n", name, write_back ? "write-back" : "write-through",
+         snapshot.counters[STATS_BLOCKS_WRITTEN] / (num_writes * 4.0), num_writes / 1024.0 / elapsed);
+
+  bench_unmount();
+  cache_destroy();
+  return flushed == 1 ? 0 : -1;
+}
+
+static int bench_write_back(void) {
+  printf("%-26s %-14s %16s %10s\n", "4 MiB of 1 KiB writes", "cache", "device blocks/block", "MiB/s");
+  if (write_back_row("hot 64 KiB", 64 * 1024, false) != 0 ||
+      write_back_row("hot 64 KiB", 64 * 1024, true) != 0 ||
+      write_back_row("whole array", MDADM_ARRAY_SIZE, false) != 0 ||
+      write_back_row("whole array", MDADM_ARRAY_SIZE, true) != 0){
+    return -1;
+  }
+  return 0;
+}
+
+//the resident set of the process in KiB, or -1
+static long resident_kib(void) {
+  FILE *statm = fopen("/proc/self/statm", "r");
+  long size, resident;
+
+  if (statm == NULL){
+    return -1;
+  }
+  int matched = fscanf(statm, "%ld %ld", &size, &resident);
+  fclose(statm);
+  return matched == 2 ? resident * (sysconf(_SC_PAGESIZE) / 1024) : -1;
+}
+
+/* fills the array so that 1 block in |spread| holds data and the rest are
+ * zeros, then reads its first half twice through a cache as large as the
+ * array, as the shards do not fill evenly. prints the memory the cache took
+ * on, the bytes received per block and the MiB/s of the second read, served
+ * from the cache. */
+static int sparse_row(int spread) {
+  uint32_t state = 88675123u;
+  uint32_t span = MDADM_ARRAY_SIZE / 2;
+  int num_blocks = MDADM_ARRAY_SIZE / JBOD_BLOCK_SIZE;
+
+  memset(buf, 0, MDADM_ARRAY_SIZE);
+  for (int block = 0; spread > 0 && block < num_blocks; block++){
+    if (next_random(&state) % spread != 0){
+      continue;
+    }
+    for (int byte = 0; byte < JBOD_BLOCK_SIZE; byte++){
+      buf[block * JBOD_BLOCK_SIZE + byte] = (uint8_t) (next_random(&state) | 1);
+    }
+  }
+
+  if (bench_mount(1) != 1){
+    return -1;
+  }
+  if (mdadm_write_large(0, MDADM_ARRAY_SIZE, buf) != MDADM_ARRAY_SIZE || cache_create(num_blocks) != 1){
+    fprintf(stderr, "error, failed to fill the array\n");
+    bench_unmount();
+    return -1;
+  }
+
+  long before = resident_kib();
+  stats_reset();
+  int result = mdadm_read_large(0, span, buf);
+  stats_snapshot_t snapshot;
+  stats_snapshot(&snapshot);
+
+  uint64_t start = stats_now();
+  if (result == (int) span){
+    result = mdadm_read_large(0, span, buf);
+  }
+  double elapsed = (stats_now() - start) / 1e9;
+  long after = resident_kib();
+
+  if (result == (int) span){
+    char density[16];
+    snprintf(density, sizeof(density), spread > 0 ? "1 in %d" : "none", spread);
+    printf("%-14s %12ld %12.1f %12.1f %12.1f\n", density, after - before,
+           snapshot.counters[STATS_BYTES_RECEIVED] / (span / (double) JBOD_BLOCK_SIZE),
+           100.0 * snapshot.counters[STATS_ZERO_BLOCKS_CACHED] / (span / JBOD_BLOCK_SIZE), span / (1024.0 * 1024.0) / elapsed);
+  }
+
+  cache_destroy();
+  bench_unmount();
+  return result == (int) span ? 0 : -1;
+}
+
+static int bench_sparse(void) {
+  const int spreads[] = { 1, 4, 16, 0 };
+
+  printf("%-14s %12s %12s %12s %12s\n", "data blocks", "cache KiB", "bytes/block", "zero %", "hit MiB/s");
+  for (int i = 0; i < 4; i++){
+    if (sparse_row(spreads[i]) != 0){
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* reads the first half of the array with integrity checks on or off, four
+ * times from the device into a fresh cache and 16 times from the cache, and
+ * stores the MiB/s of either in |rates| */
+static int checksum_rates(bool checked, double *rates) {
+  uint32_t span = MDADM_ARRAY_SIZE / 2;
+  uint64_t elapsed[2] = { 0, 0 };
+  int result = span;
+
+  if (mdadm_set_verify(checked) != 1 || bench_mount(1) != 1){
+    return -1;
+  }
+  if (mdadm_write_large(0, MDADM_ARRAY_SIZE, buf) != MDADM_ARRAY_SIZE){
+    fprintf(stderr, "error, failed to fill the array\n");
+    result = -1;
+  }
+
+  for (int round = 0; round < 4 && result == (int) span; round++){
+    if (cache_create(MDADM_ARRAY_SIZE / JBOD_BLOCK_SIZE) != 1){
+      result = -1;
+      break;
+    }
+
+    uint64_t start = stats_now();
+    result = mdadm_read_large(0, span, buf);
+    elapsed[0] += stats_now() - start;
+
+    start = stats_now();
+    for (int pass = 0; pass < 4 && result == (int) span; pass++){
+      result = mdadm_read_large(0, span, buf);
+    }
+    elapsed[1] += stats_now() - start;
+    cache_destroy();
+  }
+
+  bench_unmount();
+  mdadm_set_verify(false);
+  rates[0] = 4 * span / (1024.0 * 1024.0) / (elapsed[0] / 1e9);
+  rates[1] = 16 * span / (1024.0 * 1024.0) / (elapsed[1] / 1e9);
+  return result == (int) span ? 0 : -1;
+}
+
+static int bench_checksum(void) {
+  uint32_t state = 3141592653u;
+  int num_blocks = MDADM_ARRAY_SIZE / JBOD_BLOCK_SIZE;
+  double rates[2][2];
+
+  for (int i = 0; i < MDADM_ARRAY_SIZE; i++){
+    buf[i] = (uint8_t) next_random(&state);
+  }
+
+  //the CRC32C kernel on its own
+  uint32_t crc = 0;
+  uint64_t start = stats_now();
+  for (int round = 0; round < 64; round++){
+    for (int block = 0; block < num_blocks; block++){
+      crc += block_crc32c(buf + block * JBOD_BLOCK_SIZE);
+    }
+  }
+  double ns_per_block = (stats_now() - start) / (64.0 * num_blocks);
+
+  if (checksum_rates(false, rates[0]) != 0 || checksum_rates(true, rates[1]) != 0){
+    fprintf(stderr, "error, the reads failed\n");
+    return -1;
+  }
+
+  printf("block_crc32c %.1f ns per block (%08x)\n", ns_per_block, crc);
+  printf("%-16s %12s %12s\n", "reads", "device MiB/s", "cache MiB/s");
+  printf("%-16s %12.2f %12.2f\n", "unchecked", rates[0][0], rates[0][1]);
+  printf("%-16s %12.2f %12.2f\n", "checked", rates[1][0], rates[1][1]);
+  printf("%-16s %11.1f%% %11.1f%%\n", "overhead", 100 * (1 - rates[1][0] / rates[0][0]), 100 * (1 - rates[1][1] / rates[0][1]));
+  return 0;
+}
+
+//the parity kernel's baseline, one byte at a time
+static void scalar_xor(uint8_t *dst, const uint8_t *src) {
+  for (int i = 0; i < JBOD_BLOCK_SIZE; i++){
+    dst[i] ^= src[i];
+  }
+}
+
+//computes the parity of 15 data blocks 4096 times with |xor| and returns the MiB of data per second
+static double parity_rate(void (*xor)(uint8_t *, const uint8_t *)) {
+  uint8_t parity[JBOD_BLOCK_SIZE];
+  int rounds = 4096;
+  uint64_t start = stats_now();
+
+  for (int round = 0; round < rounds; round++){
+    memcpy(parity, buf, JBOD_BLOCK_SIZE);
+    for (int disk = 1; disk < JBOD_NUM_DISKS - 1; disk++){
+      xor(parity, buf + disk * JBOD_BLOCK_SIZE);
+    }
+    buf[round % JBOD_BLOCK_SIZE] ^= parity[round % JBOD_BLOCK_SIZE];
+  }
+  return rounds * (JBOD_NUM_DISKS - 1) * (JBOD_BLOCK_SIZE / (1024.0 * 1024.0)) / ((stats_now() - start) / 1e9);
+}
+
+/* writes 4 MiB to a RAID5 array with a stripe unit of 16 blocks, in calls of
+ * |size| bytes at random multiples of |size|. prints the MiB/s, the jbod
+ * commands per MiB and the parity groups written whole and updated by
+ * read-modify-write per MiB. */
+static int parity_write_row(const char *name, uint32_t size) {
+  uint32_t state = 1234567u;
+  uint32_t total = 4 * 1024 * 1024;
+
+  if (bench_mount_layout(1, MDADM_LAYOUT_RAID5, 16) != 1){
+    return -1;
+  }
+
+  uint32_t slots = mdadm_array_size() / size;
+  uint64_t start = stats_now();
+  for (uint32_t written = 0; written < total; written += size){
+    uint32_t addr = next_random(&state) % slots * size;
+
+    if (mdadm_write_large(addr, size, buf + addr % (MDADM_ARRAY_SIZE - size)) != (int) size){
+      fprintf(stderr, "error, failed to write %u bytes at %u\n", size, addr);
+      bench_unmount();
+      return -1;
+    }
+  }
+  double elapsed = (stats_now() - start) / 1e9;
+
+  stats_snapshot_t snapshot;
+  stats_snapshot(&snapshot);
+  printf("%-22s %10.2f %14.0f %12.0f %12.0f\n", name, 4 / elapsed, jbod_commands() / 4.0,
+         snapshot.counters[STATS_PARITY_FULL_STRIPES] / 4.0, snapshot.counters[STATS_PARITY_RMW] / 4.0);
+
+  bench_unmount();
+  return 0;
+}
+
+static int bench_parity(void) {
+  uint32_t state = 2718281828u;
+
+  for (int i = 0; i < MDADM_ARRAY_SIZE; i++){
+    buf[i] = (uint8_t) next_random(&state);
+  }
+
+  double scalar = parity_rate(scalar_xor);
+  double kernel = parity_rate(block_xor);
+  printf("%-22s %10s\n", "parity of 15 blocks", "MiB/s");
+  printf("%-22s %10.1f\n", "scalar, byte by byte", scalar);
+  printf("%-22s %10.1f %.1fx\n", "block_xor", kernel, kernel / scalar);
+
+  //a stripe row is the stripe unit of each of the 15 data disks
+  printf("\n%-22s %10s %14s %12s %12s\n", "RAID5 writes of 4 MiB", "MiB/s", "commands/MiB", "full/MiB", "rmw/MiB");
+  if (parity_write_row("full stripe rows", 15 * 16 * JBOD_BLOCK_SIZE) != 0 ||
+      parity_write_row("single blocks", JBOD_BLOCK_SIZE) != 0){
+    return -1;
+  }
+  return 0;
+}
+
+/* reads or writes 256 batches of 64 extents of 1 to 1024 bytes at random
+ * offsets, one mdadm_read_large/mdadm_write_large call per extent in arrival
+ * order or one mdadm_readv/mdadm_writev call per batch. prints the seeks,
+ * jbod commands and round trips per batch and the ms a batch takes. */
+static int vector_row(const char *name, bool is_write, bool vectored) {
+  uint32_t state = 0x9e3779b9u;
+  int num_batches = 256;
+  mdadm_extent_t extents[64];
+
+  if (bench_mount(1) != 1){
+    return -1;
+  }
+
+  uint64_t start = stats_now();
+  for (int batch = 0; batch < num_batches; batch++){
+    for (int i = 0; i < 64; i++){
+      extents[i].len = 1 + next_random(&state) % 1024;
+      extents[i].addr = next_random(&state) % (MDADM_ARRAY_SIZE - extents[i].len);
+      extents[i].buf = buf + extents[i].addr;
+    }
+
+    bool failed = false;
+    if (vectored){
+      failed = (is_write ? mdadm_writev(extents, 64) : mdadm_readv(extents, 64)) == -1;
+    }
+    for (int i = 0; !vectored && i < 64 && !failed; i++){
+      int result = is_write ? mdadm_write_large(extents[i].addr, extents[i].len, extents[i].buf) :
+                              mdadm_read_large(extents[i].addr, extents[i].len, extents[i].buf);
+      failed = result != (int) extents[i].len;
+    }
+    if (failed){
+      fprintf(stderr, "error, batch %d failed\n", batch);
+      bench_unmount();
+      return -1;
+    }
+  }
+  double elapsed = (stats_now() - start) / 1e6;
+
+  stats_snapshot_t snapshot;
+  stats_snapshot(&snapshot);
+  printf("%-28s %12.1f %12.1f %12.1f %10.2f\n", name, snapshot.counters[STATS_SEEKS_ISSUED] / (double) num_batches,
+         jbod_commands() / (double) num_batches, snapshot.counters[STATS_ROUND_TRIPS] / (double) num_batches, elapsed / num_batches);
+
+  bench_unmount();
+  return 0;
+}
+
+static int bench_vector(void) {
+  printf("%-28s %12s %12s %12s %10s\n", "batches of 64 extents", "seeks", "commands", "round trips", "ms");
+  if (vector_row("mdadm_read in arrival order", false, false) != 0 ||
+      vector_row("mdadm_readv", false, true) != 0 ||
+      vector_row("mdadm_write in arrival order", true, false) != 0 ||
+      vector_row("mdadm_writev", true, true) != 0){
+    return -1;
+  }
+  return 0;
+}
+
+/* a herd of threads that read 4 KiB of the same cold region at once, each
+ * |shift| bytes further in than the one before it */
+typedef struct {
+  pthread_barrier_t *barrier;
+  int index;
+  uint32_t shift;
+  int rounds;
+  bool failed;
+} herd_thread_t;
+
+static void *herd_main(void *arg) {
+  herd_thread_t *thread = (herd_thread_t*) arg;
+  uint8_t data[4096];
+
+  for (int round = 0; round < thread->rounds; round++){
+    uint32_t addr = round * 8192 + thread->index * thread->shift;
+
+    pthread_barrier_wait(thread->barrier);
+    if (mdadm_read_large(addr, sizeof(data), data) != (int) sizeof(data) || memcmp(data, buf + addr, sizeof(data)) != 0){
+      thread->failed = true;
+    }
+    pthread_barrier_wait(thread->barrier);
+  }
+  return NULL;
+}
+
+//runs a herd of |num_threads| without a cache, so every round misses, and prints the device work per round
+static int herd_row(int num_threads, uint32_t shift) {
+  pthread_t threads[16];
+  herd_thread_t herd[16];
+  pthread_barrier_t barrier;
+  int rounds = 64;
+  bool failed = false;
+
+  if (bench_mount(1) != 1){
+    return -1;
+  }
+  if (mdadm_write_large(0, MDADM_ARRAY_SIZE, buf) != MDADM_ARRAY_SIZE){
+    fprintf(stderr, "error, failed to fill the array\n");
+    bench_unmount();
+    return -1;
+  }
+  stats_reset();
+
+  pthread_barrier_init(&barrier, NULL, num_threads);
+  uint64_t start = stats_now();
+  for (int i = 0; i < num_threads; i++){
+    herd[i] = (herd_thread_t) { .barrier = &barrier, .index = i, .shift = shift, .rounds = rounds, .failed = false };
+    pthread_create(&threads[i], NULL, herd_main, &herd[i]);
+  }
+  for (int i = 0; i < num_threads; i++){
+    pthread_join(threads[i], NULL);
+    failed |= herd[i].failed;
+  }
+  double elapsed = (stats_now() - start) / 1e3;
+  pthread_barrier_destroy(&barrier);
+
+  //the blocks a round asks for, one read at a time each would fetch all of its own
+  int num_blocks = 0;
+  for (int i = 0; i < num_threads; i++){
+    num_blocks += (i * shift + 4096 - 1) / JBOD_BLOCK_SIZE - i * shift / JBOD_BLOCK_SIZE + 1;
+  }
+
+  stats_snapshot_t snapshot;
+  stats_snapshot(&snapshot);
+  if (!failed){
+    printf("%-8d %-10u %14d %14.1f %14.1f %12.1f\n", num_threads, shift, num_blocks, jbod_commands() / (double) rounds,
+           snapshot.counters[STATS_READS_COALESCED] / (double) rounds, elapsed / rounds);
+  }
+
+  bench_unmount();
+  if (failed){
+    fprintf(stderr, "error, a read of the herd of %d returned the wrong bytes\n", num_threads);
+    return -1;
+  }
+  return 0;
+}
+
+static int bench_herd(void) {
+  const int sizes[] = { 1, 4, 16 };
+  uint32_t state = 1618033988u;
+
+  for (int i = 0; i < MDADM_ARRAY_SIZE; i++){
+    buf[i] = (uint8_t) next_random(&state);
+  }
+
+  printf("%-8s %-10s %14s %14s %14s %12s\n", "threads", "shift", "blocks asked", "commands", "blocks shared", "us");
+  for (int i = 0; i < 3; i++){
+    if (herd_row(sizes[i], 0) != 0){
+      return -1;
+    }
+  }
+  for (int i = 1; i < 3; i++){
+    if (herd_row(sizes[i], 100) != 0){
+      return -1;
+    }
+  }
+  return 0;
+}
+
+typedef struct {
+  const char *name;
+  const char *help;
+  int (*run)(void);
+} bench_mode_t;
+
+static const bench_mode_t modes[] = {
+  { "cache", "lookups and inserts per entry count, the old array scan against the hashed cache", bench_cache },
+  { "policies", "cache hit rates of the eviction policies on hot set, scan and loop workloads", bench_policies },
+  { "write-ops", "jbod commands per MiB written in 1 KiB calls, read-modify-write of every block against mdadm_write", bench_write_ops },
+  { "pipeline", "jbod commands per second one at a time and pipelined 1, 4, 16 and 64 deep", bench_pipeline },
+  { "syscalls", "socket syscalls per block reading the array, the old packet layer against the current one", bench_syscalls },
+  { "pool", "MiB/s reading the array over 1 to 16 connections, more than 1 needs server.c", bench_pool },
+  { "large", "sequential MiB/s in transfers of 1 KiB, the old limit, and of 4 KiB, 64 KiB and 1 MiB", bench_large },
+  { "writeback", "device blocks written per block written, write-through against write-back", bench_write_back },
+  { "sparse", "cache memory, bytes received per block and cached MiB/s reading arrays of 1 in 1, 4 and 16 data blocks and of none", bench_sparse },
+  { "checksum", "read MiB/s from the device and from the cache with integrity checks off and on", bench_checksum },
+  { "parity", "RAID5 parity MiB/s of block_xor against a scalar loop, and full stripe row writes against read-modify-write", bench_parity },
+  { "vector", "seeks, commands and round trips per batch of 64 random extents, one call each against mdadm_readv and mdadm_writev", bench_vector },
+  { "herd", "jbod commands per round of up to 16 threads reading the same cold 4 KiB at once, and blocks one read provided another", bench_herd },
+};
+
+#define NUM_MODES ((int) (sizeof(modes) / sizeof(modes[0])))
+
+//split |arg| of the form ip:port into |node|, which keeps pointing into |arg|
+static int parse_node(char *arg, jbod_node_t *node) {
+  char *colon = strrchr(arg, ':');
+
+  if (colon == NULL || atoi(colon + 1) <= 0 || atoi(colon + 1) > 65535){
+    return -1;
+  }
+  *colon = '\0';
+  node->ip = arg;
+  node->port = (uint16_t) atoi(colon + 1);
+  return 1;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [-e ip:port] mode\n"
+          "  -e  use the server at this address instead of the default one\n"
+          "modes:\n", prog);
+  for (int i = 0; i < NUM_MODES; i++){
+    fprintf(stderr, "  %-10s %s\n", modes[i].name, modes[i].help);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+
+  while ((opt = getopt(argc, argv, "e:")) != -1){
+    switch (opt){
+      case 'e':
+        if (parse_node(optarg, &server) != 1){
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (optind != argc - 1){
+    usage(argv[0]);
+    return 1;
+  }
+
+  for (int i = 0; i < NUM_MODES; i++){
+    if (strcmp(argv[optind], modes[i].name) == 0){
+      return modes[i].run() == 0 ? 0 : 1;
+    }
+  }
+
+  usage(argv[0]);
+  return 1;
+}
@@ -0,0 +1,212 @@
+#include <string.h>
+#include <pthread.h>
+#include "block.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+/* a block is checked a cache line (64 bytes) at a time: the loads of one line
+ * are or-ed together and the first line with a set bit ends the scan, which
+ * for data blocks is usually the first one. */
+#define LINE_SIZE 64
+
+bool block_is_zero(const uint8_t *block) {
+#if defined(__SSE2__)
+  for (int i = 0; i < JBOD_BLOCK_SIZE; i += LINE_SIZE){
+    __m128i line = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i *) (block + i)), _mm_loadu_si128((const __m128i *) (block + i + 16))),
+                                _mm_or_si128(_mm_loadu_si128((const __m128i *) (block + i + 32)), _mm_loadu_si128((const __m128i *) (block + i + 48))));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(line, _mm_setzero_si128())) != 0xffff){
+      return false;
+    }
+  }
+  return true;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  for (int i = 0; i < JBOD_BLOCK_SIZE; i += LINE_SIZE){
+    uint8x16_t line = vorrq_u8(vorrq_u8(vld1q_u8(block + i), vld1q_u8(block + i + 16)), vorrq_u8(vld1q_u8(block + i + 32), vld1q_u8(block + i + 48)));
+    if (vmaxvq_u8(line) != 0){
+      return false;
+    }
+  }
+  return true;
+#else
+  for (int i = 0; i < JBOD_BLOCK_SIZE; i += LINE_SIZE){
+    uint64_t words[LINE_SIZE / sizeof(uint64_t)];
+    uint64_t line = 0;
+
+    memcpy(words, block + i, LINE_SIZE);
+    for (size_t w = 0; w < LINE_SIZE / sizeof(uint64_t); w++){
+      line |= words[w];
+    }
+    if (line != 0){
+      return false;
+    }
+  }
+  return true;
+#endif
+}
+
+#if defined(__x86_64__)
+//built for AVX2 on its own like crc32c_sse42, a block is eight 32-byte registers
+__attribute__((target("avx2"))) static void xor_avx2(uint8_t *dst, const uint8_t *src) {
+  for (int i = 0; i < JBOD_BLOCK_SIZE; i += 4 * sizeof(__m256i)){
+    __m256i a0 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (dst + i)), _mm256_loadu_si256((const __m256i *) (src + i)));
+    __m256i a1 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (dst + i + 32)), _mm256_loadu_si256((const __m256i *) (src + i + 32)));
+    __m256i a2 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (dst + i + 64)), _mm256_loadu_si256((const __m256i *) (src + i + 64)));
+    __m256i a3 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (dst + i + 96)), _mm256_loadu_si256((const __m256i *) (src + i + 96)));
+    _mm256_storeu_si256((__m256i *) (dst + i), a0);
+    _mm256_storeu_si256((__m256i *) (dst + i + 32), a1);
+    _mm256_storeu_si256((__m256i *) (dst + i + 64), a2);
+    _mm256_storeu_si256((__m256i *) (dst + i + 96), a3);
+  }
+}
+#endif
+
+void block_xor(uint8_t *dst, const uint8_t *src) {
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("avx2")){
+    xor_avx2(dst, src);
+    return;
+  }
+#endif
+#if defined(__SSE2__)
+  for (int i = 0; i < JBOD_BLOCK_SIZE; i += LINE_SIZE){
+    __m128i a0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (dst + i)), _mm_loadu_si128((const __m128i *) (src + i)));
+    __m128i a1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (dst + i + 16)), _mm_loadu_si128((const __m128i *) (src + i + 16)));
+    __m128i a2 = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (dst + i + 32)), _mm_loadu_si128((const __m128i *) (src + i + 32)));
+    __m128i a3 = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (dst + i + 48)), _mm_loadu_si128((const __m128i *) (src + i + 48)));
+    _mm_storeu_si128((__m128i *) (dst + i), a0);
+    _mm_storeu_si128((__m128i *) (dst + i + 16), a1);
+    _mm_storeu_si128((__m128i *) (dst + i + 32), a2);
+    _mm_storeu_si128((__m128i *) (dst + i + 48), a3);
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  for (int i = 0; i < JBOD_BLOCK_SIZE; i += LINE_SIZE){
+    uint8x16x4_t a = vld1q_u8_x4(dst + i);
+    uint8x16x4_t b = vld1q_u8_x4(src + i);
+    a.val[0] = veorq_u8(a.val[0], b.val[0]);
+    a.val[1] = veorq_u8(a.val[1], b.val[1]);
+    a.val[2] = veorq_u8(a.val[2], b.val[2]);
+    a.val[3] = veorq_u8(a.val[3], b.val[3]);
+    vst1q_u8_x4(dst + i, a);
+  }
+#else
+  for (int i = 0; i < JBOD_BLOCK_SIZE; i += sizeof(uint64_t)){
+    uint64_t a;
+    uint64_t b;
+    memcpy(&a, dst + i, sizeof(uint64_t));
+    memcpy(&b, src + i, sizeof(uint64_t));
+    a ^= b;
+    memcpy(dst + i, &a, sizeof(uint64_t));
+  }
+#endif
+}
+
+/* the reflected CRC32C polynomial, for the tables */
+#define CRC32C_POLY 0x82f63b78
+
+/* the CRC instructions take a few cycles each and every one depends on the
+ * previous, so with them a block is split into CRC_LANES lanes that are
+ * computed side by side and combined at the end: the CRC of a lane followed by
+ * n more bytes is the CRC of those bytes xor-ed with the lane's CRC advanced
+ * over n zero bytes, a linear map that shift_tables holds for each lane. */
+#define CRC_LANES 4
+#define LANE_SIZE (JBOD_BLOCK_SIZE / CRC_LANES)
+
+static uint32_t crc_table[256];
+static uint32_t shift_tables[CRC_LANES - 1][4][256]; /* [lanes that follow - 1][byte of the CRC][its value] */
+static pthread_once_t crc_tables_once = PTHREAD_ONCE_INIT;
+
+static void crc_tables_init(void) {
+  for (uint32_t i = 0; i < 256; i++){
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++){
+      crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+    }
+    crc_table[i] = crc;
+  }
+
+  for (int lanes = 1; lanes < CRC_LANES; lanes++){
+    for (int byte = 0; byte < 4; byte++){
+      for (uint32_t i = 0; i < 256; i++){
+        uint32_t crc = i << (8 * byte);
+        for (int zero = 0; zero < lanes * LANE_SIZE; zero++){
+          crc = (crc >> 8) ^ crc_table[crc & 0xff];
+        }
+        shift_tables[lanes - 1][byte][i] = crc;
+      }
+    }
+  }
+}
+
+//advances |crc| over the bytes of |lanes| lanes of zeros
+static inline uint32_t crc_shift(int lanes, uint32_t crc) {
+  const uint32_t (*shift)[256] = shift_tables[lanes - 1];
+  return shift[0][crc & 0xff] ^ shift[1][(crc >> 8) & 0xff] ^ shift[2][(crc >> 16) & 0xff] ^ shift[3][crc >> 24];
+}
+
+//combines the CRCs of the lanes of a block, the first lane started from ~0 and the others from 0
+static inline uint32_t crc_combine(uint32_t crc0, uint32_t crc1, uint32_t crc2, uint32_t crc3) {
+  return ~(crc_shift(3, crc0) ^ crc_shift(2, crc1) ^ crc_shift(1, crc2) ^ crc3);
+}
+
+static inline uint64_t load_word(const uint8_t *bytes) {
+  uint64_t word;
+  memcpy(&word, bytes, sizeof(uint64_t));
+  return word;
+}
+
+static uint32_t crc32c_table(const uint8_t *block) {
+  uint32_t crc = ~0u;
+
+  for (int i = 0; i < JBOD_BLOCK_SIZE; i++){
+    crc = (crc >> 8) ^ crc_table[(crc ^ block[i]) & 0xff];
+  }
+  return ~crc;
+}
+
+#if defined(__x86_64__)
+//built for SSE4.2 on its own, the rest of the client does not require it
+__attribute__((target("sse4.2"))) static uint32_t crc32c_sse42(const uint8_t *block) {
+  uint64_t crc0 = ~0u, crc1 = 0, crc2 = 0, crc3 = 0;
+
+  for (int i = 0; i < LANE_SIZE; i += sizeof(uint64_t)){
+    crc0 = _mm_crc32_u64(crc0, load_word(block + i));
+    crc1 = _mm_crc32_u64(crc1, load_word(block + LANE_SIZE + i));
+    crc2 = _mm_crc32_u64(crc2, load_word(block + 2 * LANE_SIZE + i));
+    crc3 = _mm_crc32_u64(crc3, load_word(block + 3 * LANE_SIZE + i));
+  }
+  return crc_combine(crc0, crc1, crc2, crc3);
+}
+#elif defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32c_armv8(const uint8_t *block) {
+  uint32_t crc0 = ~0u, crc1 = 0, crc2 = 0, crc3 = 0;
+
+  for (int i = 0; i < LANE_SIZE; i += sizeof(uint64_t)){
+    crc0 = __crc32cd(crc0, load_word(block + i));
+    crc1 = __crc32cd(crc1, load_word(block + LANE_SIZE + i));
+    crc2 = __crc32cd(crc2, load_word(block + 2 * LANE_SIZE + i));
+    crc3 = __crc32cd(crc3, load_word(block + 3 * LANE_SIZE + i));
+  }
+  return crc_combine(crc0, crc1, crc2, crc3);
+}
+#endif
+
+uint32_t block_crc32c(const uint8_t *block) {
+  pthread_once(&crc_tables_once, crc_tables_init);
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("sse4.2")){
+    return crc32c_sse42(block);
+  }
+#elif defined(__ARM_FEATURE_CRC32)
+  return crc32c_armv8(block);
+#endif
+  return crc32c_table(block);
+}
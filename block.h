@@ -0,0 +1,22 @@
+#ifndef BLOCK_H_
+#define BLOCK_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "jbod.h"
+
+/* Returns true if all JBOD_BLOCK_SIZE bytes of |block| are zero. Uses SSE2 or
+ * NEON where the target has them and 64-bit words otherwise. */
+bool block_is_zero(const uint8_t *block);
+
+/* Xors the JBOD_BLOCK_SIZE bytes of |src| into |dst|. Uses AVX2 where the CPU
+ * has it, SSE2 or NEON where the target has them and 64-bit words otherwise. */
+void block_xor(uint8_t *dst, const uint8_t *src);
+
+/* Returns the CRC32C (Castagnoli) of the JBOD_BLOCK_SIZE bytes of |block|.
+ * Uses the SSE4.2 or ARMv8 CRC instructions where the CPU has them and a
+ * lookup table otherwise. */
+uint32_t block_crc32c(const uint8_t *block);
+
+#endif
@@ -1,18 +1,637 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/mman.h>
 #include "cache.h"
+#include "block.h"
+#include "net.h"
+#include "stats.h"
 
-static cache_entry_t *cache = NULL;
-static int cache_size = 0;
-static int clock = 0;
-static int num_queries = 0;
-static int num_hits = 0;
+/* the cache is split into shards so threads working on different blocks do
+ * not contend on one lock. a shard owns a slice of the entries together with
+ * its own hash index and eviction lists, so the policy (see cache_policy_t)
+ * applies within the shard. caches smaller than CACHE_ENTRIES_PER_SHARD * 2
+ * use a single shard and see the exact policy.
+ *
+ * in write-back mode a written block is only marked dirty, and the device is
+ * updated later by the flush in mdadm. dirty entries sit on a list of their
+ * own so eviction, which only takes clean entries, never drops data that has
+ * not reached the device yet. */
+#define CACHE_MAX_SHARDS 16
+#define CACHE_ENTRIES_PER_SHARD 256
 
-static int is_created = -1;
+#define CACHE_PAGE_SIZE 4096
+#define CACHE_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/* the intrusive lists an entry can be on. LRU keeps every clean entry on
+ * LIST_RECENT in recency order and CLOCK in insertion order, the tail being
+ * under the hand. 2Q uses LIST_RECENT as its FIFO of new blocks (A1in) and
+ * LIST_FREQUENT as the LRU of reused ones (Am). ARC calls them T1 and T2. */
+enum { LIST_RECENT, LIST_FREQUENT, LIST_DIRTY, NUM_LISTS };
+
+/* 2Q remembers the keys evicted from its FIFO (A1out) in GHOST_RECENT, ARC
+ * the keys evicted from T1 and T2 in GHOST_RECENT and GHOST_FREQUENT (B1 and
+ * B2). a miss on a remembered key is treated as reuse. */
+enum { GHOST_RECENT, GHOST_FREQUENT, NUM_GHOST_LISTS };
+
+/* the key and age of entries[i] are keys[i]. lookups walk hash chains through
+ * this array alone, four records to a cache line, and only touch the entry
+ * they find. */
+typedef struct {
+  uint32_t key;         /* disk_num * JBOD_NUM_BLOCKS_PER_DISK + block_num, CACHE_NO_KEY for no block */
+  int hash_next;        /* next entry in the same hash bucket, -1 ends the chain */
+  uint64_t access_time; /* the access clock at the entry's last use, resize keeps the latest */
+} cache_key_t;
+
+/* the key of an entry that holds nothing, see cache_drop */
+#define CACHE_NO_KEY UINT32_MAX
+
+typedef struct {
+  uint32_t key;  /* disk_num * JBOD_NUM_BLOCKS_PER_DISK + block_num */
+  int list;      /* ghost list, -1 while the ghost is free */
+  int prev;
+  int next;
+  int hash_next;
+} cache_ghost_t;
+
+typedef struct {
+  pthread_mutex_t lock;
+
+  cache_entry_t *entries;
+  cache_key_t *keys;
+  int size;
+
+  /* the shard's |size| payload slots of JBOD_BLOCK_SIZE bytes each. entries[i]
+   * holds slot entries[i].slot, an all-zero block holds none. free_slots is a
+   * stack of the slots no entry holds, the lowest on top, so the slots in use
+   * stay packed at the front of the arena. */
+  uint8_t *payloads;
+  int *free_slots;
+  int num_free_slots;
+
+  /* entries [0, num_used) have been handed out, the rest are still free.
+   * free_head starts a stack of handed out entries that cache_drop took back,
+   * chained through cache_entry_t.lru_next and on no list. */
+  int num_used;
+  int free_head;
+
+  /* hash index: buckets[h] is the first entry whose key hashes to h, chained
+   * through cache_key_t.hash_next. num_buckets is a power of two. */
+  int *buckets;
+  int num_buckets;
+
+  /* intrusive lists threaded through cache_entry_t.lru_prev/lru_next, the
+   * head is the most recent end and the tail the one eviction looks at */
+  int heads[NUM_LISTS];
+  int tails[NUM_LISTS];
+  int counts[NUM_LISTS];
+
+  /* 2Q and ARC only: the keys of evicted entries, hashed into ghost_buckets
+   * like the entries, and ARC's adaptive target size for LIST_RECENT */
+  cache_ghost_t *ghosts;
+  int *ghost_buckets;
+  int ghost_heads[NUM_GHOST_LISTS];
+  int ghost_tails[NUM_GHOST_LISTS];
+  int ghost_counts[NUM_GHOST_LISTS];
+  int ghost_free;
+  int target_recent;
+} cache_shard_t;
+
+static cache_shard_t *shards = NULL;
+static int num_shards = 0;
+static cache_policy_t policy = CACHE_POLICY_LRU;
+
+static uint8_t *arena = NULL;
+static size_t arena_bytes = 0;
+
+static atomic_uint_fast64_t access_clock = 0;
+static atomic_int num_queries = 0;
+static atomic_int num_hits = 0;
+static atomic_int num_coalesced = 0;
+
+/* readahead accounting: blocks inserted by cache_prefetch, the ones a lookup
+ * then asked for, and the ones evicted before anybody did */
+static atomic_int num_prefetched = 0;
+static atomic_int num_prefetch_hits = 0;
+static atomic_int num_prefetch_wasted = 0;
+
+static atomic_bool write_back = false;
+static atomic_bool checksums = false;
+
+static atomic_int is_created = -1;
+
+
+static uint32_t cache_key(int disk_num, int block_num) {
+  return (uint32_t) disk_num * JBOD_NUM_BLOCKS_PER_DISK + (uint32_t) block_num;
+}
+
+//mix a key, the low bits pick the bucket and the high bits the shard
+static uint32_t cache_key_hash(uint32_t key) {
+  return key * 2654435761u;
+}
+
+static cache_shard_t *cache_shard(int disk_num, int block_num) {
+  return &shards[(cache_key_hash(cache_key(disk_num, block_num)) >> 24) & (num_shards - 1)];
+}
+
+static int cache_bucket(cache_shard_t *shard, uint32_t key) {
+  return (int) (cache_key_hash(key) >> 7) & (shard->num_buckets - 1);
+}
+
+//return the index of the entry holding the key, or -1 if it is not cached
+static int cache_find(cache_shard_t *shard, int disk_num, int block_num) {
+  uint32_t key = cache_key(disk_num, block_num);
+  int index = shard->buckets[cache_bucket(shard, key)];
+
+  while (index != -1 && shard->keys[index].key != key){
+    index = shard->keys[index].hash_next;
+  }
+
+  return index;
+}
+
+static void hash_add(cache_shard_t *shard, int index) {
+  int bucket = cache_bucket(shard, shard->keys[index].key);
+  shard->keys[index].hash_next = shard->buckets[bucket];
+  shard->buckets[bucket] = index;
+}
+
+//unlink the entry from its hash chain, one that holds no key is on none
+static void hash_remove(cache_shard_t *shard, int index) {
+  if (shard->keys[index].key == CACHE_NO_KEY){
+    return;
+  }
+
+  int *link = &shard->buckets[cache_bucket(shard, shard->keys[index].key)];
+  while (*link != -1){
+    if (*link == index){
+      *link = shard->keys[index].hash_next;
+      shard->keys[index].hash_next = -1;
+      return;
+    }
+    link = &shard->keys[*link].hash_next;
+  }
+}
+
+static void list_unlink(cache_shard_t *shard, int index) {
+  cache_entry_t *entries = shard->entries;
+  int list = entries[index].list;
+  int prev = entries[index].lru_prev;
+  int next = entries[index].lru_next;
+
+  if (prev != -1){
+    entries[prev].lru_next = next;
+  }
+  else{
+    shard->heads[list] = next;
+  }
+
+  if (next != -1){
+    entries[next].lru_prev = prev;
+  }
+  else{
+    shard->tails[list] = prev;
+  }
+
+  entries[index].lru_prev = -1;
+  entries[index].lru_next = -1;
+  shard->counts[list] --;
+}
+
+static void list_push_front(cache_shard_t *shard, int index, int list) {
+  cache_entry_t *entries = shard->entries;
+
+  entries[index].list = list;
+  entries[index].lru_prev = -1;
+  entries[index].lru_next = shard->heads[list];
+
+  if (shard->heads[list] != -1){
+    entries[shard->heads[list]].lru_prev = index;
+  }
+  shard->heads[list] = index;
+
+  if (shard->tails[list] == -1){
+    shard->tails[list] = index;
+  }
+  shard->counts[list] ++;
+}
+
+static uint8_t *cache_block(cache_shard_t *shard, int index) {
+  return shard->payloads + (size_t) shard->entries[index].slot * JBOD_BLOCK_SIZE;
+}
+
+//give entry |index| a payload slot if it has none, there is one for every entry
+static void slot_take(cache_shard_t *shard, int index) {
+  if (shard->entries[index].slot == -1){
+    shard->num_free_slots --;
+    shard->entries[index].slot = shard->free_slots[shard->num_free_slots];
+  }
+}
+
+//return the payload slot of entry |index|, if it has one, to the free stack
+static void slot_release(cache_shard_t *shard, int index) {
+  if (shard->entries[index].slot != -1){
+    shard->free_slots[shard->num_free_slots] = shard->entries[index].slot;
+    shard->num_free_slots ++;
+    shard->entries[index].slot = -1;
+  }
+}
+
+//return the ghost holding |key|, or -1
+static int ghost_find(cache_shard_t *shard, uint32_t key) {
+  int index = shard->ghost_buckets[(key * 2654435761u >> 7) & (shard->num_buckets - 1)];
+
+  while (index != -1 && shard->ghosts[index].key != key){
+    index = shard->ghosts[index].hash_next;
+  }
+
+  return index;
+}
+
+static void ghost_remove(cache_shard_t *shard, int index) {
+  cache_ghost_t *ghost = &shard->ghosts[index];
+  int *link = &shard->ghost_buckets[(ghost->key * 2654435761u >> 7) & (shard->num_buckets - 1)];
+
+  while (*link != index){
+    link = &shard->ghosts[*link].hash_next;
+  }
+  *link = ghost->hash_next;
+
+  if (ghost->prev != -1){
+    shard->ghosts[ghost->prev].next = ghost->next;
+  }
+  else{
+    shard->ghost_heads[ghost->list] = ghost->next;
+  }
+  if (ghost->next != -1){
+    shard->ghosts[ghost->next].prev = ghost->prev;
+  }
+  else{
+    shard->ghost_tails[ghost->list] = ghost->prev;
+  }
+  shard->ghost_counts[ghost->list] --;
+
+  //the free ghosts are chained through next
+  ghost->list = -1;
+  ghost->next = shard->ghost_free;
+  shard->ghost_free = index;
+}
+
+//forget the oldest key of a ghost list
+static void ghost_drop_tail(cache_shard_t *shard, int list) {
+  if (shard->ghost_tails[list] != -1){
+    ghost_remove(shard, shard->ghost_tails[list]);
+  }
+}
+
+//remember the key of an evicted entry, the caller keeps the ghost lists within their bounds
+static void ghost_add(cache_shard_t *shard, int list, uint32_t key) {
+  if (shard->ghost_free == -1){
+    ghost_drop_tail(shard, shard->ghost_counts[GHOST_RECENT] >= shard->ghost_counts[GHOST_FREQUENT] ? GHOST_RECENT : GHOST_FREQUENT);
+  }
+
+  int index = shard->ghost_free;
+  cache_ghost_t *ghost = &shard->ghosts[index];
+  shard->ghost_free = ghost->next;
+
+  int bucket = (key * 2654435761u >> 7) & (shard->num_buckets - 1);
+  ghost->key = key;
+  ghost->list = list;
+  ghost->hash_next = shard->ghost_buckets[bucket];
+  shard->ghost_buckets[bucket] = index;
+
+  ghost->prev = -1;
+  ghost->next = shard->ghost_heads[list];
+  if (ghost->next != -1){
+    shard->ghosts[ghost->next].prev = index;
+  }
+  shard->ghost_heads[list] = index;
+  if (shard->ghost_tails[list] == -1){
+    shard->ghost_tails[list] = index;
+  }
+  shard->ghost_counts[list] ++;
+}
+
+//a clean entry was used again
+static void policy_hit(cache_shard_t *shard, int index) {
+  cache_entry_t *entry = &shard->entries[index];
+
+  switch (policy){
+    case CACHE_POLICY_CLOCK:
+      entry->referenced = true;
+      break;
+    case CACHE_POLICY_2Q:
+      //a block in the FIFO of new blocks is only promoted when it comes back after its eviction
+      if (entry->list == LIST_FREQUENT){
+        list_unlink(shard, index);
+        list_push_front(shard, index, LIST_FREQUENT);
+      }
+      break;
+    case CACHE_POLICY_ARC:
+      list_unlink(shard, index);
+      list_push_front(shard, index, LIST_FREQUENT);
+      break;
+    default:
+      list_unlink(shard, index);
+      list_push_front(shard, index, LIST_RECENT);
+      break;
+  }
+}
+
+//ARC moves its target size for LIST_RECENT towards the ghost list that was hit
+static void policy_adapt(cache_shard_t *shard, int ghost_list) {
+  int recent = shard->ghost_counts[GHOST_RECENT];
+  int frequent = shard->ghost_counts[GHOST_FREQUENT];
+
+  if (policy != CACHE_POLICY_ARC){
+    return;
+  }
+
+  if (ghost_list == GHOST_RECENT){
+    int delta = recent >= frequent ? 1 : frequent / recent;
+    shard->target_recent = shard->target_recent + delta < shard->size ? shard->target_recent + delta : shard->size;
+  }
+  else{
+    int delta = frequent >= recent ? 1 : recent / frequent;
+    shard->target_recent = shard->target_recent - delta > 0 ? shard->target_recent - delta : 0;
+  }
+}
+
+//return the clean entry to evict, or -1 if there is none, and remember its key when the policy keeps ghosts
+static int policy_victim(cache_shard_t *shard, int ghost_list) {
+  cache_entry_t *entries = shard->entries;
+  int recent = shard->tails[LIST_RECENT];
+  int frequent = shard->tails[LIST_FREQUENT];
+  int index;
+
+  switch (policy){
+    case CACHE_POLICY_CLOCK:
+      //second chance: a referenced entry under the hand is cleared and moved back to the head
+      while (shard->tails[LIST_RECENT] != -1 && entries[shard->tails[LIST_RECENT]].referenced){
+        index = shard->tails[LIST_RECENT];
+        entries[index].referenced = false;
+        list_unlink(shard, index);
+        list_push_front(shard, index, LIST_RECENT);
+      }
+      return shard->tails[LIST_RECENT];
+
+    case CACHE_POLICY_2Q:
+      //new blocks pass through a FIFO of a quarter of the shard, a scan never reaches LIST_FREQUENT
+      if (recent != -1 && (shard->counts[LIST_RECENT] > shard->size / 4 || frequent == -1)){
+        if (shard->ghost_counts[GHOST_RECENT] >= (shard->size / 2 > 1 ? shard->size / 2 : 1)){
+          ghost_drop_tail(shard, GHOST_RECENT);
+        }
+        ghost_add(shard, GHOST_RECENT, shard->keys[recent].key);
+        return recent;
+      }
+      return frequent;
+
+    case CACHE_POLICY_ARC:
+      if (recent != -1 && (frequent == -1 || shard->counts[LIST_RECENT] > shard->target_recent ||
+          (ghost_list == GHOST_FREQUENT && shard->counts[LIST_RECENT] == shard->target_recent))){
+        //keep the recent list and its ghosts within the shard size
+        if (shard->counts[LIST_RECENT] + shard->ghost_counts[GHOST_RECENT] >= shard->size){
+          ghost_drop_tail(shard, GHOST_RECENT);
+        }
+        index = recent;
+        ghost_list = GHOST_RECENT;
+      }
+      else if (frequent != -1){
+        index = frequent;
+        ghost_list = GHOST_FREQUENT;
+      }
+      else{
+        return -1;
+      }
+
+      //and all the ghosts within the shard size too
+      if (shard->ghost_counts[GHOST_RECENT] + shard->ghost_counts[GHOST_FREQUENT] >= shard->size){
+        ghost_drop_tail(shard, shard->ghost_counts[GHOST_FREQUENT] > 0 ? GHOST_FREQUENT : GHOST_RECENT);
+      }
+      ghost_add(shard, ghost_list, shard->keys[index].key);
+      return index;
+
+    default:
+      return recent;
+  }
+}
+
+//mark the entry as the most recently used one
+static void cache_touch(cache_shard_t *shard, int index) {
+  shard->keys[index].access_time = atomic_fetch_add(&access_clock, 1) + 1;
+
+  if (shard->entries[index].list == LIST_DIRTY){
+    list_unlink(shard, index);
+    list_push_front(shard, index, LIST_DIRTY);
+  }
+  else{
+    policy_hit(shard, index);
+  }
+}
+
+//move the entry to the dirty list, or back to the policy list it came from
+static void cache_set_dirty(cache_shard_t *shard, int index, bool dirty) {
+  cache_entry_t *entry = &shard->entries[index];
+
+  if (entry->dirty != dirty){
+    if (dirty){
+      entry->home = entry->list;
+    }
+    list_unlink(shard, index);
+    entry->dirty = dirty;
+    list_push_front(shard, index, dirty ? LIST_DIRTY : entry->home);
+  }
+}
+
+/* take a slot for a new key and index it: a free one, otherwise the policy
+ * evicts a clean entry. returns -1 when every entry of the shard is dirty. */
+static int cache_claim(cache_shard_t *shard, int disk_num, int block_num) {
+  int ghost_list = -1;
+  int index;
+
+  //a key that was evicted recently enough to be remembered counts as reused
+  if (shard->ghosts != NULL){
+    int ghost = ghost_find(shard, cache_key(disk_num, block_num));
+    if (ghost != -1){
+      ghost_list = shard->ghosts[ghost].list;
+      policy_adapt(shard, ghost_list);
+      ghost_remove(shard, ghost);
+    }
+  }
+
+  if (shard->free_head != -1){
+    index = shard->free_head;
+    shard->free_head = shard->entries[index].lru_next;
+  }
+  else if (shard->num_used < shard->size){
+    index = shard->num_used;
+    shard->num_used ++;
+    shard->entries[index].slot = -1;
+  }
+  else{
+    index = policy_victim(shard, ghost_list);
+    if (index == -1){
+      return -1;
+    }
+    hash_remove(shard, index);
+    list_unlink(shard, index);
+    stats_count(STATS_CACHE_EVICTIONS, 1);
+    if (shard->entries[index].prefetched){
+      num_prefetch_wasted ++;
+    }
+  }
+
+  cache_entry_t *entry = &shard->entries[index];
+  entry->dirty = false;
+  entry->prefetched = false;
+  entry->referenced = false;
+  shard->keys[index].key = cache_key(disk_num, block_num);
+  shard->keys[index].access_time = atomic_fetch_add(&access_clock, 1) + 1;
+  hash_add(shard, index);
+  stats_count(STATS_CACHE_INSERTS, 1);
+
+  //LRU and CLOCK keep all clean entries on LIST_RECENT, 2Q and ARC promote the reused keys
+  list_push_front(shard, index, ghost_list != -1 ? LIST_FREQUENT : LIST_RECENT);
+
+  return index;
+}
+
+static bool cache_key_valid(int disk_num, int block_num) {
+  return disk_num < JBOD_MAX_NODES * JBOD_NUM_DISKS && disk_num >= 0 && block_num < JBOD_NUM_BLOCKS_PER_DISK && block_num >= 0;
+}
+
+/* the payloads of all entries live in one page aligned arena, shard after
+ * shard, so a block never straddles a page and the metadata that lookups
+ * probe is packed in cache_entry_t without them. built with
+ * -DCACHE_HUGE_PAGES the arena is requested from hugetlbfs first. */
+static uint8_t *arena_alloc(size_t bytes, size_t *mapped) {
+  void *arena;
+
+#ifdef CACHE_HUGE_PAGES
+  size_t huge_bytes = (bytes + CACHE_HUGE_PAGE_SIZE - 1) / CACHE_HUGE_PAGE_SIZE * CACHE_HUGE_PAGE_SIZE;
+  arena = mmap(NULL, huge_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (arena != MAP_FAILED){
+    *mapped = huge_bytes;
+    return (uint8_t*) arena;
+  }
+#endif
+
+  size_t page_bytes = (bytes + CACHE_PAGE_SIZE - 1) / CACHE_PAGE_SIZE * CACHE_PAGE_SIZE;
+  arena = mmap(NULL, page_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (arena == MAP_FAILED){
+    return NULL;
+  }
+
+  *mapped = page_bytes;
+  return (uint8_t*) arena;
+}
+
+//spread the remainder so the shard sizes add up to num_entries
+static int shard_size(int num_entries, int count, int i) {
+  return num_entries / count + (i < num_entries % count ? 1 : 0);
+}
+
+//allocate and reset the index and lists of a shard of |size| entries whose payloads start at |payloads|
+static int shard_init(cache_shard_t *shard, int size, uint8_t *payloads, cache_policy_t cache_policy) {
+  shard->size = size;
+  shard->payloads = payloads;
+
+  //keep the load factor at or below 1/2 so chains stay short
+  shard->num_buckets = 1;
+  while (shard->num_buckets < 2 * shard->size){
+    shard->num_buckets <<= 1;
+  }
+
+  shard->entries = (cache_entry_t*) calloc(shard->size, sizeof(cache_entry_t));
+  shard->keys = (cache_key_t*) calloc(shard->size, sizeof(cache_key_t));
+  shard->free_slots = (int*) malloc(shard->size * sizeof(int));
+  shard->buckets = (int*) malloc(shard->num_buckets * sizeof(int));
+  if (shard->entries == NULL || shard->keys == NULL || shard->free_slots == NULL || shard->buckets == NULL){
+    return -1;
+  }
+
+  for (int slot = 0; slot < shard->size; slot++){
+    shard->free_slots[slot] = shard->size - 1 - slot;
+  }
+  shard->num_free_slots = shard->size;
+
+  for (int index = 0; index < shard->num_buckets; index++){
+    shard->buckets[index] = -1;
+  }
+
+  //the ghosts never outnumber the entries
+  if (cache_policy == CACHE_POLICY_2Q || cache_policy == CACHE_POLICY_ARC){
+    shard->ghosts = (cache_ghost_t*) malloc(shard->size * sizeof(cache_ghost_t));
+    shard->ghost_buckets = (int*) malloc(shard->num_buckets * sizeof(int));
+    if (shard->ghosts == NULL || shard->ghost_buckets == NULL){
+      return -1;
+    }
+
+    for (int index = 0; index < shard->num_buckets; index++){
+      shard->ghost_buckets[index] = -1;
+    }
+    for (int index = 0; index < shard->size; index++){
+      shard->ghosts[index].list = -1;
+      shard->ghosts[index].next = index + 1 < shard->size ? index + 1 : -1;
+    }
+  }
+
+  shard->num_used = 0;
+  shard->free_head = -1;
+  for (int list = 0; list < NUM_LISTS; list++){
+    shard->heads[list] = -1;
+    shard->tails[list] = -1;
+    shard->counts[list] = 0;
+  }
+  for (int list = 0; list < NUM_GHOST_LISTS; list++){
+    shard->ghost_heads[list] = -1;
+    shard->ghost_tails[list] = -1;
+    shard->ghost_counts[list] = 0;
+  }
+  shard->ghost_free = shard->ghosts != NULL ? 0 : -1;
+  shard->target_recent = 0;
+
+  return 1;
+}
+
+//free what shard_init allocated, the payloads belong to the arena
+static void shard_free(cache_shard_t *shard) {
+  free(shard->entries);
+  free(shard->keys);
+  free(shard->free_slots);
+  free(shard->buckets);
+  free(shard->ghosts);
+  free(shard->ghost_buckets);
+}
+
+//release every shard allocated so far and the arena
+static void cache_free_shards(int count) {
+  for (int i = 0; i < count; i++){
+    pthread_mutex_destroy(&shards[i].lock);
+    shard_free(&shards[i]);
+  }
+  free(shards);
+  shards = NULL;
+  num_shards = 0;
+
+  if (arena != NULL){
+    munmap(arena, arena_bytes);
+    arena = NULL;
+    arena_bytes = 0;
+  }
+}
 
 
 int cache_create(int num_entries) {
+  return cache_create_with_policy(num_entries, CACHE_POLICY_LRU);
+}
+
+/* not thread-safe with respect to the other cache functions: create the cache
+ * before starting concurrent I/O */
+int cache_create_with_policy(int num_entries, cache_policy_t cache_policy) {
   //declaring the function twice without first calling cache_destroy should fail
   if (cache_enabled()){
     return -1;
@@ -22,108 +641,544 @@ int cache_create(int num_entries) {
     return -1;
   }
 
-  cache = (cache_entry_t*) calloc(num_entries, sizeof(cache_entry_t));
-  cache_size = num_entries;
+  if (cache_policy != CACHE_POLICY_LRU && cache_policy != CACHE_POLICY_CLOCK && cache_policy != CACHE_POLICY_2Q && cache_policy != CACHE_POLICY_ARC){
+    return -1;
+  }
+
+  int count = 1;
+  while (count < CACHE_MAX_SHARDS && count * 2 * CACHE_ENTRIES_PER_SHARD <= num_entries){
+    count <<= 1;
+  }
+
+  arena = arena_alloc((size_t) num_entries * JBOD_BLOCK_SIZE, &arena_bytes);
+  shards = (cache_shard_t*) calloc(count, sizeof(cache_shard_t));
+  if (arena == NULL || shards == NULL){
+    cache_free_shards(0);
+    return -1;
+  }
+
+  uint8_t *payloads = arena;
+  for (int i = 0; i < count; i++){
+    cache_shard_t *shard = &shards[i];
+
+    pthread_mutex_init(&shard->lock, NULL);
+    if (shard_init(shard, shard_size(num_entries, count, i), payloads, cache_policy) != 1){
+      cache_free_shards(i + 1);
+      return -1;
+    }
+    payloads += (size_t) shard->size * JBOD_BLOCK_SIZE;
+  }
+
+  num_shards = count;
+  policy = cache_policy;
   is_created = 1;
 
   return 1;
 }
 
+//move the entries of |old| that are kept into the empty |shard|, in the same order on the same lists
+static void shard_migrate(cache_shard_t *old, cache_shard_t *shard, uint64_t min_access_time) {
+  //the dirty entries go first, they must all fit
+  static const int order[NUM_LISTS] = { LIST_DIRTY, LIST_RECENT, LIST_FREQUENT };
+
+  for (int n = 0; n < NUM_LISTS; n++){
+    int list = order[n];
+
+    //pushing from the tail to the head rebuilds every list in its old order
+    for (int index = old->tails[list]; index != -1 && shard->num_used < shard->size; index = old->entries[index].lru_prev){
+      if (list != LIST_DIRTY && old->keys[index].access_time < min_access_time){
+        continue;
+      }
+
+      int moved = shard->num_used;
+      shard->num_used ++;
+      shard->entries[moved] = old->entries[index];
+      shard->entries[moved].slot = -1;
+      shard->keys[moved] = old->keys[index];
+      if (!old->entries[index].zero){
+        slot_take(shard, moved);
+        memcpy(cache_block(shard, moved), cache_block(old, index), JBOD_BLOCK_SIZE);
+      }
+      hash_add(shard, moved);
+      list_push_front(shard, moved, list);
+    }
+  }
+
+  shard->target_recent = old->target_recent < shard->size ? old->target_recent : shard->size;
+}
+
+static int compare_access_times(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+  return x > y ? -1 : (x < y ? 1 : 0);
+}
+
+//the access time of the least recently used clean entry that still fits when |keep| are kept, with the shard locked
+static uint64_t shard_cutoff(cache_shard_t *shard, int keep, uint64_t *times) {
+  int count = 0;
+
+  for (int list = 0; list < NUM_LISTS; list++){
+    for (int index = shard->heads[list]; list != LIST_DIRTY && index != -1; index = shard->entries[index].lru_next){
+      times[count] = shard->keys[index].access_time;
+      count ++;
+    }
+  }
+
+  if (count <= keep){
+    return 0;
+  }
+  if (keep == 0){
+    return UINT64_MAX;
+  }
+
+  qsort(times, count, sizeof(uint64_t), compare_access_times);
+  return times[keep - 1];
+}
+
+int cache_resize(int num_entries) {
+  /*
+  the shards keep their number, so every key stays in its shard, and each one
+  is rebuilt at its new size in a new arena. all dirty entries are kept, then
+  the most recently used clean ones while they fit, the rest are dropped along
+  with the ghosts. every shard is locked while the cache is swapped.
+  */
+  if (!cache_enabled() || num_entries < 2 || num_entries > 4096 || num_entries < num_shards){
+    return -1;
+  }
+
+  cache_shard_t fresh[CACHE_MAX_SHARDS];
+  uint64_t times[4096];
+  int result = 1;
+  size_t fresh_bytes = 0;
+  uint8_t *fresh_arena = arena_alloc((size_t) num_entries * JBOD_BLOCK_SIZE, &fresh_bytes);
+
+  memset(fresh, 0, sizeof(fresh));
+
+  for (int i = 0; i < num_shards; i++){
+    pthread_mutex_lock(&shards[i].lock);
+  }
+
+  if (fresh_arena == NULL){
+    result = -1;
+  }
+
+  uint8_t *payloads = fresh_arena;
+  for (int i = 0; i < num_shards && result == 1; i++){
+    //a dirty block can only leave the cache through a flush
+    if (shards[i].counts[LIST_DIRTY] > shard_size(num_entries, num_shards, i) ||
+        shard_init(&fresh[i], shard_size(num_entries, num_shards, i), payloads, policy) != 1){
+      result = -1;
+    }
+    payloads += (size_t) shard_size(num_entries, num_shards, i) * JBOD_BLOCK_SIZE;
+  }
+
+  if (result == 1){
+    for (int i = 0; i < num_shards; i++){
+      cache_shard_t *shard = &shards[i];
+      uint64_t cutoff = shard_cutoff(shard, fresh[i].size - shard->counts[LIST_DIRTY], times);
+
+      shard_migrate(shard, &fresh[i], cutoff);
+      shard_free(shard);
+
+      //the lock is held and stays in place, everything after it is replaced
+      memcpy((uint8_t*) shard + offsetof(cache_shard_t, entries), (uint8_t*) &fresh[i] + offsetof(cache_shard_t, entries),
+             sizeof(cache_shard_t) - offsetof(cache_shard_t, entries));
+    }
+
+    munmap(arena, arena_bytes);
+    arena = fresh_arena;
+    arena_bytes = fresh_bytes;
+  }
+  else{
+    for (int i = 0; i < num_shards; i++){
+      shard_free(&fresh[i]);
+    }
+    if (fresh_arena != NULL){
+      munmap(fresh_arena, fresh_bytes);
+    }
+  }
+
+  for (int i = num_shards - 1; i >= 0; i--){
+    pthread_mutex_unlock(&shards[i].lock);
+  }
+
+  return result;
+}
+
+/* not thread-safe with respect to the other cache functions: stop concurrent
+ * I/O before destroying the cache */
 int cache_destroy(void) {
   if (!cache_enabled()){
     return -1;
   }
 
-  free(cache);
-  cache = NULL;
-  cache_size = 0;
+  //dirty blocks would be lost, they have to be flushed first
+  if (cache_num_dirty() > 0){
+    return -1;
+  }
+
   is_created = -1;
+  write_back = false;
+  cache_free_shards(num_shards);
 
   return 1;
 }
 
+/* sparse arrays are mostly never-written blocks, so an all-zero block is only
+ * flagged on its entry and holds no payload slot. that saves the copy both
+ * ways, and as the slots in use stay packed the arena pages past them are
+ * never touched, so a mostly zero cache keeps most of its arena unbacked. */
+
+//store |buf| as the contents of entry |index|
+static void cache_store(cache_shard_t *shard, int index, const uint8_t *buf) {
+  cache_entry_t *entry = &shard->entries[index];
+
+  entry->zero = block_is_zero(buf);
+  entry->corrupt = false;
+  entry->has_crc = false;
+  if (entry->zero){
+    slot_release(shard, index);
+    stats_count(STATS_ZERO_BLOCKS_CACHED, 1);
+  }
+  else{
+    slot_take(shard, index);
+    memcpy(cache_block(shard, index), buf, JBOD_BLOCK_SIZE);
+    if (checksums){
+      entry->crc = block_crc32c(buf);
+      entry->has_crc = true;
+    }
+  }
+}
+
+/* takes entry |index| out of use. it leaves its hash chain and its list, so
+ * neither eviction, the ghosts nor resize see it, and waits on the free stack
+ * for the next key the shard takes. */
+static void cache_drop(cache_shard_t *shard, int index) {
+  hash_remove(shard, index);
+  list_unlink(shard, index);
+  shard->keys[index].key = CACHE_NO_KEY;
+  shard->entries[index].dirty = false;
+  slot_release(shard, index);
+
+  shard->entries[index].lru_next = shard->free_head;
+  shard->free_head = index;
+}
+
+/* copy the contents of entry |index| to |buf|, returns false if they fail
+ * their checksum. a clean entry that does is dropped, the device still has the
+ * block. a dirty one holds the only copy, so it stays dirty and is quarantined:
+ * it fails every load until a write of the whole block replaces it. */
+static bool cache_load(cache_shard_t *shard, int index, uint8_t *buf) {
+  cache_entry_t *entry = &shard->entries[index];
+
+  if (entry->corrupt){
+    return false;
+  }
+  if (entry->zero){
+    memset(buf, 0, JBOD_BLOCK_SIZE);
+    return true;
+  }
+
+  memcpy(buf, cache_block(shard, index), JBOD_BLOCK_SIZE);
+  if (entry->has_crc && block_crc32c(buf) != entry->crc){
+    fprintf(stderr, "error, cached block %u of disk %u fails its checksum\n",
+            shard->keys[index].key % JBOD_NUM_BLOCKS_PER_DISK, shard->keys[index].key / JBOD_NUM_BLOCKS_PER_DISK);
+    stats_count(STATS_CHECKSUM_ERRORS, 1);
+    if (entry->dirty){
+      entry->corrupt = true;
+    }
+    else{
+      cache_drop(shard, index);
+    }
+    return false;
+  }
+  return true;
+}
+
 int cache_lookup(int disk_num, int block_num, uint8_t *buf) {
-  if (cache == NULL || buf == NULL || disk_num >= JBOD_NUM_DISKS || disk_num < 0 || block_num >= JBOD_NUM_BLOCKS_PER_DISK  || block_num < 0){
+  if (!cache_enabled() || buf == NULL || !cache_key_valid(disk_num, block_num)){
     return -1;
   }
 
   num_queries ++;
 
-  for (int index = 0; index < cache_size; index++){
-    if (cache[index].disk_num == disk_num && cache[index].block_num == block_num && cache[index].valid == true){
-      memcpy(buf, cache[index].block,  JBOD_BLOCK_SIZE);
-
-      num_hits ++;
-      clock ++;
-      cache[index].access_time = clock;
+  cache_shard_t *shard = cache_shard(disk_num, block_num);
+  pthread_mutex_lock(&shard->lock);
 
-      return 1;
+  int index = cache_find(shard, disk_num, block_num);
+  if (index != -1 && !cache_load(shard, index, buf)){
+    index = -1;
+  }
+  if (index != -1){
+    cache_touch(shard, index);
+    if (shard->entries[index].prefetched){
+      shard->entries[index].prefetched = false;
+      num_prefetch_hits ++;
     }
   }
 
-  return -1;
+  pthread_mutex_unlock(&shard->lock);
+
+  if (index == -1){
+    stats_count(STATS_CACHE_MISSES, 1);
+    return -1;
+  }
+
+  num_hits ++;
+  stats_count(STATS_CACHE_HITS, 1);
+  return 1;
 }
 
 void cache_update(int disk_num, int block_num, const uint8_t *buf) {
-  if (buf != NULL && cache != NULL && disk_num < JBOD_NUM_DISKS && disk_num >= 0 && block_num < JBOD_NUM_BLOCKS_PER_DISK  && block_num >= 0){
-    for (int index = 0; index < cache_size; index++){
-      if (cache[index].disk_num == disk_num && cache[index].block_num == block_num && cache[index].valid == true){
-        memcpy(cache[index].block, buf, JBOD_BLOCK_SIZE);
+  if (buf != NULL && cache_enabled() && cache_key_valid(disk_num, block_num)){
+    cache_shard_t *shard = cache_shard(disk_num, block_num);
+    pthread_mutex_lock(&shard->lock);
 
-        clock ++;
-        cache[index].access_time = clock;
-      }
+    int index = cache_find(shard, disk_num, block_num);
+    if (index != -1){
+      cache_store(shard, index, buf);
+      shard->entries[index].prefetched = false;
+      cache_touch(shard, index);
     }
+
+    pthread_mutex_unlock(&shard->lock);
   }
 }
 
-int cache_insert(int disk_num, int block_num, const uint8_t *buf) {
-  if (buf == NULL || cache == NULL || disk_num >= JBOD_NUM_DISKS || disk_num < 0 || block_num >= JBOD_NUM_BLOCKS_PER_DISK  || block_num < 0){
-    //printf("error1");
+static int cache_insert_entry(int disk_num, int block_num, const uint8_t *buf, bool prefetched) {
+  if (buf == NULL || !cache_enabled() || !cache_key_valid(disk_num, block_num)){
     return -1;
   }
 
+  cache_shard_t *shard = cache_shard(disk_num, block_num);
+  pthread_mutex_lock(&shard->lock);
+
   //condition: block_exist
-  for(int index = 0; index < cache_size; index ++){
-    if (cache[index].disk_num == disk_num && cache[index].block_num == block_num && cache[index].valid == true){
+  if (cache_find(shard, disk_num, block_num) != -1){
+    pthread_mutex_unlock(&shard->lock);
+    return -1;
+  }
+
+  //condition: available cache, otherwise the shard is full and the policy evicts an entry
+  int index = cache_claim(shard, disk_num, block_num);
+  if (index == -1){
+    pthread_mutex_unlock(&shard->lock);
+    return -1;
+  }
+
+  cache_store(shard, index, buf);
+  shard->entries[index].prefetched = prefetched;
+
+  pthread_mutex_unlock(&shard->lock);
+
+  if (prefetched){
+    num_prefetched ++;
+  }
+
+  return 1;
+}
+
+int cache_insert(int disk_num, int block_num, const uint8_t *buf) {
+  return cache_insert_entry(disk_num, block_num, buf, false);
+}
+
+int cache_prefetch(int disk_num, int block_num, const uint8_t *buf) {
+  return cache_insert_entry(disk_num, block_num, buf, true);
+}
+
+int cache_prefetch_wasted(void) {
+  return num_prefetch_wasted;
+}
+
+int cache_set_write_back(bool enabled) {
+  if (!cache_enabled()){
+    return -1;
+  }
+
+  //write-through must not start while blocks are still waiting for a flush
+  if (!enabled && cache_num_dirty() > 0){
+    return -1;
+  }
+
+  write_back = enabled;
+  return 1;
+}
+
+bool cache_write_back(void) {
+  return cache_enabled() && write_back;
+}
+
+int cache_write(int disk_num, int block_num, const uint8_t *buf) {
+  if (buf == NULL || !cache_write_back() || !cache_key_valid(disk_num, block_num)){
+    return -1;
+  }
+
+  cache_shard_t *shard = cache_shard(disk_num, block_num);
+  pthread_mutex_lock(&shard->lock);
+
+  int index = cache_find(shard, disk_num, block_num);
+  if (index != -1){
+    //a rewrite of a block that has not been flushed yet never reaches the device
+    if (shard->entries[index].dirty){
+      num_coalesced ++;
+    }
+  }
+  else{
+    index = cache_claim(shard, disk_num, block_num);
+    if (index == -1){
+      pthread_mutex_unlock(&shard->lock);
       return -1;
     }
   }
 
-  int max = 0;
+  cache_store(shard, index, buf);
+  shard->entries[index].prefetched = false;
+  cache_set_dirty(shard, index, true);
+  cache_touch(shard, index);
+
+  pthread_mutex_unlock(&shard->lock);
+
+  return 1;
+}
+
+int cache_clean(int disk_num, int block_num, uint8_t *buf) {
+  if (buf == NULL || !cache_enabled() || !cache_key_valid(disk_num, block_num)){
+    return -1;
+  }
+
+  cache_shard_t *shard = cache_shard(disk_num, block_num);
+  pthread_mutex_lock(&shard->lock);
+
+  int result = -1;
+  int index = cache_find(shard, disk_num, block_num);
+  if (index != -1 && shard->entries[index].dirty){
+    if (cache_load(shard, index, buf)){
+      cache_set_dirty(shard, index, false);
+      result = 1;
+    }
+  }
+
+  pthread_mutex_unlock(&shard->lock);
+
+  return result;
+}
+
+int cache_peek(int disk_num, int block_num, uint8_t *buf) {
+  if (buf == NULL || !cache_enabled() || !cache_key_valid(disk_num, block_num)){
+    return -1;
+  }
+
+  cache_shard_t *shard = cache_shard(disk_num, block_num);
+  pthread_mutex_lock(&shard->lock);
+
+  int index = cache_find(shard, disk_num, block_num);
+  if (index != -1 && (shard->entries[index].dirty || !cache_load(shard, index, buf))){
+    index = -1;
+  }
+
+  pthread_mutex_unlock(&shard->lock);
 
-  //condition: available cache
-  for (int index = 0; index < cache_size; index ++){
-    if(cache[index].valid == false){
-      // printf("condition_2");
-      memcpy(cache[index].block, buf, JBOD_BLOCK_SIZE);
+  return index == -1 ? -1 : 1;
+}
+
+bool cache_contains(int disk_num, int block_num) {
+  bool found = false;
+
+  if (cache_enabled() && cache_key_valid(disk_num, block_num)){
+    cache_shard_t *shard = cache_shard(disk_num, block_num);
+    pthread_mutex_lock(&shard->lock);
+    found = cache_find(shard, disk_num, block_num) != -1;
+    pthread_mutex_unlock(&shard->lock);
+  }
+
+  return found;
+}
 
-      clock++;
-      cache[index].access_time = clock;
-      cache[index].disk_num = disk_num;
-      cache[index].block_num = block_num;
-      cache[index].valid = true;
+bool cache_is_corrupt(int disk_num, int block_num) {
+  bool corrupt = false;
 
-      return 1;
+  if (cache_enabled() && cache_key_valid(disk_num, block_num)){
+    cache_shard_t *shard = cache_shard(disk_num, block_num);
+    pthread_mutex_lock(&shard->lock);
+    int index = cache_find(shard, disk_num, block_num);
+    corrupt = index != -1 && shard->entries[index].corrupt;
+    pthread_mutex_unlock(&shard->lock);
+  }
+
+  return corrupt;
+}
+
+void cache_invalidate(int disk_num, int block_num) {
+  if (cache_enabled() && cache_key_valid(disk_num, block_num)){
+    cache_shard_t *shard = cache_shard(disk_num, block_num);
+    pthread_mutex_lock(&shard->lock);
+
+    int index = cache_find(shard, disk_num, block_num);
+    if (index != -1 && !shard->entries[index].dirty){
+      cache_drop(shard, index);
     }
 
-    if(cache[index].access_time < cache[max].access_time){
-      //printf("max: %d, access time: %d", max, cache[index].access_time);
-      max = index;
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
+
+void cache_set_checksums(bool enabled) {
+  checksums = enabled;
+}
+
+int cache_dirty_blocks(uint32_t *block_ids, int max) {
+  int count = 0;
+
+  if (block_ids == NULL || !cache_enabled()){
+    return 0;
+  }
+
+  for (int i = 0; i < num_shards && count < max; i++){
+    cache_shard_t *shard = &shards[i];
+    pthread_mutex_lock(&shard->lock);
+
+    for (int index = shard->heads[LIST_DIRTY]; index != -1 && count < max; index = shard->entries[index].lru_next){
+      block_ids[count] = shard->keys[index].key;
+      count ++;
     }
+
+    pthread_mutex_unlock(&shard->lock);
+  }
+
+  return count;
+}
+
+int cache_num_dirty(void) {
+  int count = 0;
+
+  if (!cache_enabled()){
+    return 0;
   }
 
-  //condition: cache is full
-  memcpy(cache[max].block, buf, JBOD_BLOCK_SIZE);
+  for (int i = 0; i < num_shards; i++){
+    pthread_mutex_lock(&shards[i].lock);
+    count += shards[i].counts[LIST_DIRTY];
+    pthread_mutex_unlock(&shards[i].lock);
+  }
+
+  return count;
+}
+
+bool cache_needs_flush(void) {
+  bool needed = false;
 
-  clock++;
-  cache[max].access_time = clock;
-  cache[max].disk_num = disk_num;
-  cache[max].block_num = block_num;
+  if (!cache_write_back()){
+    return false;
+  }
 
-  return 1;  
+  //flush before a shard runs out of clean entries to evict
+  for (int i = 0; i < num_shards && !needed; i++){
+    pthread_mutex_lock(&shards[i].lock);
+    needed = shards[i].counts[LIST_DIRTY] * 2 >= shards[i].size;
+    pthread_mutex_unlock(&shards[i].lock);
+  }
 
-  
+  return needed;
 }
 
 bool cache_enabled(void) {
@@ -137,4 +1192,10 @@ bool cache_enabled(void) {
 
 void cache_print_hit_rate(void) {
   fprintf(stderr, "Hit rate: %5.1f%%\n", 100 * (float) num_hits / num_queries);
+  if (write_back){
+    fprintf(stderr, "Coalesced writes: %d\n", (int) num_coalesced);
+  }
+  if (num_prefetched > 0){
+    fprintf(stderr, "Prefetched: %d, hits: %d, wasted: %d\n", (int) num_prefetched, (int) num_prefetch_hits, (int) num_prefetch_wasted);
+  }
 }
@@ -7,21 +7,52 @@
 #include "jbod.h"
 #include "util.h"
 
+/* The state of a cache entry besides its key and age, which lookups probe in
+ * a compact array of their own. The block itself is kept apart in a page
+ * aligned arena. */
 typedef struct {
-  bool valid;
-  int disk_num;
-  int block_num;
-  uint8_t block[JBOD_BLOCK_SIZE];
-  int access_time;
+  bool dirty;      /* write-back mode: newer than the device, see cache_write */
+  bool prefetched; /* inserted by readahead and not looked up since */
+  int lru_prev;    /* neighbour towards the head of the entry's list, or -1 */
+  int lru_next;    /* neighbour towards the tail of the entry's list, or -1 */
+  int list;        /* the eviction list the entry is on */
+  int home;        /* the list a dirty entry returns to once it is clean */
+  bool referenced; /* CLOCK: used since the hand last passed */
+  bool zero;       /* the block is all zeros and holds no payload slot */
+  int slot;        /* the entry's payload slot in the arena, -1 for none */
+  bool has_crc;    /* |crc| is the CRC32C of the payload, see cache_set_checksums */
+  bool corrupt;    /* a dirty block that failed its checksum, quarantined until it is rewritten */
+  uint32_t crc;
 } cache_entry_t;
 
+/* Eviction policies. LRU evicts the least recently used entry. CLOCK gives
+ * every used entry a second chance instead of reordering on each hit. 2Q and
+ * ARC only keep a block among the frequently used ones once it is reused, so
+ * one pass over the array cannot push out a hot set. */
+typedef enum {
+  CACHE_POLICY_LRU,
+  CACHE_POLICY_CLOCK,
+  CACHE_POLICY_2Q,
+  CACHE_POLICY_ARC,
+} cache_policy_t;
+
 /* Returns 1 on success and -1 on failure. Should allocate a space for
  * |num_entries| cache entries, each of type cache_entry_t. Calling it again
  * without first calling cache_destroy (see below) should fail. */
 int cache_create(int num_entries);
 
+/* Same as cache_create, evicting with |policy| instead of LRU. */
+int cache_create_with_policy(int num_entries, cache_policy_t policy);
+
+/* Returns 1 on success and -1 on failure. Grows or shrinks the cache to
+ * |num_entries| entries while it is in use. The most recently used entries
+ * that fit are kept, and it fails rather than drop a dirty block. The cache
+ * keeps the number of shards it was created with, so |num_entries| must be at
+ * least that number. */
+int cache_resize(int num_entries);
+
 /* Returns 1 on success and -1 on failure. Frees the space allocated by
- * cache_create function above. */
+ * cache_create function above. Fails while dirty blocks remain. */
 int cache_destroy(void);
 
 /* Returns 1 on success and -1 on failure. Looks up the block located at
@@ -38,10 +69,78 @@ int cache_insert(int disk_num, int block_num, const uint8_t *buf);
 
 void cache_update(int disk_num, int block_num, const uint8_t *buf);
 
+/* Same as cache_insert, for a block that was read ahead of any request. The
+ * entry counts as a prefetch hit when it is looked up, and as wasted when it
+ * is evicted first. */
+int cache_prefetch(int disk_num, int block_num, const uint8_t *buf);
+
+/* Returns the number of prefetched blocks evicted before they were used. */
+int cache_prefetch_wasted(void);
+
+/* Returns 1 on success and -1 on failure. Switches the cache between
+ * write-through (the default) and write-back. In write-back mode mdadm stores
+ * written blocks with cache_write and only sends them to the device when they
+ * are flushed. Switching back fails while dirty blocks remain. */
+int cache_set_write_back(bool enabled);
+
+/* Returns true if the cache is enabled and in write-back mode. */
+bool cache_write_back(void);
+
+/* Returns 1 on success and -1 on failure. Stores |buf| as the new contents of
+ * the block, inserting it if needed, and marks it dirty. Only clean entries
+ * are evicted, so this fails when every entry of its shard is dirty. */
+int cache_write(int disk_num, int block_num, const uint8_t *buf);
+
+/* Returns 1 on success and -1 if the block is not cached or not dirty. Copies
+ * a dirty block to |buf| and marks it clean, for it is about to be flushed. A
+ * block that fails its checksum is left dirty. */
+int cache_clean(int disk_num, int block_num, uint8_t *buf);
+
+/* Fills |block_ids| with at most |max| dirty blocks, each as
+ * disk_num * JBOD_NUM_BLOCKS_PER_DISK + block_num, and returns how many. */
+int cache_dirty_blocks(uint32_t *block_ids, int max);
+
+/* Returns 1 on success and -1 if the block is not cached or is dirty. Copies
+ * a clean cached block to |buf| without it counting as a use of the entry. */
+int cache_peek(int disk_num, int block_num, uint8_t *buf);
+
+/* Returns true if the block is cached, without it counting as a use of the
+ * entry or as a hit or miss. */
+bool cache_contains(int disk_num, int block_num);
+
+/* Returns true if the block is dirty and quarantined, see
+ * cache_set_checksums. The device only has an older copy of it, so a miss on
+ * it must not be served from there. */
+bool cache_is_corrupt(int disk_num, int block_num);
+
+/* Drops the clean cached copy of a block, if there is one. */
+void cache_invalidate(int disk_num, int block_num);
+
+/* Turns checksums on or off. While they are on, every block stored in the
+ * cache gets a CRC32C that is checked whenever the block is read back out. A
+ * clean entry that fails the check is dropped and the read misses. A dirty one
+ * holds the only up to date copy, so it stays dirty and quarantined instead:
+ * cache_lookup and cache_clean fail for it and cache_is_corrupt returns true
+ * until cache_write replaces the whole block. Off by default. */
+void cache_set_checksums(bool enabled);
+
+/* Returns the number of dirty blocks. */
+int cache_num_dirty(void);
+
+/* Returns true when dirty blocks take up half of a shard, so they should be
+ * flushed before eviction runs out of clean entries. The cache cannot write to
+ * the device, so eviction never takes a dirty entry and a dirty block stays
+ * cached until a flush cleans it. mdadm flushes every dirty block once a write
+ * makes this true, instead of writing a block back when it is evicted. That
+ * keeps clean entries to evict, and a block whose shard is all dirty anyway is
+ * written through to the device, see cache_write. */
+bool cache_needs_flush(void);
+
 /* Returns true if cache is enabled and false if not. */
 bool cache_enabled(void);
 
-/* Prints the hit rate of the cache. */
+/* Prints the hit rate of the cache, and the readahead and write-back counters
+ * when those are in use. */
 void cache_print_hit_rate(void);
 
 #endif
@@ -16,317 +16,2612 @@
 
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <openssl/sha.h>
 
+#include "block.h"
 #include "cache.h"
 #include "mdadm.h"
 #include "util.h"
 #include "jbod.h"
 #include "net.h"
+#include "profile.h"
+#include "stats.h"
+#include "trace.h"
 
-//encode_operation
+//encode_operation, bits 14-19 command, bits 20-27 block id, bits 28-31 disk id
 uint32_t encode_operation(int DISKID, int BLOCKID, jbod_cmd_t CMD){
-  return DISKID << 4 | BLOCKID << 20 | DISKID << 28;
+  return (uint32_t) CMD << 14 | (uint32_t) BLOCKID << 20 | (uint32_t) DISKID << 28;
 }
 
 int isMounted = 0;
 
-int mdadm_mount(void) {
-  //if isMounted is 1, then return -1 because the disk is already mounted
-  if (isMounted == 1){
-    return -1;
+/* mount and unmount are serialized by this lock. a request is admitted while
+ * the array is mounted and counted in |num_requests| until it has finished,
+ * and an unmount stops admitting requests and waits for the count to drop to
+ * zero, so I/O never races with a change of the mount state. */
+static pthread_mutex_t mount_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t request_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t requests_idle = PTHREAD_COND_INITIALIZER;
+static int num_requests = 0;
+static bool unmounting = false;
+
+/* requests are streamed in chunks of this many blocks, so the bookkeeping of a
+ * call stays bounded however long it is. a chunk is a whole disk, or a stripe
+ * unit of up to 16 blocks on every disk, so one batch keeps them all busy. */
+#define BLOCKS_PER_CHUNK 256
+
+/* the largest readahead window, see mdadm_set_readahead */
+#define READAHEAD_MAX_BLOCKS 64
+
+/* a RAID5 chunk is at most this many parity groups, one block of each disk
+ * per group, see plan_stripe_read. a degraded read rebuilds at most this many
+ * blocks per chunk. */
+#define GROUPS_PER_CHUNK (BLOCKS_PER_CHUNK / JBOD_NUM_DISKS)
+
+/* the most operations one chunk queues: at worst a seek to the disk and to the
+ * block before the transfer of each of its blocks, of the blocks a degraded
+ * read rebuilds from, and of a readahead window behind them */
+#define BATCH_CAPACITY (3 * (2 * BLOCKS_PER_CHUNK + READAHEAD_MAX_BLOCKS))
+
+/* operations a batch has room for per block of the request's first chunk, a
+ * seek to the disk and to the block and the transfer. batches grow from there
+ * up to BATCH_CAPACITY. */
+#define BATCH_OPS_PER_BLOCK 3
+
+/* number of jbod commands avoided compared to seeking before every block */
+static atomic_uint_fast64_t num_commands_saved = 0;
+
+#define ARRAY_BLOCKS (JBOD_NUM_DISKS * JBOD_NUM_BLOCKS_PER_DISK)
+
+/* the blocks of every disk of the largest federation (see jbod_connect_nodes),
+ * disk d of node n being disk n * JBOD_NUM_DISKS + d here */
+#define MAX_DEVICE_BLOCKS (JBOD_MAX_NODES * ARRAY_BLOCKS)
+#define MAX_ARRAY_SIZE (MAX_DEVICE_BLOCKS * JBOD_BLOCK_SIZE)
+
+/*
+the blocks of the array are numbered in address order and dealt out to the
+disks in stripe units of |stripe_blocks| blocks: unit u goes to disk
+u % JBOD_NUM_DISKS, behind the units that disk already holds. a unit of a whole
+disk is the linear layout, the disks back to back. with a smaller unit a
+sequential stream moves on to the next disk every |stripe_blocks| blocks, so a
+large request spreads over many disks whose connections work side by side.
+the layout is set at mount, while no request runs.
+
+a federation of |num_nodes| servers has |num_disks| disks. the linear layout
+puts the nodes back to back, node n's disks following node n - 1's. the striped
+layout deals the units out to the nodes in turn, disk a of the array being
+disk a / num_nodes of node a % num_nodes, so consecutive units go to
+different servers.
+
+RAID5 deals out the units in rows of DATA_DISKS, the left-symmetric layout of
+Linux md: row r keeps its parity on disk 15 - r % 16 and its units on the
+disks after that one, wrapping around. block b of every disk but the parity
+one, within the row, forms a parity group with block b of the parity disk,
+which holds the XOR of the others. the units of one disk are still
+JBOD_NUM_DISKS apart, the row that skips a disk's unit is the one it holds the
+parity of.
+*/
+#define DATA_DISKS (JBOD_NUM_DISKS - 1)
+
+static mdadm_layout_t array_layout = MDADM_LAYOUT_LINEAR;
+static uint32_t stripe_blocks = JBOD_NUM_BLOCKS_PER_DISK;
+static uint32_t array_blocks = ARRAY_BLOCKS;
+static uint32_t num_nodes = 1;
+static uint32_t num_disks = JBOD_NUM_DISKS;
+
+/* the failed disk of a RAID5 array, -1 while there is none. a request takes it
+ * once when it starts, so all of its chunks agree on it */
+static atomic_int failed_disk = -1;
+
+//the disk holding the parity of RAID5 row |row|
+static uint32_t parity_disk(uint32_t row) {
+  return JBOD_NUM_DISKS - 1 - row % JBOD_NUM_DISKS;
+}
+
+//where block |block_id| of the array lives
+static void map_block(uint32_t block_id, uint32_t *disk_num, uint32_t *block_num) {
+  uint32_t unit = block_id / stripe_blocks;
+
+  if (array_layout == MDADM_LAYOUT_RAID5){
+    uint32_t row = unit / DATA_DISKS;
+    *disk_num = (parity_disk(row) + 1 + unit % DATA_DISKS) % JBOD_NUM_DISKS;
+    *block_num = row * stripe_blocks + block_id % stripe_blocks;
+    return;
   }
 
-  //if there is no error after calling jbod_mount command then return 1 as true, or -1 as false
-  uint32_t op = encode_operation(0, 0, JBOD_MOUNT);
-  if (jbod_client_operation(op, NULL) == 0){
-    isMounted = 1;
-    return 1;
+  uint32_t array_disk = unit % num_disks;
+  *disk_num = array_layout == MDADM_LAYOUT_RAID0 ? array_disk % num_nodes * JBOD_NUM_DISKS + array_disk / num_nodes : array_disk;
+  *block_num = unit / num_disks * stripe_blocks + block_id % stripe_blocks;
+}
+
+//the block of the array that data disk |disk_num| of a RAID5 array holds at |block_num|
+static uint32_t group_member(uint32_t block_num, uint32_t disk_num) {
+  uint32_t row = block_num / stripe_blocks;
+  uint32_t unit_in_row = (disk_num + JBOD_NUM_DISKS - parity_disk(row) - 1) % JBOD_NUM_DISKS;
+
+  return (row * DATA_DISKS + unit_in_row) * stripe_blocks + block_num % stripe_blocks;
+}
+
+/*
+with verification on, mdadm remembers the CRC32C of what every block of every
+disk should hold: what this client last wrote to it, or what it first read
+from it after the mount. a block read from the device is checked against it, so
+a block that changed on the disk or on its way from it fails the read instead
+of being returned. the cache checks its own copies (see cache_set_checksums).
+an entry is only touched by a request that owns the connection of its disk,
+and only while mounted, so the table needs no lock.
+*/
+#define CRC_KNOWN ((uint64_t) 1 << 32)
+
+static bool verify = false;
+static uint64_t expected_crcs[MAX_DEVICE_BLOCKS]; /* the CRC in the low bits, CRC_KNOWN once there is one */
+
+/* operations queued for the next jbod_client_pipeline_async call. a chunk is
+ * queued in full and then sent as one pipelined batch, so it costs about one
+ * round trip instead of one per command. every request owns its own batch,
+ * sized for its first chunk (see batch_init) and grown while it is planned. */
+typedef struct {
+  jbod_request_t *reqs;
+  int len;
+  int capacity;
+} batch_t;
+
+/*
+every read, write and flush runs as a request that moves through phases. a
+phase plans the next batch (cache lookups, seeks, transfers), sends it without
+waiting and continues in the batch's callback, so no thread is parked while a
+request waits for the device: the synchronous calls only wait for their
+request's callback. a write runs its partial head and tail reads first, then
+its chunks, a write that leaves the write-back cache under pressure continues
+as a flush. a RAID5 write instead alternates between reading what the parity
+of a chunk's groups needs and writing the groups.
+*/
+typedef enum {
+  PHASE_READ,
+  PHASE_WRITE_EDGES,
+  PHASE_WRITE,
+  PHASE_STRIPE_READ,
+  PHASE_STRIPE_WRITE,
+  PHASE_FLUSH,
+  PHASE_VERIFY,
+  PHASE_DONE,
+} request_phase_t;
+
+/* how a RAID5 write brings the parity of a group up to date */
+typedef enum {
+  STRIPE_FULL,        /* every data block of the group is written, the parity is their XOR */
+  STRIPE_RMW,         /* reads the old parity and the written blocks' old contents, and swaps those out of it */
+  STRIPE_RECONSTRUCT, /* reads the blocks that are not written and XORs them with the written ones */
+  STRIPE_REBUILD,     /* a partly written block of the failed disk: reads all the others to rebuild it first */
+  STRIPE_NO_PARITY,   /* the parity disk failed, only the data is written */
+} stripe_mode_t;
+
+typedef struct {
+  uint32_t block_num;    /* the block of every disk the group is made of */
+  uint32_t parity_disk;
+  stripe_mode_t mode;
+  uint32_t written;      /* bit d stands for disk d's block in the group */
+  uint32_t partial;      /* the written blocks the request only covers a part of */
+  uint32_t reads;        /* the blocks read before the group is written */
+} stripe_group_t;
+
+typedef struct mdadm_request mdadm_request_t;
+
+struct mdadm_request {
+  request_phase_t phase;
+  uint32_t addr;
+  uint32_t len;
+  uint8_t *buf;
+  mdadm_callback_t callback;
+  void *arg;
+  int result;              /* what the callback gets */
+  int histogram;           /* the stats histogram of the call, -1 for a flush */
+  uint64_t start;
+  bool flushing;           /* a write that went on to flush the cache */
+
+  uint64_t conns;          /* bit c stands for connection c, see acquire_conns */
+  mdadm_request_t *next;   /* in the list of requests waiting for connections, or ready to run */
+
+  batch_t batch;
+  bool awaiting;           /* the batch was planned, its outcome is in batch_result */
+  int batch_result;
+
+  /* the blocks of the request and of its current chunk, numbered in address order */
+  uint32_t first_block;
+  uint32_t last_block;
+  uint32_t chunk_first;
+  uint32_t chunk_last;
+  uint8_t *chunk_bufs[BLOCKS_PER_CHUNK];
+  bool missed[BLOCKS_PER_CHUNK];
+  uint8_t head_buf[JBOD_BLOCK_SIZE];
+  uint8_t tail_buf[JBOD_BLOCK_SIZE];
+  uint8_t (*stage)[JBOD_BLOCK_SIZE]; /* a striped chunk in the order it is queued, see stage_alloc */
+  int failed_disk;         /* the RAID5 array's failed disk when the request started, -1 for none */
+
+  /* a RAID5 write's parity groups of the current chunk, whose blocks are in
+  |stage| disk by disk, and a degraded read's blocks that are rebuilt, with the
+  blocks of the other disks they are rebuilt from */
+  stripe_group_t groups[GROUPS_PER_CHUNK];
+  uint32_t num_groups;
+  uint32_t rebuilt[GROUPS_PER_CHUNK];
+  uint8_t *rebuild_bufs[GROUPS_PER_CHUNK][JBOD_NUM_DISKS];
+  uint32_t num_rebuilt;
+  uint8_t (*peers)[JBOD_BLOCK_SIZE];
+
+  /* a read's readahead, a flush's dirty block ids with the blocks of the chunk
+  being written, and a verify's blocks followed by their signatures */
+  uint32_t ahead_first;
+  uint32_t ahead_count;
+  uint64_t ahead_cached; /* bit i is set for the i-th block of the window in chunk_order when it was cached already */
+  uint8_t (*blocks)[JBOD_BLOCK_SIZE];
+  uint32_t *dirty_ids;
+  int num_dirty;
+  int num_quarantined;     /* dirty blocks the flush left dirty as they fail their checksum */
+
+  /* a read's entries in the in-flight table, see add_read */
+  struct inflight_block *fetched;  /* the blocks it fetches itself */
+  int num_fetched;
+  struct read_piece *pieces;       /* what it provides to other reads */
+  uint64_t *provided;              /* bit i is set if another read provides block first_block + i */
+  int num_pending;                 /* the provided blocks not copied over yet */
+  bool parked;                     /* its own batches are done, it waits for num_pending to reach 0 */
+  bool failed_piece;               /* a read that provided a block failed */
+};
+
+/*
+a request must own the connections of every disk it touches from the moment it
+plans its seeks from jbod_client_position until its last batch has completed,
+otherwise another request could move the device in between. with one
+connection per disk this serializes command sequences per disk only.
+ownership is not a lock held by a thread: a request that cannot get all of its
+connections at once is queued, and a request giving its connections back
+hands them to the queued ones in arrival order. a queued request also holds
+back later arrivals that want any of its connections, so a flush that needs
+all of them is not starved by a stream of small requests.
+*/
+static pthread_mutex_t owner_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t owned_conns = 0;
+static uint64_t waiting_conns = 0;
+static mdadm_request_t *waiting_head = NULL;
+static mdadm_request_t *waiting_tail = NULL;
+
+/* requests ready to run on this thread. running them from a loop instead of
+ * from the function that made them ready keeps the stack flat when one
+ * request finishing lets a long queue of others through. */
+static _Thread_local mdadm_request_t *ready_head = NULL;
+static _Thread_local mdadm_request_t *ready_tail = NULL;
+static _Thread_local bool running_ready = false;
+
+static void request_step(mdadm_request_t *req);
+
+static void schedule(mdadm_request_t *req) {
+  req->next = NULL;
+  if (ready_tail != NULL){
+    ready_tail->next = req;
   }
   else{
-    isMounted = 0;
-    return -1;
+    ready_head = req;
   }
+  ready_tail = req;
+
+  if (running_ready){
+    return;
+  }
+
+  running_ready = true;
+  while (ready_head != NULL){
+    mdadm_request_t *next = ready_head;
+    ready_head = next->next;
+    if (ready_head == NULL){
+      ready_tail = NULL;
+    }
+    request_step(next);
+  }
+  running_ready = false;
 }
 
-int mdadm_unmount(void) {
-  //if isMounted is 1, then return -1 because the disk is already unmounted
-  if (isMounted == 0){
-    return -1;
+//the connections that serve the disks |first_disk| to |last_disk|
+static uint64_t disks_conns(uint32_t first_disk, uint32_t last_disk) {
+  uint64_t conns = 0;
+
+  for (uint32_t disk_num = first_disk; disk_num <= last_disk; disk_num++){
+    int c = jbod_client_route(disk_num);
+    if (c != -1){
+      conns |= (uint64_t) 1 << c;
+    }
   }
+  return conns;
+}
 
-  //if there is no error after calling jbod_unmount command then return 1 as true, or -1 as false
-  uint32_t op = encode_operation(0, 0, JBOD_UNMOUNT);
-  if (jbod_client_operation(op, NULL) == 0){
-    isMounted = 0;
-    return 1;
+//the connections that serve the blocks |first_block| to |last_block| of the array
+static uint64_t blocks_conns(uint32_t first_block, uint32_t last_block) {
+  //a unit on every disk
+  if (last_block - first_block + 1 >= stripe_blocks * num_disks){
+    return disks_conns(0, num_disks - 1);
   }
-  else{
-    isMounted = 1;
-    return -1;
+
+  uint64_t conns = 0;
+  for (uint32_t unit = first_block / stripe_blocks; unit <= last_block / stripe_blocks; unit++){
+    uint32_t disk_num;
+    uint32_t block_num;
+
+    map_block(unit * stripe_blocks, &disk_num, &block_num);
+    conns |= disks_conns(disk_num, disk_num);
   }
+  return conns;
 }
 
-int mdadm_read(uint32_t addr, uint32_t len, uint8_t *buf) {
-  //if read_len is 0, return 0 because there is nothing to read from the disk
-  if (len == 0){
-    return 0;
+//runs |req| once it owns its connections
+static void acquire_conns(mdadm_request_t *req) {
+  bool granted = false;
+
+  pthread_mutex_lock(&owner_lock);
+  if ((req->conns & (owned_conns | waiting_conns)) == 0){
+    owned_conns |= req->conns;
+    granted = true;
+  }
+  else{
+    req->next = NULL;
+    if (waiting_tail != NULL){
+      waiting_tail->next = req;
+    }
+    else{
+      waiting_head = req;
+    }
+    waiting_tail = req;
+    waiting_conns |= req->conns;
   }
+  pthread_mutex_unlock(&owner_lock);
 
-  //Any potential error will result in -1 as failure
-  if (isMounted == 0 || len > 1024 || len < 0 || buf == NULL || (len + addr) > (256*256*16)){
-    return -1;
+  if (granted){
+    schedule(req);
   }
+}
 
-  //define necessary variables, updated len needs to be flexible
-  uint32_t current_addr = addr;
-  uint32_t bytes_write = 0;
-  uint32_t updated_len = len;
-
-  while (current_addr < len + addr){
-    //define necessary varibales
-    uint8_t read_buf[JBOD_BLOCK_SIZE];
-    uint32_t num_of_disk = current_addr / JBOD_DISK_SIZE;
-    uint32_t num_of_block = current_addr % JBOD_DISK_SIZE / JBOD_BLOCK_SIZE;
-    uint32_t offset_of_block = current_addr % JBOD_BLOCK_SIZE;
-
-    int have_data = -1;
-
-    //cache implementation
-    if(cache_enabled()){
-      if (cache_lookup(num_of_disk, num_of_block, read_buf) == -1){  
-        //call command from jbod operation
-        int error_seek_disk = jbod_client_operation(encode_operation(num_of_disk, num_of_block, JBOD_SEEK_TO_DISK), NULL);
-        int error_seek_block = jbod_client_operation(encode_operation(num_of_disk, num_of_block, JBOD_SEEK_TO_BLOCK), NULL);
-        int error_read_block = jbod_client_operation(encode_operation(num_of_disk, num_of_block, JBOD_READ_BLOCK), read_buf);
-
-        //return -1 if error ocurred
-        if (error_seek_disk + error_seek_block + error_read_block != 0){
-          //display the error message
-          printf("error, error message: %d", error_seek_disk + error_seek_block + error_read_block);
-          return -1;
-        }
+static void release_conns(mdadm_request_t *req) {
+  mdadm_request_t *granted = NULL;
+  mdadm_request_t *prev = NULL;
+  uint64_t blocked = 0;
 
-        //cache_insert(num_of_disk, num_of_block, read_buf);
+  pthread_mutex_lock(&owner_lock);
+  owned_conns &= ~req->conns;
 
-        have_data = -1;
+  for (mdadm_request_t *waiter = waiting_head; waiter != NULL;){
+    mdadm_request_t *next = waiter->next;
 
-        //cache_insert(num_of_disk, num_of_block, read_buf);
+    if ((waiter->conns & (owned_conns | blocked)) == 0){
+      if (prev != NULL){
+        prev->next = next;
       }
       else{
-        have_data = 1;
+        waiting_head = next;
       }
+      if (waiting_tail == waiter){
+        waiting_tail = prev;
+      }
+      owned_conns |= waiter->conns;
+      waiter->next = granted;
+      granted = waiter;
     }
     else{
-      int error_seek_disk = jbod_client_operation(encode_operation(num_of_disk, num_of_block, JBOD_SEEK_TO_DISK), NULL);
-      int error_seek_block = jbod_client_operation(encode_operation(num_of_disk, num_of_block, JBOD_SEEK_TO_BLOCK), NULL);
-      int error_read_block = jbod_client_operation(encode_operation(num_of_disk, num_of_block, JBOD_READ_BLOCK), read_buf);
-
-        //return -1 if error ocurred
-        if (error_seek_disk + error_seek_block + error_read_block != 0){
-          //display the error message
-          printf("error, error message: %d", error_seek_disk + error_seek_block + error_read_block);
-          return -1;
-        }
+      blocked |= waiter->conns;
+      prev = waiter;
     }
+    waiter = next;
+  }
+  waiting_conns = blocked;
+  pthread_mutex_unlock(&owner_lock);
 
-    //first condition, offset is 0, updated_len <= block size
-    /*
-    copy the content from buf to read_buf by the updated_len
-    increases bytes_write, current_addr by updated_len
-    substract updated_len from updated_len
-    */
-    if(offset_of_block == 0 && updated_len <= JBOD_BLOCK_SIZE - offset_of_block){
-      memcpy(buf + bytes_write, read_buf + offset_of_block, updated_len);
-      bytes_write += updated_len;
-      current_addr += updated_len;
-      updated_len -= updated_len;
-    }
-
-    //second condition, offset is 0, updated_len > block size
-    /*
-    copy the content from buf to the read_buf by the block size
-    bascially read the whole block
-    increases bytes_write, current_addr by block size
-    substract updated_len from block size
-    */
-    else if(offset_of_block == 0 && updated_len > JBOD_BLOCK_SIZE - offset_of_block){
-      memcpy(buf + bytes_write, read_buf + offset_of_block, JBOD_BLOCK_SIZE);
-      bytes_write += JBOD_BLOCK_SIZE;
-      current_addr += JBOD_BLOCK_SIZE;
-      updated_len -= JBOD_BLOCK_SIZE;
-    }
-
-    //third condition, offset is not 0, updated_len <= block size - offset of the block
-    /*
-    copy the content from buf to the read_buf by the block size - offset_of_block
-    handle the case when offset is not 0
-    increases bytes_write, current_addr by block size minus offset_of_block
-    substract updated_len from block size from the block size minus offset_of_block
-    */
-    else if(offset_of_block != 0 && updated_len > JBOD_BLOCK_SIZE - offset_of_block){
-      memcpy(buf + bytes_write , read_buf + offset_of_block, JBOD_BLOCK_SIZE - offset_of_block);
-      bytes_write += JBOD_BLOCK_SIZE - offset_of_block;
-      current_addr += JBOD_BLOCK_SIZE - offset_of_block;
-      updated_len -= JBOD_BLOCK_SIZE - offset_of_block;
-    }
-
-    //forth condition, offset is not 0, updated_len > block size - offset of the block
-    /*
-    copy the content from buf to the read_buf by updated_len
-    handle the case when offset is not 0
-    increases bytes_write, current_addr by updated_len
-    substract updated_len from block size from updated_len
-    */
-    else if(offset_of_block != 0 && updated_len <= JBOD_BLOCK_SIZE - offset_of_block){
-      memcpy(buf + bytes_write, read_buf + offset_of_block, updated_len);
-      bytes_write += updated_len;
-      current_addr += updated_len;
-      updated_len -= updated_len;
-    }
+  while (granted != NULL){
+    mdadm_request_t *next = granted->next;
+    schedule(granted);
+    granted = next;
+  }
+}
 
+//admits a request if the array is mounted and no unmount is waiting for the requests to finish
+static bool request_begin(void) {
+  bool admitted;
 
-    if (cache_enabled()){
-      if(have_data == -1){
-        cache_insert(num_of_disk, num_of_block, read_buf);
-      }
+  pthread_mutex_lock(&request_lock);
+  admitted = isMounted == 1 && !unmounting;
+  if (admitted){
+    num_requests ++;
+  }
+  pthread_mutex_unlock(&request_lock);
+
+  return admitted;
+}
+
+static void request_end(void) {
+  pthread_mutex_lock(&request_lock);
+  num_requests --;
+  if (num_requests == 0){
+    pthread_cond_broadcast(&requests_idle);
+  }
+  pthread_mutex_unlock(&request_lock);
+}
+
+//drop the queued operations; the positions they assumed on the owned connections were never reached
+static void abort_batch(mdadm_request_t *req) {
+  req->batch.len = 0;
+  for (uint32_t disk_num = 0; disk_num < num_disks; disk_num++){
+    jbod_position_t *position = jbod_client_position(disk_num);
+    if (position != NULL && (req->conns & ((uint64_t) 1 << jbod_client_route(disk_num)))){
+      position->disk = -1;
+      position->block = -1;
     }
   }
-  return len;
 }
 
-int mdadm_write(uint32_t addr, uint32_t len, const uint8_t *buf) {
-    //if read_len is 0, return 0 because there is nothing to write to the disk
-  if (len == 0){
-    return 0;
+//the op for |cmd| on |disk_num|, which it names by its number within its node
+static uint32_t disk_operation(uint32_t disk_num, uint32_t block_num, jbod_cmd_t cmd) {
+  return encode_operation(disk_num % JBOD_NUM_DISKS, block_num, cmd);
+}
+
+//room for the operations of |num_blocks| blocks, returns -1 if it cannot be allocated
+static int batch_init(batch_t *batch, uint32_t num_blocks) {
+  batch->len = 0;
+  batch->capacity = num_blocks < BATCH_CAPACITY / BATCH_OPS_PER_BLOCK ? (int) num_blocks * BATCH_OPS_PER_BLOCK : BATCH_CAPACITY;
+  batch->reqs = (jbod_request_t*) malloc(batch->capacity * sizeof(jbod_request_t));
+  return batch->reqs == NULL ? -1 : 0;
+}
+
+//double the room of a full batch, returns -1 once it holds BATCH_CAPACITY operations
+static int batch_grow(batch_t *batch) {
+  if (batch->capacity == BATCH_CAPACITY){
+    return -1;
   }
 
-  //Any potential error will result in -1 as failure
-  if (isMounted == 0 || len > 1024 || len < 0 || buf == NULL || (len + addr) > (256*256*16)){
+  int capacity = batch->capacity * 2 < BATCH_CAPACITY ? batch->capacity * 2 : BATCH_CAPACITY;
+  jbod_request_t *reqs = (jbod_request_t*) realloc(batch->reqs, capacity * sizeof(jbod_request_t));
+  if (reqs == NULL){
     return -1;
   }
 
-  //define necessary variables, updated len needs to be flexible
-  uint32_t current_addr = addr;
-  uint32_t bytes_write = 0;
-  uint32_t updated_len = len;
+  batch->reqs = reqs;
+  batch->capacity = capacity;
+  return 0;
+}
 
-  while (current_addr < len + addr){
-    //define necessary varibales
-    uint8_t write_buf[JBOD_BLOCK_SIZE];
-    uint32_t num_of_disk = current_addr / JBOD_DISK_SIZE;
-    uint32_t num_of_block = current_addr % JBOD_DISK_SIZE / JBOD_BLOCK_SIZE;
-    uint32_t offset_of_block = current_addr % JBOD_BLOCK_SIZE;
+//append one operation on |disk_num| to the batch
+static int queue_op(batch_t *batch, uint32_t disk_num, uint32_t op, uint8_t *block) {
+  if (batch->len == batch->capacity && batch_grow(batch) == -1){
+    return -1;
+  }
 
-    int have_data = 1;
-    
-    //cache implementation
-    if (cache_enabled() == true){
-      if (cache_lookup(num_of_disk, num_of_block, write_buf) == -1){
-        have_data = -1;
-        //jbod operation. In order write something to the disk, we have to read the block first
-        int error_seek_disk = jbod_client_operation(encode_operation(num_of_disk, num_of_block, JBOD_SEEK_TO_DISK), NULL);
-        int error_seek_block = jbod_client_operation(encode_operation(num_of_disk, num_of_block, JBOD_SEEK_TO_BLOCK), NULL);
-        int error_read_block = jbod_client_operation(encode_operation(num_of_disk, num_of_block, JBOD_READ_BLOCK), write_buf);
-        
-        //return -1 if error ocurred
-        if (error_seek_disk + error_seek_block + error_read_block != 0){
-          //display the error message
-          printf("error, error message: %d", error_seek_disk + error_seek_block + error_read_block);
-          return -1;
-        }
+  batch->reqs[batch->len].op = op;
+  batch->reqs[batch->len].block = block;
+  batch->reqs[batch->len].node = disk_num / JBOD_NUM_DISKS;
+  batch->len ++;
+  return 0;
+}
 
-        //cache_insert(num_of_disk, num_of_block, write_buf);
+/* every connection tracks where the device's disk and block pointers are
+ * (see jbod_client_position). JBOD_SEEK_TO_DISK resets the block pointer to 0,
+ * and every JBOD_READ_BLOCK or JBOD_WRITE_BLOCK advances it by one, so a run of
+ * consecutive blocks on the same disk only needs to be seeked once. */
 
-      }
-      else{
-        have_data = 1;
-      }
+//queue the seeks to |disk_num|/|block_num|, skipping the ones that are already satisfied
+static int queue_seek(batch_t *batch, uint32_t disk_num, uint32_t block_num) {
+  jbod_position_t *position = jbod_client_position(disk_num);
+  if (position == NULL){
+    return -1;
+  }
 
+  if (position->disk != (int) disk_num){
+    if (queue_op(batch, disk_num, disk_operation(disk_num, 0, JBOD_SEEK_TO_DISK), NULL) != 0){
+      return -1;
     }
-    else{
-        //jbod operation. In order write something to the disk, we have to read the block first
-        int error_seek_disk = jbod_client_operation(encode_operation(num_of_disk, num_of_block, JBOD_SEEK_TO_DISK), NULL);
-        int error_seek_block = jbod_client_operation(encode_operation(num_of_disk, num_of_block, JBOD_SEEK_TO_BLOCK), NULL);
-        int error_read_block = jbod_client_operation(encode_operation(num_of_disk, num_of_block, JBOD_READ_BLOCK), write_buf);
-        
-        //return -1 if error ocurred
-        if (error_seek_disk + error_seek_block + error_read_block != 0){
-          //display the error message
-          printf("error, error message: %d", error_seek_disk + error_seek_block + error_read_block);
-          return -1;
-        }
+    position->disk = disk_num;
+    position->block = 0;
+    stats_count(STATS_SEEKS_ISSUED, 1);
+  }
+  else{
+    num_commands_saved ++;
+    stats_count(STATS_SEEKS_AVOIDED, 1);
+  }
+
+  if (position->block != (int) block_num){
+    if (queue_op(batch, disk_num, disk_operation(disk_num, block_num, JBOD_SEEK_TO_BLOCK), NULL) != 0){
+      return -1;
     }
-    
+    position->block = block_num;
+    stats_count(STATS_SEEKS_ISSUED, 1);
+  }
+  else{
+    num_commands_saved ++;
+    stats_count(STATS_SEEKS_AVOIDED, 1);
+  }
+
+  return 0;
+}
+
+/* when the server takes the range commands (see JBOD_READ_RANGE), a transfer
+ * is queued as a range instead: it names its own disk and block, so it needs no
+ * seeks, and a block that directly follows the last queued range of the same
+ * kind, on the same disk and in the memory right after it, joins that range
+ * instead of becoming a packet of its own. where the server elides zero
+ * blocks, reads always ask it to, and an all-zero block is written by a range
+ * of its own kind that carries no payload, which consecutive zero blocks join
+ * wherever their buffers are. */
+
+//grow the batch's last op by one block if it is a range like |op| that |block_num| and |block| continue
+static bool extend_range(batch_t *batch, uint32_t disk_num, uint32_t op, uint32_t block_num, uint8_t *block) {
+  if (batch->len == 0){
+    return false;
+  }
+
+  jbod_request_t *last = &batch->reqs[batch->len - 1];
+  uint32_t count = last->op & JBOD_RANGE_COUNT_MASK;
+  uint32_t kind_mask = ~((uint32_t) 0xff << 20 | JBOD_RANGE_COUNT_MASK);
+
+  if ((last->op & kind_mask) != (op & kind_mask) || last->node != (int) (disk_num / JBOD_NUM_DISKS) ||
+      ((last->op >> 20) & 0xff) + count != block_num || count == JBOD_RANGE_MAX_BLOCKS){
+    return false;
+  }
+  if (block == NULL ? last->block != NULL : last->block == NULL || last->block + count * JBOD_BLOCK_SIZE != block){
+    return false;
+  }
+
+  last->op ++;
+  return true;
+}
+
+//queue a transfer of one block as part of a range command, the device ends up just past it
+static int queue_range(batch_t *batch, uint32_t range_cmd, uint32_t disk_num, uint32_t block_num, uint8_t *block) {
+  uint32_t op = disk_operation(disk_num, block_num, (jbod_cmd_t) range_cmd);
+
+  if (jbod_client_zero_elision(disk_num)){
+    if (range_cmd == JBOD_READ_RANGE){
+      op |= JBOD_RANGE_ZERO_ELIDE;
+    }
+    else if (block_is_zero(block)){
+      op |= JBOD_RANGE_ZERO_ELIDE;
+      block = NULL;
+    }
+  }
+
+  if (extend_range(batch, disk_num, op, block_num, block)){
+    stats_count(STATS_BLOCKS_COALESCED, 1);
+  }
+  else if (queue_op(batch, disk_num, op | 1, block) != 0){
+    return -1;
+  }
+
+  jbod_position_t *position = jbod_client_position(disk_num);
+  position->disk = disk_num;
+  position->block = block_num + 1;
+  return 0;
+}
+
+/* copies a cached block to |buf| and sets |missed| if it has to come from the
+ * device instead. returns -1 for a dirty block that failed its checksum in the
+ * cache: the device only has an older copy, so the request fails. */
+static int lookup_block(uint32_t disk_num, uint32_t block_num, uint8_t *buf, bool *missed) {
+  *missed = !cache_enabled() || cache_lookup(disk_num, block_num, buf) != 1;
+  return *missed && cache_is_corrupt(disk_num, block_num) ? -1 : 0;
+}
+
+//queue a read of one block into |block|, which must stay valid until the batch completes
+static int queue_read(batch_t *batch, uint32_t disk_num, uint32_t block_num, uint8_t *block) {
+  if (jbod_client_ranges(disk_num)){
+    return queue_range(batch, JBOD_READ_RANGE, disk_num, block_num, block);
+  }
+
+  if (queue_seek(batch, disk_num, block_num) != 0 || queue_op(batch, disk_num, disk_operation(disk_num, block_num, JBOD_READ_BLOCK), block) != 0){
+    return -1;
+  }
+
+  jbod_client_position(disk_num)->block ++;
+  return 0;
+}
+
+//queue a write of one block from |block|, which must stay valid until the batch completes
+static int queue_write(batch_t *batch, uint32_t disk_num, uint32_t block_num, uint8_t *block) {
+  if (jbod_client_ranges(disk_num)){
+    return queue_range(batch, JBOD_WRITE_RANGE, disk_num, block_num, block);
+  }
+
+  if (queue_seek(batch, disk_num, block_num) != 0 || queue_op(batch, disk_num, disk_operation(disk_num, block_num, JBOD_WRITE_BLOCK), block) != 0){
+    return -1;
+  }
+
+  jbod_client_position(disk_num)->block ++;
+  return 0;
+}
+
+/*
+readahead keeps a few sequential streams. a read that starts where an earlier
+one ended continues that stream, and once fewer than half a window of blocks
+past it are prefetched, the next window is read along with the request's own
+misses. the prefetch continues from where those reads leave the device
+pointer, so it adds no round trip and, for a steady scan, no seek. the window
+is planned when the request is submitted, so the request takes the connections
+of the disks it maps to along with its own. the window doubles while the stream
+keeps consuming what was prefetched and halves when prefetched blocks are
+evicted unused.
+*/
+#define READAHEAD_STREAMS 8
+#define READAHEAD_MIN_WINDOW 4
+
+typedef struct {
+  bool active;
+  uint32_t next_block;  /* the block a sequential reader asks for next */
+  uint32_t ahead_until; /* the last block prefetched for the stream */
+  uint32_t window;
+  int last_wasted;      /* cache_prefetch_wasted() at the stream's last request */
+  uint64_t last_used;
+} readahead_stream_t;
+
+static readahead_stream_t streams[READAHEAD_STREAMS];
+static uint32_t readahead_max = 0;
+static uint64_t readahead_clock = 0;
+static pthread_mutex_t readahead_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int mdadm_set_readahead(uint32_t max_blocks) {
+  if (max_blocks > READAHEAD_MAX_BLOCKS){
+    return -1;
+  }
+
+  pthread_mutex_lock(&readahead_lock);
+  readahead_max = max_blocks;
+  memset(streams, 0, sizeof(streams));
+  pthread_mutex_unlock(&readahead_lock);
+
+  return 1;
+}
+
+//returns how many blocks from *start on to prefetch after a read of [first_block, last_block]
+static uint32_t readahead_plan(uint32_t first_block, uint32_t last_block, uint32_t *start) {
+  uint32_t count = 0;
+
+  pthread_mutex_lock(&readahead_lock);
+
+  if (readahead_max == 0 || !cache_enabled()){
+    pthread_mutex_unlock(&readahead_lock);
+    return 0;
+  }
 
-    //implementation logic is described in read_madam function
-    //first condition, offset is 0, updated_len <= block size
-    if(offset_of_block == 0 && updated_len <= JBOD_BLOCK_SIZE - offset_of_block){
-      memcpy(write_buf + offset_of_block, buf + bytes_write, updated_len);
-      bytes_write += updated_len;
-      current_addr += updated_len;
-      updated_len -= updated_len;
+  //an unaligned sequential reader starts inside the block the previous read ended in
+  readahead_stream_t *stream = NULL;
+  readahead_stream_t *victim = &streams[0];
+  for (int i = 0; i < READAHEAD_STREAMS; i++){
+    if (streams[i].active && (first_block == streams[i].next_block || first_block + 1 == streams[i].next_block)){
+      stream = &streams[i];
+      break;
     }
+    if (!streams[i].active || (victim->active && streams[i].last_used < victim->last_used)){
+      victim = &streams[i];
+    }
+  }
+
+  int wasted = cache_prefetch_wasted();
+
+  //a new stream is only read ahead once the next request continues it
+  if (stream == NULL){
+    victim->active = true;
+    victim->next_block = last_block + 1;
+    victim->ahead_until = last_block;
+    victim->window = readahead_max < READAHEAD_MIN_WINDOW ? readahead_max : READAHEAD_MIN_WINDOW;
+    victim->last_wasted = wasted;
+    victim->last_used = ++readahead_clock;
+    pthread_mutex_unlock(&readahead_lock);
+    return 0;
+  }
+
+  if (wasted > stream->last_wasted){
+    stream->window = stream->window > 1 ? stream->window / 2 : 1;
+  }
+  else if (first_block <= stream->ahead_until){
+    stream->window = stream->window * 2 < readahead_max ? stream->window * 2 : readahead_max;
+  }
+  stream->last_wasted = wasted;
+  stream->next_block = last_block + 1;
+  stream->last_used = ++readahead_clock;
+
+  uint32_t from = (stream->ahead_until > last_block ? stream->ahead_until : last_block) + 1;
+  uint32_t until = last_block + stream->window;
+  if (until > array_blocks - 1){
+    until = array_blocks - 1;
+  }
+
+  //refill only when less than half a window is left, so prefetches come in large batches
+  if (from <= until && stream->ahead_until < last_block + stream->window / 2){
+    *start = from;
+    count = until - from + 1;
+    stream->ahead_until = until;
+  }
+
+  pthread_mutex_unlock(&readahead_lock);
+  return count;
+}
+
+uint64_t mdadm_commands_saved(void) {
+  return num_commands_saved;
+}
+
+//the block of the disks that block |block_id| of the array maps to, numbered disk * JBOD_NUM_BLOCKS_PER_DISK + block
+static uint32_t device_block(uint32_t block_id) {
+  uint32_t disk_num;
+  uint32_t block_num;
+
+  map_block(block_id, &disk_num, &block_num);
+  return disk_num * JBOD_NUM_BLOCKS_PER_DISK + block_num;
+}
+
+//remember |block| as what the disks hold at |device_id|
+static void expect_block(uint32_t device_id, const uint8_t *block) {
+  if (verify){
+    expected_crcs[device_id] = CRC_KNOWN | block_crc32c(block);
+  }
+}
+
+//forget what the disks hold at |device_id|, after a write that may or may not have reached them
+static void forget_block(uint32_t device_id) {
+  expected_crcs[device_id] = 0;
+}
+
+//checks a block that arrived from |device_id|, returns false if it is not what it should be
+static bool check_block(uint32_t device_id, const uint8_t *block) {
+  if (!verify){
+    return true;
+  }
+
+  uint32_t crc = block_crc32c(block);
+  if ((expected_crcs[device_id] & CRC_KNOWN) && (uint32_t) expected_crcs[device_id] != crc){
+    fprintf(stderr, "error, block %u of disk %u fails its checksum\n", device_id % JBOD_NUM_BLOCKS_PER_DISK, device_id / JBOD_NUM_BLOCKS_PER_DISK);
+    stats_count(STATS_CHECKSUM_ERRORS, 1);
+    return false;
+  }
+
+  expected_crcs[device_id] = CRC_KNOWN | crc;
+  return true;
+}
+
+static int compare_block_ids(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *) a;
+  uint32_t y = *(const uint32_t *) b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+//true when the request [addr, addr + len) overwrites every byte of block |block_id|
+static bool block_covered(uint32_t block_id, uint32_t addr, uint32_t len) {
+  uint32_t block_start = block_id * JBOD_BLOCK_SIZE;
+  return block_start >= addr && block_start + JBOD_BLOCK_SIZE <= addr + len;
+}
+
+/* the blocks of a chunk are queued disk by disk, each disk's in block order,
+ * so blocks that a striped layout deals out to different disks still form runs
+ * of seekless transfers or ranges. fills |order| with the block ids from
+ * |chunk_first| to |chunk_last| in that order. */
+static void chunk_order(uint32_t chunk_first, uint32_t chunk_last, uint32_t *order) {
+  uint32_t first_unit = chunk_first / stripe_blocks;
+  uint32_t last_unit = chunk_last / stripe_blocks;
+  int count = 0;
 
-    //second condition, offset is 0, updated_len > block size
-    else if(offset_of_block == 0 && updated_len > JBOD_BLOCK_SIZE - offset_of_block){
-      memcpy(write_buf + offset_of_block, buf + bytes_write, JBOD_BLOCK_SIZE);
-      bytes_write += JBOD_BLOCK_SIZE;
-      current_addr += JBOD_BLOCK_SIZE;
-      updated_len -= JBOD_BLOCK_SIZE;
+  //the units of one disk are |num_disks| apart
+  for (uint32_t disk_unit = first_unit; disk_unit <= last_unit && disk_unit < first_unit + num_disks; disk_unit++){
+    for (uint32_t unit = disk_unit; unit <= last_unit; unit += num_disks){
+      uint32_t first = unit * stripe_blocks > chunk_first ? unit * stripe_blocks : chunk_first;
+      uint32_t last = (unit + 1) * stripe_blocks - 1 < chunk_last ? (unit + 1) * stripe_blocks - 1 : chunk_last;
+      for (uint32_t block_id = first; block_id <= last; block_id++){
+        order[count] = block_id;
+        count ++;
+      }
     }
+  }
+}
+
+/* in a layout striped in units smaller than a chunk, the blocks a chunk reads
+ * from or writes to one disk are spread over the request buffer, and a range
+ * command only takes blocks that are contiguous in memory. such a chunk goes
+ * through |stage| instead, where its blocks lie in the order they are queued,
+ * so each disk's run is one range again. that only pays once the request
+ * comes back to a disk. allocates |stage| if the chunks of |req| need it,
+ * returns 0 on success and -1 on failure. */
+static int stage_alloc(mdadm_request_t *req) {
+  uint32_t num_units = req->last_block / stripe_blocks - req->first_block / stripe_blocks + 1;
 
-    //third condition, offset is not 0, updated_len <= block size - offset of the block
-    else if(offset_of_block != 0 && updated_len > JBOD_BLOCK_SIZE - offset_of_block){
-      memcpy(write_buf + offset_of_block, buf + bytes_write, JBOD_BLOCK_SIZE - offset_of_block);
-      bytes_write += JBOD_BLOCK_SIZE - offset_of_block;
-      current_addr += JBOD_BLOCK_SIZE - offset_of_block;
-      updated_len -= JBOD_BLOCK_SIZE - offset_of_block;
+  if (stripe_blocks < BLOCKS_PER_CHUNK && num_units > num_disks && req->stage == NULL){
+    req->stage = malloc(BLOCKS_PER_CHUNK * JBOD_BLOCK_SIZE);
+    if (req->stage == NULL){
+      return -1;
     }
+  }
+  return 0;
+}
+
+//copy the part of block |block_id| that overlaps [addr, addr + len) between |block| and the request buffer
+static void copy_overlap(uint32_t block_id, uint32_t addr, uint32_t len, uint8_t *block, uint8_t *request_buf, bool to_request) {
+  uint32_t block_start = block_id * JBOD_BLOCK_SIZE;
+  uint32_t start = block_start > addr ? block_start : addr;
+  uint32_t end = block_start + JBOD_BLOCK_SIZE < addr + len ? block_start + JBOD_BLOCK_SIZE : addr + len;
+
+  if (to_request){
+    memcpy(request_buf + (start - addr), block + (start - block_start), end - start);
+  }
+  else{
+    memcpy(block + (start - block_start), request_buf + (start - addr), end - start);
+  }
+}
+
+/*
+a degraded read cannot get the blocks of the failed disk from it. each one the
+cache misses is rebuilt after the batch as the XOR of the rest of its parity
+group: the blocks of the other disks the chunk reads anyway, and into |peers|
+the ones it does not, queued disk by disk behind the chunk's own reads so they
+still form runs. a chunk is cut short where it would rebuild more than
+GROUPS_PER_CHUNK blocks.
+*/
+static uint32_t degraded_chunk_last(mdadm_request_t *req, uint32_t chunk_first, uint32_t chunk_last) {
+  uint32_t num_failed = 0;
 
-    //forth condition, offset is not 0, updated_len > block size - offset of the block
-    else if(offset_of_block != 0 && updated_len <= JBOD_BLOCK_SIZE - offset_of_block){
-      memcpy(write_buf + offset_of_block, buf + bytes_write, updated_len);
-      bytes_write += updated_len;
-      current_addr += updated_len;
-      updated_len -= updated_len;
+  for (uint32_t block_id = chunk_first; block_id <= chunk_last; block_id++){
+    uint32_t disk_num;
+    uint32_t block_num;
+
+    map_block(block_id, &disk_num, &block_num);
+    if ((int) disk_num == req->failed_disk){
+      if (num_failed == GROUPS_PER_CHUNK){
+        return block_id - 1;
+      }
+      num_failed ++;
     }
+  }
+  return chunk_last;
+}
 
-    //have to seek the block, because the jbod read will direct the software to next disk, we have to seek disk again to not write the content to the wrong disk
-    int error_seek_disk = jbod_client_operation(encode_operation(num_of_disk, num_of_block, JBOD_SEEK_TO_DISK), NULL);
-    int error_seek_block = jbod_client_operation(encode_operation(num_of_disk, num_of_block, JBOD_SEEK_TO_BLOCK), NULL);
+//queue the reads of what the blocks in |rebuilt| are rebuilt from, once the chunk's own reads are queued
+static int queue_rebuilds(mdadm_request_t *req) {
+  uint32_t num_peers = 0;
 
-    //again, return -1 if error ocurred
-    if (error_seek_block + error_seek_disk != 0){
-      //display the error message
-      printf("error, error message: %d", error_seek_disk + error_seek_block);
+  if (req->num_rebuilt > 0 && req->peers == NULL){
+    req->peers = malloc(GROUPS_PER_CHUNK * DATA_DISKS * JBOD_BLOCK_SIZE);
+    if (req->peers == NULL){
       return -1;
     }
+  }
+
+  for (uint32_t disk_num = 0; disk_num < JBOD_NUM_DISKS; disk_num++){
+    for (uint32_t r = 0; r < req->num_rebuilt && (int) disk_num != req->failed_disk; r++){
+      uint32_t failed_num;
+      uint32_t block_num;
 
-    if (cache_enabled()){
-      if(have_data == -1){
-        cache_insert(num_of_disk, num_of_block, write_buf);
+      map_block(req->rebuilt[r], &failed_num, &block_num);
+
+      if (disk_num != parity_disk(block_num / stripe_blocks)){
+        uint32_t block_id = group_member(block_num, disk_num);
+        if (block_id >= req->chunk_first && block_id <= req->chunk_last){
+          req->rebuild_bufs[r][disk_num] = req->chunk_bufs[block_id - req->chunk_first];
+          continue;
+        }
       }
-      else{
-        cache_update(num_of_disk, num_of_block, write_buf);
+
+      uint8_t *peer = req->peers[num_peers];
+      num_peers ++;
+      req->rebuild_bufs[r][disk_num] = peer;
+      bool missed;
+      if (lookup_block(disk_num, block_num, peer, &missed) != 0 || (missed && queue_read(&req->batch, disk_num, block_num, peer) != 0)){
+        return -1;
       }
-      //cache_update(num_of_disk, num_of_block, write_buf);
     }
+  }
 
-    //call write_block command
-    int error_write_block = jbod_client_operation(encode_operation(num_of_disk, num_of_block, JBOD_WRITE_BLOCK), write_buf);
-    
+  return 0;
+}
 
-    //return -1 if error ocurred
-    if (error_write_block != 0){
-      //display error message
-      printf("error, error message: %d", error_write_block);
-      return -1;
+//the XOR of |blocks|, one per disk, but for |skip_disk|'s, into |block|
+static void xor_blocks(uint8_t *block, uint8_t *blocks[JBOD_NUM_DISKS], int skip_disk) {
+  bool first = true;
+
+  for (int disk_num = 0; disk_num < JBOD_NUM_DISKS; disk_num++){
+    if (disk_num == skip_disk){
+      continue;
     }
+    if (first){
+      memcpy(block, blocks[disk_num], JBOD_BLOCK_SIZE);
+      first = false;
+    }
+    else{
+      block_xor(block, blocks[disk_num]);
+    }
+  }
+}
+
+//true if another read provides block |block_id| of |req|
+static bool block_provided(const mdadm_request_t *req, uint32_t block_id) {
+  uint32_t i = block_id - req->first_block;
+  return req->provided != NULL && (req->provided[i / 64] & (1ull << (i % 64))) != 0;
+}
 
+/* the read phase walks the request one chunk of BLOCKS_PER_CHUNK blocks per
+ * batch, so memory stays bounded whatever the length, and queues a chunk disk
+ * by disk (see chunk_order). consecutive misses on the same disk form a run:
+ * queue_seek only queues seeks for the first block of the run, the rest are
+ * back to back JBOD_READ_BLOCKs because the device advances its block pointer
+ * by itself, or the run becomes one JBOD_READ_RANGE where the server has them.
+ * a cache hit in the middle of a run makes the next miss seek again. fully
+ * covered blocks land straight in |buf|, only the partial head and tail blocks
+ * are staged, unless the whole chunk is (see stage_alloc). */
+static int plan_read(mdadm_request_t *req) {
+  uint32_t chunk_first = req->chunk_first;
+  uint32_t chunk_last = chunk_first + BLOCKS_PER_CHUNK - 1 < req->last_block ? chunk_first + BLOCKS_PER_CHUNK - 1 : req->last_block;
 
+  if (req->failed_disk != -1){
+    chunk_last = degraded_chunk_last(req, chunk_first, chunk_last);
   }
+  req->chunk_last = chunk_last;
+  req->num_rebuilt = 0;
+
+  if (chunk_first == req->first_block && req->ahead_count > 0){
+    req->blocks = malloc(req->ahead_count * JBOD_BLOCK_SIZE);
+    if (req->blocks == NULL){
+      req->ahead_count = 0;
+    }
+  }
+
+  uint32_t order[BLOCKS_PER_CHUNK];
+  if (stage_alloc(req) != 0){
+    return -1;
+  }
+  chunk_order(chunk_first, chunk_last, order);
+
+  for (uint32_t i = 0; i <= chunk_last - chunk_first; i++){
+    uint32_t block_id = order[i];
+    uint32_t num_of_disk;
+    uint32_t num_of_block;
+    uint8_t *read_buf;
+
+    map_block(block_id, &num_of_disk, &num_of_block);
+
+    //another read fetches it and copies it over, see add_read
+    if (block_provided(req, block_id)){
+      req->missed[block_id - chunk_first] = false;
+      continue;
+    }
+
+    if (req->stage != NULL){
+      read_buf = req->stage[i];
+    }
+    else if (block_covered(block_id, req->addr, req->len)){
+      read_buf = req->buf + (block_id * JBOD_BLOCK_SIZE - req->addr);
+    }
+    else{
+      read_buf = block_id == req->first_block ? req->head_buf : req->tail_buf;
+    }
+    req->chunk_bufs[block_id - chunk_first] = read_buf;
+
+    //cache implementation, only a miss goes to the device, or is rebuilt if its disk failed
+    if (lookup_block(num_of_disk, num_of_block, read_buf, &req->missed[block_id - chunk_first]) != 0){
+      return -1;
+    }
+    if (req->missed[block_id - chunk_first] && (int) num_of_disk == req->failed_disk){
+      req->rebuilt[req->num_rebuilt] = block_id;
+      req->num_rebuilt ++;
+    }
+    else if (req->missed[block_id - chunk_first] && queue_read(&req->batch, num_of_disk, num_of_block, read_buf) != 0){
+      return -1;
+    }
+  }
+
+  if (queue_rebuilds(req) != 0){
+    return -1;
+  }
+
+  //the readahead rides in the last chunk's batch, right behind the request's own reads
+  if (chunk_last == req->last_block && req->ahead_count > 0){
+    chunk_order(req->ahead_first, req->ahead_first + req->ahead_count - 1, order);
+  }
+  req->ahead_cached = 0;
+  for (uint32_t i = 0; chunk_last == req->last_block && i < req->ahead_count; i++){
+    uint32_t num_of_disk;
+    uint32_t num_of_block;
+
+    //the failed disk's blocks are not worth rebuilding ahead of time, and cached ones need no read
+    map_block(order[i], &num_of_disk, &num_of_block);
+    if ((int) num_of_disk == req->failed_disk){
+      continue;
+    }
+    if (cache_contains(num_of_disk, num_of_block)){
+      req->ahead_cached |= 1ull << i;
+      continue;
+    }
+    if (queue_read(&req->batch, num_of_disk, num_of_block, req->blocks[i]) != 0){
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static void complete_read(mdadm_request_t *req) {
+  if (req->batch_result != 0){
+    //display the error message
+    printf("error, failed to read %u bytes at %u", req->len, req->addr);
+    req->result = -1;
+    req->phase = PHASE_DONE;
+    return;
+  }
+
+  for (uint32_t r = 0; r < req->num_rebuilt; r++){
+    xor_blocks(req->chunk_bufs[req->rebuilt[r] - req->chunk_first], req->rebuild_bufs[r], req->failed_disk);
+    stats_count(STATS_BLOCKS_REBUILT, 1);
+  }
+
+  for (uint32_t block_id = req->chunk_first; block_id <= req->chunk_last; block_id++){
+    if (req->missed[block_id - req->chunk_first] && !check_block(device_block(block_id), req->chunk_bufs[block_id - req->chunk_first])){
+      req->result = -1;
+      req->phase = PHASE_DONE;
+      return;
+    }
+  }
+
+  for (uint32_t block_id = req->chunk_first; block_id <= req->chunk_last; block_id++){
+    uint8_t *read_buf = req->chunk_bufs[block_id - req->chunk_first];
+
+    if (block_provided(req, block_id)){
+      continue;
+    }
+    if (!block_covered(block_id, req->addr, req->len) || req->stage != NULL){
+      copy_overlap(block_id, req->addr, req->len, read_buf, req->buf, true);
+    }
+
+    if (cache_enabled() && req->missed[block_id - req->chunk_first]){
+      uint32_t num_of_disk;
+      uint32_t num_of_block;
+
+      map_block(block_id, &num_of_disk, &num_of_block);
+      cache_insert(num_of_disk, num_of_block, read_buf);
+    }
+  }
+
+  if (req->chunk_last < req->last_block){
+    req->chunk_first = req->chunk_last + 1;
+    return;
+  }
+
+  //blocks that are already cached keep their contents, a dirty one is newer than what was read
+  uint32_t order[BLOCKS_PER_CHUNK];
+  if (req->ahead_count > 0){
+    chunk_order(req->ahead_first, req->ahead_first + req->ahead_count - 1, order);
+  }
+  for (uint32_t i = 0; i < req->ahead_count; i++){
+    uint32_t device_id = device_block(order[i]);
+
+    if ((req->ahead_cached & (1ull << i)) || (int) (device_id / JBOD_NUM_BLOCKS_PER_DISK) == req->failed_disk || !check_block(device_id, req->blocks[i])){
+      continue;
+    }
+    cache_prefetch(device_id / JBOD_NUM_BLOCKS_PER_DISK, device_id % JBOD_NUM_BLOCKS_PER_DISK, req->blocks[i]);
+  }
+
+  req->result = req->len;
+  req->phase = PHASE_DONE;
+}
+
+/* only the partial head and tail blocks of a write need their old contents
+ * (from the cache or from the device) to be merged with the new bytes, and
+ * those reads go out as one pipelined batch before any block is written. */
+static int plan_write_edges(mdadm_request_t *req) {
+  //read-modify-write only when the block is partially overwritten, which can only be the first or the last one
+  uint32_t edge_blocks[2] = { req->first_block, req->last_block };
+
+  for (int edge = 0; edge < 2; edge++){
+    uint32_t block_id = edge_blocks[edge];
+    uint32_t num_of_disk;
+    uint32_t num_of_block;
+    uint8_t *write_buf = block_id == req->first_block ? req->head_buf : req->tail_buf;
+
+    map_block(block_id, &num_of_disk, &num_of_block);
+    req->missed[edge] = false;
+    if ((edge == 1 && req->first_block == req->last_block) || block_covered(block_id, req->addr, req->len)){
+      continue;
+    }
+
+    if (lookup_block(num_of_disk, num_of_block, write_buf, &req->missed[edge]) != 0 ||
+        (req->missed[edge] && queue_read(&req->batch, num_of_disk, num_of_block, write_buf) != 0)){
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static void complete_write_edges(mdadm_request_t *req) {
+  if (req->batch_result != 0){
+    //display the error message
+    printf("error, failed to read the partial blocks of %u bytes at %u", req->len, req->addr);
+    req->result = -1;
+    req->phase = PHASE_DONE;
+    return;
+  }
+
+  if ((req->missed[0] && !check_block(device_block(req->first_block), req->head_buf)) || (req->missed[1] && !check_block(device_block(req->last_block), req->tail_buf))){
+    req->result = -1;
+    req->phase = PHASE_DONE;
+    return;
+  }
+
+  req->phase = PHASE_WRITE;
+  req->chunk_first = req->first_block;
+}
+
+/* blocks that are fully covered by the request are written straight from
+ * |buf|, and since every JBOD_WRITE_BLOCK advances the block pointer, a run of
+ * them needs no seek after the first one. with a write-back cache a block only
+ * goes to the device when its shard has no clean entry left to make room for
+ * it, the rest wait for a flush. |missed| marks the blocks sent. */
+static int plan_write(mdadm_request_t *req) {
+  uint32_t chunk_first = req->chunk_first;
+  uint32_t chunk_last = chunk_first + BLOCKS_PER_CHUNK - 1 < req->last_block ? chunk_first + BLOCKS_PER_CHUNK - 1 : req->last_block;
+
+  req->chunk_last = chunk_last;
+
+  uint32_t order[BLOCKS_PER_CHUNK];
+  if (stage_alloc(req) != 0){
+    return -1;
+  }
+  chunk_order(chunk_first, chunk_last, order);
+
+  for (uint32_t i = 0; i <= chunk_last - chunk_first; i++){
+    uint32_t block_id = order[i];
+    uint32_t num_of_disk;
+    uint32_t num_of_block;
+    uint8_t *write_buf;
+
+    map_block(block_id, &num_of_disk, &num_of_block);
+
+    if (block_covered(block_id, req->addr, req->len)){
+      //the packet layer only reads the block, so it is sent from the caller's buffer as is
+      write_buf = req->buf + (block_id * JBOD_BLOCK_SIZE - req->addr);
+    }
+    else{
+      write_buf = block_id == req->first_block ? req->head_buf : req->tail_buf;
+      copy_overlap(block_id, req->addr, req->len, write_buf, req->buf, false);
+    }
+    if (req->stage != NULL){
+      memcpy(req->stage[i], write_buf, JBOD_BLOCK_SIZE);
+      write_buf = req->stage[i];
+    }
+
+    //the cache keeps the new contents whether or not the block was cached before
+    if (cache_write_back()){
+      if (cache_write(num_of_disk, num_of_block, write_buf) == 1){
+        write_buf = NULL;
+      }
+    }
+    else if (cache_enabled()){
+      if (cache_insert(num_of_disk, num_of_block, write_buf) == -1){
+        cache_update(num_of_disk, num_of_block, write_buf);
+      }
+    }
+
+    req->chunk_bufs[block_id - chunk_first] = write_buf;
+    req->missed[block_id - chunk_first] = write_buf != NULL;
+    if (write_buf != NULL && queue_write(&req->batch, num_of_disk, num_of_block, write_buf) != 0){
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static void complete_write(mdadm_request_t *req) {
+  for (uint32_t block_id = req->chunk_first; block_id <= req->chunk_last; block_id++){
+    if (req->missed[block_id - req->chunk_first]){
+      if (req->batch_result == 0){
+        expect_block(device_block(block_id), req->chunk_bufs[block_id - req->chunk_first]);
+      }
+      else{
+        forget_block(device_block(block_id));
+      }
+    }
+  }
+
+  if (req->batch_result != 0){
+    //display error message
+    printf("error, failed to write %u bytes at %u", req->len, req->addr);
+    req->result = -1;
+    req->phase = PHASE_DONE;
+    return;
+  }
+
+  if (req->chunk_last < req->last_block){
+    req->chunk_first = req->chunk_last + 1;
+    return;
+  }
+
+  req->result = req->len;
+  req->phase = PHASE_DONE;
+}
+
+/*
+a RAID5 write goes through the parity groups of the rows it touches, block b of
+every disk of a row making a group, in chunks of up to GROUPS_PER_CHUNK groups.
+the blocks of a chunk lie in |stage| disk by disk, so a disk's blocks are
+consecutive in memory and on the disk and queue as one run. how a group's
+parity is brought up to date decides what is read first (see stripe_mode_t):
+nothing when every data block of it is written whole, otherwise the fewer of
+the old parity with the written blocks and the blocks not written. blocks the
+cache has, parity included, are not read. a RAID5 write owns every connection,
+so nothing changes a group between its reads and its writes.
+chunk_first and chunk_last count groups, by their block on the disks.
+*/
+
+//the last group of a RAID5 write, the end of the row its last block is in
+static uint32_t stripe_last_group(mdadm_request_t *req) {
+  return (req->last_block / stripe_blocks / DATA_DISKS + 1) * stripe_blocks - 1;
+}
+
+//disk |disk_num|'s block of group |g| of the chunk
+static uint8_t *stripe_slot(mdadm_request_t *req, uint32_t g, uint32_t disk_num) {
+  return req->stage[disk_num * GROUPS_PER_CHUNK + g];
+}
+
+//plans the group at |block_num| into |group|, returns false if the write has no block in it
+static bool stripe_group_plan(mdadm_request_t *req, uint32_t block_num, stripe_group_t *group) {
+  uint32_t row = block_num / stripe_blocks;
+  uint32_t base = row * DATA_DISKS * stripe_blocks + block_num % stripe_blocks;
+
+  //the data blocks of the group are base + k * stripe_blocks for k below DATA_DISKS
+  uint32_t k = req->first_block <= base ? 0 : (req->first_block - base + stripe_blocks - 1) / stripe_blocks;
+  if (k >= DATA_DISKS || base + k * stripe_blocks > req->last_block){
+    return false;
+  }
+
+  group->block_num = block_num;
+  group->parity_disk = parity_disk(row);
+  group->written = 0;
+  group->partial = 0;
+
+  for (uint32_t disk_num = 0; disk_num < JBOD_NUM_DISKS; disk_num++){
+    uint32_t block_id = group_member(block_num, disk_num);
+
+    if (disk_num != group->parity_disk && block_id >= req->first_block && block_id <= req->last_block){
+      group->written |= 1u << disk_num;
+      if (!block_covered(block_id, req->addr, req->len)){
+        group->partial |= 1u << disk_num;
+      }
+    }
+  }
+
+  uint32_t parity = 1u << group->parity_disk;
+  uint32_t data = ((1u << JBOD_NUM_DISKS) - 1) & ~parity;
+  uint32_t failed = req->failed_disk == -1 ? 0 : 1u << req->failed_disk;
+  int rmw_reads = __builtin_popcount(group->written) + 1;
+  int reconstruct_reads = DATA_DISKS - __builtin_popcount(group->written) + __builtin_popcount(group->partial);
+
+  if (group->written == data && group->partial == 0){
+    group->mode = STRIPE_FULL;
+    group->reads = 0;
+  }
+  else if (failed == parity){
+    group->mode = STRIPE_NO_PARITY;
+    group->reads = group->partial;
+  }
+  else if (failed & group->partial){
+    group->mode = STRIPE_REBUILD;
+    group->reads = ((1u << JBOD_NUM_DISKS) - 1) & ~failed;
+  }
+  //the old contents of a written block of the failed disk are gone, those of a block not written can be read
+  else if ((failed & group->written) == 0 && (rmw_reads <= reconstruct_reads || (failed & data) != 0)){
+    group->mode = STRIPE_RMW;
+    group->reads = group->written | parity;
+  }
+  else{
+    group->mode = STRIPE_RECONSTRUCT;
+    group->reads = (data & ~group->written) | group->partial;
+  }
+
+  return true;
+}
+
+static int plan_stripe_read(mdadm_request_t *req) {
+  uint32_t last_group = stripe_last_group(req);
+  uint32_t block_num;
+
+  if (req->stage == NULL){
+    req->stage = malloc(BLOCKS_PER_CHUNK * JBOD_BLOCK_SIZE);
+    if (req->stage == NULL){
+      return -1;
+    }
+  }
+
+  req->num_groups = 0;
+  for (block_num = req->chunk_first; block_num <= last_group && req->num_groups < GROUPS_PER_CHUNK; block_num++){
+    if (stripe_group_plan(req, block_num, &req->groups[req->num_groups])){
+      req->num_groups ++;
+    }
+  }
+  req->chunk_last = block_num - 1;
+  memset(req->missed, 0, sizeof(req->missed));
+
+  for (uint32_t disk_num = 0; disk_num < JBOD_NUM_DISKS; disk_num++){
+    for (uint32_t g = 0; g < req->num_groups; g++){
+      stripe_group_t *group = &req->groups[g];
+      uint8_t *block = stripe_slot(req, g, disk_num);
+      uint32_t i = disk_num * GROUPS_PER_CHUNK + g;
+
+      if ((group->reads & (1u << disk_num)) == 0){
+        continue;
+      }
+
+      if (lookup_block(disk_num, group->block_num, block, &req->missed[i]) != 0){
+        return -1;
+      }
+      if (req->missed[i] && queue_read(&req->batch, disk_num, group->block_num, block) != 0){
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+//puts the new contents of group |g|'s written blocks in the stage and brings its parity up to date
+static void stripe_merge(mdadm_request_t *req, uint32_t g) {
+  stripe_group_t *group = &req->groups[g];
+  uint8_t *blocks[JBOD_NUM_DISKS];
+
+  for (uint32_t disk_num = 0; disk_num < JBOD_NUM_DISKS; disk_num++){
+    blocks[disk_num] = stripe_slot(req, g, disk_num);
+  }
+  uint8_t *parity = blocks[group->parity_disk];
+
+  if (group->mode == STRIPE_REBUILD){
+    xor_blocks(blocks[req->failed_disk], blocks, req->failed_disk);
+    stats_count(STATS_BLOCKS_REBUILT, 1);
+  }
+
+  //a read-modify-write takes each block's old contents out of the parity and puts the new ones in
+  for (uint32_t disk_num = 0; disk_num < JBOD_NUM_DISKS; disk_num++){
+    if ((group->written & (1u << disk_num)) == 0){
+      continue;
+    }
+    if (group->mode == STRIPE_RMW){
+      block_xor(parity, blocks[disk_num]);
+    }
+    copy_overlap(group_member(group->block_num, disk_num), req->addr, req->len, blocks[disk_num], req->buf, false);
+    if (group->mode == STRIPE_RMW){
+      block_xor(parity, blocks[disk_num]);
+    }
+  }
+
+  switch (group->mode){
+    case STRIPE_FULL:
+      xor_blocks(parity, blocks, group->parity_disk);
+      stats_count(STATS_PARITY_FULL_STRIPES, 1);
+      break;
+    case STRIPE_RMW:
+      stats_count(STATS_PARITY_RMW, 1);
+      break;
+    case STRIPE_RECONSTRUCT:
+    case STRIPE_REBUILD:
+      xor_blocks(parity, blocks, group->parity_disk);
+      stats_count(STATS_PARITY_RECONSTRUCTS, 1);
+      break;
+    default:
+      break;
+  }
+}
+
+static void complete_stripe_read(mdadm_request_t *req) {
+  if (req->batch_result != 0){
+    //display the error message
+    printf("error, failed to read the parity groups of %u bytes at %u", req->len, req->addr);
+    req->result = -1;
+    req->phase = PHASE_DONE;
+    return;
+  }
+
+  for (uint32_t disk_num = 0; disk_num < JBOD_NUM_DISKS; disk_num++){
+    for (uint32_t g = 0; g < req->num_groups; g++){
+      uint32_t device_id = disk_num * JBOD_NUM_BLOCKS_PER_DISK + req->groups[g].block_num;
+
+      if (req->missed[disk_num * GROUPS_PER_CHUNK + g] && !check_block(device_id, stripe_slot(req, g, disk_num))){
+        req->result = -1;
+        req->phase = PHASE_DONE;
+        return;
+      }
+    }
+  }
+
+  for (uint32_t g = 0; g < req->num_groups; g++){
+    stripe_merge(req, g);
+  }
+
+  req->phase = PHASE_STRIPE_WRITE;
+}
+
+/* writes the written blocks and the parity of the chunk's groups from the
+ * stage. the cache takes their new contents, those of the failed disk's blocks
+ * too, which are not sent. |missed| marks the blocks with new contents. */
+static int plan_stripe_write(mdadm_request_t *req) {
+  memset(req->missed, 0, sizeof(req->missed));
+
+  for (uint32_t disk_num = 0; disk_num < JBOD_NUM_DISKS; disk_num++){
+    for (uint32_t g = 0; g < req->num_groups; g++){
+      stripe_group_t *group = &req->groups[g];
+      uint8_t *block = stripe_slot(req, g, disk_num);
+      uint32_t i = disk_num * GROUPS_PER_CHUNK + g;
+
+      req->missed[i] = (group->written & (1u << disk_num)) != 0 || (disk_num == group->parity_disk && group->mode != STRIPE_NO_PARITY);
+      if (!req->missed[i]){
+        continue;
+      }
+
+      if (cache_enabled() && cache_insert(disk_num, group->block_num, block) == -1){
+        cache_update(disk_num, group->block_num, block);
+      }
+      if ((int) disk_num != req->failed_disk && queue_write(&req->batch, disk_num, group->block_num, block) != 0){
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+static void complete_stripe_write(mdadm_request_t *req) {
+  for (uint32_t disk_num = 0; disk_num < JBOD_NUM_DISKS; disk_num++){
+    for (uint32_t g = 0; g < req->num_groups; g++){
+      uint32_t device_id = disk_num * JBOD_NUM_BLOCKS_PER_DISK + req->groups[g].block_num;
+
+      if (!req->missed[disk_num * GROUPS_PER_CHUNK + g]){
+        continue;
+      }
+      if (req->batch_result == 0){
+        expect_block(device_id, stripe_slot(req, g, disk_num));
+      }
+      else{
+        forget_block(device_id);
+      }
+    }
+  }
+
+  if (req->batch_result != 0){
+    //display error message
+    printf("error, failed to write %u bytes at %u", req->len, req->addr);
+    req->result = -1;
+    req->phase = PHASE_DONE;
+    return;
+  }
+
+  if (req->chunk_last < stripe_last_group(req)){
+    req->chunk_first = req->chunk_last + 1;
+    req->phase = PHASE_STRIPE_READ;
+    return;
+  }
+
+  req->result = req->len;
+  req->phase = PHASE_DONE;
+}
+
+/*
+a flush writes every dirty block of a write-back cache in disk/block order, so
+a run of consecutive blocks needs one seek at its start and the device pointer
+does the rest. it owns every connection so no request can rewrite a block
+between cleaning it in the cache and sending it. blocks of a chunk that may not
+have reached the device are marked dirty again and the flush stops. the chunk
+being written is indexed into |dirty_ids| by chunk_first and chunk_last.
+*/
+static int plan_flush(mdadm_request_t *req) {
+  if (req->dirty_ids == NULL){
+    req->dirty_ids = malloc(num_disks * JBOD_NUM_BLOCKS_PER_DISK * sizeof(uint32_t));
+    req->blocks = malloc(BLOCKS_PER_CHUNK * JBOD_BLOCK_SIZE);
+    if (req->dirty_ids == NULL || req->blocks == NULL){
+      return -1;
+    }
+
+    req->num_dirty = cache_dirty_blocks(req->dirty_ids, num_disks * JBOD_NUM_BLOCKS_PER_DISK);
+    qsort(req->dirty_ids, req->num_dirty, sizeof(uint32_t), compare_block_ids);
+    req->chunk_first = 0;
+  }
+
+  int chunk_len = req->num_dirty - (int) req->chunk_first < BLOCKS_PER_CHUNK ? req->num_dirty - (int) req->chunk_first : BLOCKS_PER_CHUNK;
+  req->chunk_last = req->chunk_first + chunk_len;
+  memset(req->missed, 0, sizeof(req->missed));
+
+  for (int i = 0; i < chunk_len; i++){
+    uint32_t num_of_disk = req->dirty_ids[req->chunk_first + i] / JBOD_NUM_BLOCKS_PER_DISK;
+    uint32_t num_of_block = req->dirty_ids[req->chunk_first + i] % JBOD_NUM_BLOCKS_PER_DISK;
+
+    req->missed[i] = cache_clean(num_of_disk, num_of_block, req->blocks[i]) == 1;
+    //a quarantined block stays dirty and the flush fails once the rest is written
+    if (!req->missed[i] && cache_is_corrupt(num_of_disk, num_of_block)){
+      req->num_quarantined ++;
+    }
+    if (req->missed[i] && queue_write(&req->batch, num_of_disk, num_of_block, req->blocks[i]) != 0){
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static void complete_flush(mdadm_request_t *req) {
+  if (req->batch_result != 0){
+    //the cleaned blocks of the chunk may not have reached the device
+    for (uint32_t i = 0; req->dirty_ids != NULL && req->chunk_first + i < req->chunk_last; i++){
+      if (req->missed[i]){
+        uint32_t block_id = req->dirty_ids[req->chunk_first + i];
+        cache_write(block_id / JBOD_NUM_BLOCKS_PER_DISK, block_id % JBOD_NUM_BLOCKS_PER_DISK, req->blocks[i]);
+        forget_block(block_id);
+      }
+    }
+    //display the error message
+    printf("error, failed to flush %d dirty blocks", req->num_dirty - (int) req->chunk_first);
+
+    //a write that went on to flush is complete anyway, its blocks stay dirty for the next flush
+    if (!req->flushing){
+      req->result = -1;
+    }
+    req->phase = PHASE_DONE;
+    return;
+  }
+
+  for (uint32_t i = 0; req->chunk_first + i < req->chunk_last; i++){
+    if (req->missed[i]){
+      expect_block(req->dirty_ids[req->chunk_first + i], req->blocks[i]);
+    }
+  }
+
+  if ((int) req->chunk_last < req->num_dirty){
+    req->chunk_first = req->chunk_last;
+    return;
+  }
+
+  if (!req->flushing){
+    req->result = req->num_quarantined == 0 ? 1 : -1;
+  }
+  req->phase = PHASE_DONE;
+}
+
+/*
+a verify has the device sign each block of its range with JBOD_SIGN_BLOCK and
+compares the SHA1 signature with the client's copy of the block: the clean
+cached copy where there is one, which costs no transfer, otherwise the block
+is read in the same batch and checked like any read. the reads of a chunk are
+queued before its signatures so they still form runs. |missed| marks the
+blocks read, |result| counts the blocks that disagree.
+*/
+static int plan_verify(mdadm_request_t *req) {
+  uint32_t chunk_first = req->chunk_first;
+  uint32_t chunk_last = chunk_first + BLOCKS_PER_CHUNK - 1 < req->last_block ? chunk_first + BLOCKS_PER_CHUNK - 1 : req->last_block;
+
+  req->chunk_last = chunk_last;
+
+  if (req->blocks == NULL){
+    req->blocks = malloc(2 * BLOCKS_PER_CHUNK * JBOD_BLOCK_SIZE);
+    if (req->blocks == NULL){
+      return -1;
+    }
+    req->result = 0;
+  }
+
+  uint32_t order[BLOCKS_PER_CHUNK];
+  chunk_order(chunk_first, chunk_last, order);
+
+  for (uint32_t n = 0; n <= chunk_last - chunk_first; n++){
+    uint32_t i = order[n] - chunk_first;
+    uint32_t num_of_disk;
+    uint32_t num_of_block;
+
+    map_block(order[n], &num_of_disk, &num_of_block);
+    req->missed[i] = !cache_enabled() || cache_peek(num_of_disk, num_of_block, req->blocks[i]) == -1;
+    if (req->missed[i] && queue_read(&req->batch, num_of_disk, num_of_block, req->blocks[i]) != 0){
+      return -1;
+    }
+  }
+
+  //a signature names its block in the op and leaves the device pointers alone
+  for (uint32_t block_id = chunk_first; block_id <= chunk_last; block_id++){
+    uint32_t num_of_disk;
+    uint32_t num_of_block;
+
+    map_block(block_id, &num_of_disk, &num_of_block);
+    if (queue_op(&req->batch, num_of_disk, disk_operation(num_of_disk, num_of_block, JBOD_SIGN_BLOCK), req->blocks[BLOCKS_PER_CHUNK + block_id - chunk_first]) != 0){
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* the digest bytes a signature has to carry, all the stock jbod_server prints */
+#define SIGNATURE_MIN_BYTES 15
+
+/* jbod_server answers JBOD_SIGN_BLOCK with the text "SIG(disk,block) %2d %3d : "
+ * followed by "0x%02x " for each byte of the block's SHA1. the stock build
+ * prints only the first SIGNATURE_MIN_BYTES of them, so those must be there and
+ * match, and so must any that follow. the disk is the server's own, its number
+ * within its node.
+ * returns true if |signature| signs the block at |device_id| with |digest|. */
+static bool signature_matches(const uint8_t *signature, uint32_t device_id, const uint8_t *digest) {
+  char text[JBOD_BLOCK_SIZE + 1];
+  int disk_num;
+  int block_num;
+  int used = -1;
+
+  memcpy(text, signature, JBOD_BLOCK_SIZE);
+  text[JBOD_BLOCK_SIZE] = '\0';
+
+  if (sscanf(text, "SIG(disk,block) %d %d : %n", &disk_num, &block_num, &used) != 2 || used == -1 ||
+      disk_num != (int) (device_id / JBOD_NUM_BLOCKS_PER_DISK % JBOD_NUM_DISKS) || block_num != (int) (device_id % JBOD_NUM_BLOCKS_PER_DISK)){
+    return false;
+  }
+
+  int num_bytes = 0;
+  const char *next = text + used;
+  while (num_bytes < SHA_DIGEST_LENGTH){
+    unsigned int byte;
+    int consumed = -1;
+
+    if (sscanf(next, "0x%2x %n", &byte, &consumed) != 1 || consumed == -1){
+      break;
+    }
+    if (byte != digest[num_bytes]){
+      return false;
+    }
+    num_bytes ++;
+    next += consumed;
+  }
+
+  return num_bytes >= SIGNATURE_MIN_BYTES;
+}
+
+static void complete_verify(mdadm_request_t *req) {
+  if (req->batch_result != 0){
+    //display the error message
+    printf("error, failed to verify %u bytes at %u", req->len, req->addr);
+    req->result = -1;
+    req->phase = PHASE_DONE;
+    return;
+  }
+
+  for (uint32_t block_id = req->chunk_first; block_id <= req->chunk_last; block_id++){
+    uint32_t i = block_id - req->chunk_first;
+    uint32_t device_id = device_block(block_id);
+    uint8_t digest[SHA_DIGEST_LENGTH];
+
+    SHA1(req->blocks[i], JBOD_BLOCK_SIZE, digest);
+    if (!signature_matches(req->blocks[BLOCKS_PER_CHUNK + i], device_id, digest)){
+      fprintf(stderr, "error, block %u of disk %u does not match its signature\n", device_id % JBOD_NUM_BLOCKS_PER_DISK, device_id / JBOD_NUM_BLOCKS_PER_DISK);
+      stats_count(STATS_SIGNATURE_MISMATCHES, 1);
+      if (!req->missed[i]){
+        cache_invalidate(device_id / JBOD_NUM_BLOCKS_PER_DISK, device_id % JBOD_NUM_BLOCKS_PER_DISK);
+      }
+      req->result ++;
+    }
+    else if (req->missed[i] && !check_block(device_id, req->blocks[i])){
+      req->result ++;
+    }
+  }
+
+  if (req->chunk_last < req->last_block){
+    req->chunk_first = req->chunk_last + 1;
+    return;
+  }
+
+  req->phase = PHASE_DONE;
+}
+
+//queues the next batch of |req|, returns 0 on success and -1 if it cannot be planned
+static int plan_phase(mdadm_request_t *req) {
+  switch (req->phase){
+    case PHASE_READ:
+      return plan_read(req);
+    case PHASE_WRITE_EDGES:
+      return plan_write_edges(req);
+    case PHASE_WRITE:
+      return plan_write(req);
+    case PHASE_STRIPE_READ:
+      return plan_stripe_read(req);
+    case PHASE_STRIPE_WRITE:
+      return plan_stripe_write(req);
+    case PHASE_FLUSH:
+      return plan_flush(req);
+    case PHASE_VERIFY:
+      return plan_verify(req);
+    default:
+      return -1;
+  }
+}
+
+//handles the outcome of the batch, moving |req| to its next chunk or phase
+static void complete_phase(mdadm_request_t *req) {
+  switch (req->phase){
+    case PHASE_READ:
+      complete_read(req);
+      break;
+    case PHASE_WRITE_EDGES:
+      complete_write_edges(req);
+      break;
+    case PHASE_WRITE:
+      complete_write(req);
+      break;
+    case PHASE_STRIPE_READ:
+      complete_stripe_read(req);
+      break;
+    case PHASE_STRIPE_WRITE:
+      complete_stripe_write(req);
+      break;
+    case PHASE_FLUSH:
+      complete_flush(req);
+      break;
+    case PHASE_VERIFY:
+      complete_verify(req);
+      break;
+    default:
+      break;
+  }
+}
+
+/*
+a read that needs a block another read is fetching waits for that fetch
+instead of repeating it, and gets a copy of the bytes it needs: a burst of
+threads missing the same cold block costs one device read. every read enters
+the blocks it fetches itself into a table keyed by their device block, and
+each block it finds there already is provided by the read that fetches it.
+a read provided with all of its blocks fetches nothing, one provided with
+some fetches the rest. either finishes once its own batches are done and
+every read it waits on has copied its bytes over. a block that is cached is
+not waited for, the cache serves it. a write stops the reads in flight from
+providing the blocks it overlaps, a read that starts after it has to see what
+it wrote.
+*/
+#define INFLIGHT_BUCKETS 1024
+
+/* the bytes [addr, addr + len) of one block, which |follower| waits for */
+typedef struct read_piece {
+  mdadm_request_t *follower;
+  uint32_t addr;
+  uint32_t len;
+  struct read_piece *next;
+} read_piece_t;
+
+/* a block fetched by |leader|, chained into the table by its device block */
+typedef struct inflight_block {
+  uint32_t device_id;
+  bool joinable;
+  mdadm_request_t *leader;
+  struct inflight_block *next;
+} inflight_block_t;
+
+static pthread_mutex_t inflight_lock = PTHREAD_MUTEX_INITIALIZER;
+static inflight_block_t *inflight_blocks[INFLIGHT_BUCKETS];
+
+//the table's bucket of block |device_id|
+static inflight_block_t **inflight_bucket(uint32_t device_id) {
+  return &inflight_blocks[(device_id * 2654435761u >> 16) % INFLIGHT_BUCKETS];
+}
+
+//have the read fetching |block_id| provide the part of it |req| needs, returns true if one does
+static bool join_block(mdadm_request_t *req, uint32_t block_id) {
+  uint32_t device_id = device_block(block_id);
+  uint32_t piece_first = block_id * JBOD_BLOCK_SIZE > req->addr ? block_id * JBOD_BLOCK_SIZE : req->addr;
+  uint32_t piece_end = (block_id + 1) * JBOD_BLOCK_SIZE < req->addr + req->len ? (block_id + 1) * JBOD_BLOCK_SIZE : req->addr + req->len;
+
+  if (cache_enabled() && cache_contains(device_id / JBOD_NUM_BLOCKS_PER_DISK, device_id % JBOD_NUM_BLOCKS_PER_DISK)){
+    return false;
+  }
+
+  for (inflight_block_t *entry = *inflight_bucket(device_id); entry != NULL; entry = entry->next){
+    mdadm_request_t *leader = entry->leader;
+
+    //the leader only has the bytes of the block that it was asked for
+    if (entry->device_id != device_id || !entry->joinable || leader->addr > piece_first || piece_end > leader->addr + leader->len){
+      continue;
+    }
+
+    uint32_t num_blocks = req->last_block - req->first_block + 1;
+    if (req->provided == NULL){
+      req->provided = calloc((num_blocks + 63) / 64, sizeof(uint64_t));
+    }
+    read_piece_t *piece = malloc(sizeof(read_piece_t));
+    if (req->provided == NULL || piece == NULL){
+      free(piece);
+      return false;
+    }
+
+    *piece = (read_piece_t) { .follower = req, .addr = piece_first, .len = piece_end - piece_first, .next = leader->pieces };
+    leader->pieces = piece;
+    req->provided[(block_id - req->first_block) / 64] |= 1ull << ((block_id - req->first_block) % 64);
+    req->num_pending ++;
+    stats_count(STATS_READS_COALESCED, 1);
+    return true;
+  }
+  return false;
+}
+
+/* has the reads in flight provide what they can of |req|, and enters the
+ * blocks left into the table. a read provided with every block only keeps the
+ * connections of its readahead. */
+static void add_read(mdadm_request_t *req) {
+  uint32_t num_blocks = req->last_block - req->first_block + 1;
+  uint32_t num_provided = 0;
+
+  for (uint32_t block_id = req->first_block; block_id <= req->last_block; block_id++){
+    if (join_block(req, block_id)){
+      num_provided ++;
+    }
+  }
+
+  if (num_provided == num_blocks && req->failed_disk == -1){
+    req->conns = req->ahead_count > 0 ? blocks_conns(req->ahead_first, req->ahead_first + req->ahead_count - 1) : 0;
+  }
+
+  req->fetched = num_provided < num_blocks ? malloc((num_blocks - num_provided) * sizeof(inflight_block_t)) : NULL;
+  for (uint32_t block_id = req->first_block; req->fetched != NULL && block_id <= req->last_block; block_id++){
+    if (block_provided(req, block_id)){
+      continue;
+    }
+
+    inflight_block_t *entry = &req->fetched[req->num_fetched];
+    inflight_block_t **bucket = inflight_bucket(device_block(block_id));
+    *entry = (inflight_block_t) { .device_id = device_block(block_id), .joinable = true, .leader = req, .next = *bucket };
+    *bucket = entry;
+    req->num_fetched ++;
+  }
+}
+
+//a write of the blocks |first_block| to |last_block| stops the reads in flight from providing them
+static void close_reads(uint32_t first_block, uint32_t last_block) {
+  for (uint32_t block_id = first_block; block_id <= last_block; block_id++){
+    uint32_t device_id = device_block(block_id);
+
+    for (inflight_block_t *entry = *inflight_bucket(device_id); entry != NULL; entry = entry->next){
+      if (entry->device_id == device_id){
+        entry->joinable = false;
+      }
+    }
+  }
+}
+
+//take the blocks of |req| out of the table, returns the pieces it has to provide
+static read_piece_t *remove_read(mdadm_request_t *req) {
+  pthread_mutex_lock(&inflight_lock);
+  for (int i = 0; i < req->num_fetched; i++){
+    inflight_block_t **link = inflight_bucket(req->fetched[i].device_id);
+    while (*link != &req->fetched[i]){
+      link = &(*link)->next;
+    }
+    *link = req->fetched[i].next;
+  }
+  read_piece_t *pieces = req->pieces;
+  req->pieces = NULL;
+  pthread_mutex_unlock(&inflight_lock);
+
+  return pieces;
+}
+
+/* calls back the caller of a request that is done and frees it. returns the
+ * reads it provided the last piece of whose own batches are done, chained
+ * through |next|, so they can be completed in turn. */
+static mdadm_request_t *request_complete(mdadm_request_t *req) {
+  if (req->histogram != -1){
+    stats_record(req->histogram, stats_now() - req->start);
+  }
+
+  mdadm_callback_t callback = req->callback;
+  void *arg = req->arg;
+  int result = req->failed_piece ? -1 : req->result;
+  read_piece_t *pieces = req->num_fetched > 0 ? remove_read(req) : NULL;
+  mdadm_request_t *ready = NULL;
+
+  //the followers' bytes are in the buffer that the caller may reuse once called back
+  while (pieces != NULL){
+    read_piece_t *piece = pieces;
+    mdadm_request_t *follower = piece->follower;
+
+    if (result != -1){
+      memcpy(follower->buf + (piece->addr - follower->addr), req->buf + (piece->addr - req->addr), piece->len);
+    }
+
+    pthread_mutex_lock(&inflight_lock);
+    follower->failed_piece |= result == -1;
+    follower->num_pending --;
+    if (follower->num_pending == 0 && follower->parked){
+      follower->next = ready;
+      ready = follower;
+    }
+    pthread_mutex_unlock(&inflight_lock);
+
+    pieces = piece->next;
+    free(piece);
+  }
+
+  free(req->batch.reqs);
+  free(req->blocks);
+  free(req->dirty_ids);
+  free(req->stage);
+  free(req->peers);
+  free(req->provided);
+  free(req->fetched);
+  free(req);
+  request_end();
+
+  callback(result, arg);
+  return ready;
+}
+
+static void request_finish(mdadm_request_t *req) {
+  release_conns(req);
+
+  //the write is complete once it is in the cache, the flush it triggers still runs before the caller hears back
+  if (req->histogram == STATS_MDADM_WRITE && !req->flushing && req->result != -1 && cache_needs_flush()){
+    req->flushing = true;
+    req->phase = PHASE_FLUSH;
+    req->conns = disks_conns(0, num_disks - 1);
+    acquire_conns(req);
+    return;
+  }
+
+  //a read still waiting for blocks other reads provide is completed by the last of them
+  pthread_mutex_lock(&inflight_lock);
+  req->parked = req->num_pending > 0;
+  bool parked = req->parked;
+  pthread_mutex_unlock(&inflight_lock);
+  if (parked){
+    return;
+  }
+
+  req->next = NULL;
+  while (req != NULL){
+    mdadm_request_t *next = req->next;
+    mdadm_request_t *ready = request_complete(req);
+
+    //the reads it made ready go before the rest
+    while (ready != NULL){
+      mdadm_request_t *ready_next = ready->next;
+      ready->next = next;
+      next = ready;
+      ready = ready_next;
+    }
+    req = next;
+  }
+}
+
+static void batch_done(int result, void *arg) {
+  mdadm_request_t *req = (mdadm_request_t*) arg;
+
+  req->batch_result = result == 0 ? 0 : -1;
+  schedule(req);
+}
+
+//advances |req| until it waits for a batch or has finished, only ever called from schedule
+static void request_step(mdadm_request_t *req) {
+  while (true){
+    if (req->awaiting){
+      req->awaiting = false;
+      req->batch.len = 0;
+      complete_phase(req);
+    }
+
+    if (req->phase == PHASE_DONE){
+      request_finish(req);
+      return;
+    }
+
+    req->awaiting = true;
+    if (plan_phase(req) != 0){
+      abort_batch(req);
+      req->batch_result = -1;
+    }
+    else if (req->batch.len == 0){
+      //everything came from the cache
+      req->batch_result = 0;
+    }
+    //from here on the callback may already be running |req| on the event loop
+    else if (jbod_client_pipeline_async(req->batch.reqs, req->batch.len, batch_done, req) == 0){
+      return;
+    }
+    else{
+      abort_batch(req);
+      req->batch_result = -1;
+    }
+  }
+}
+
+static mdadm_request_t *request_new(request_phase_t phase, uint32_t addr, uint32_t len, uint8_t *buf, mdadm_callback_t callback, void *arg) {
+  mdadm_request_t *req = (mdadm_request_t*) malloc(sizeof(mdadm_request_t));
+  if (req == NULL){
+    return NULL;
+  }
+
+  req->phase = phase;
+  req->addr = addr;
+  req->len = len;
+  req->buf = buf;
+  req->callback = callback;
+  req->arg = arg;
+  req->result = -1;
+  req->histogram = phase == PHASE_READ ? STATS_MDADM_READ : (phase == PHASE_WRITE_EDGES ? STATS_MDADM_WRITE : -1);
+  req->start = stats_now();
+  req->flushing = false;
+  req->awaiting = false;
+  req->first_block = addr / JBOD_BLOCK_SIZE;
+  req->last_block = len == 0 ? req->first_block : (addr + len - 1) / JBOD_BLOCK_SIZE;
+  req->chunk_first = req->first_block;
+  req->ahead_count = phase == PHASE_READ ? readahead_plan(req->first_block, req->last_block, &req->ahead_first) : 0;
+  req->blocks = NULL;
+  req->dirty_ids = NULL;
+  req->num_dirty = 0;
+  req->num_quarantined = 0;
+  req->stage = NULL;
+  req->failed_disk = failed_disk;
+  req->num_groups = 0;
+  req->num_rebuilt = 0;
+  req->peers = NULL;
+  req->fetched = NULL;
+  req->num_fetched = 0;
+  req->pieces = NULL;
+  req->provided = NULL;
+  req->num_pending = 0;
+  req->parked = false;
+  req->failed_piece = false;
+
+  uint32_t chunk_blocks = req->last_block - req->first_block + 1;
+  if (batch_init(&req->batch, (chunk_blocks < BLOCKS_PER_CHUNK ? chunk_blocks : BLOCKS_PER_CHUNK) + req->ahead_count) == -1){
+    free(req);
+    return NULL;
+  }
+
+  //a RAID5 write reads its partial blocks along with the rest of their groups
+  if (phase == PHASE_WRITE_EDGES && array_layout == MDADM_LAYOUT_RAID5){
+    req->phase = PHASE_STRIPE_READ;
+    req->chunk_first = req->first_block / stripe_blocks / DATA_DISKS * stripe_blocks;
+  }
+
+  //a RAID5 write and a degraded read's rebuilds may need a block of every disk
+  if (phase == PHASE_FLUSH || req->phase == PHASE_STRIPE_READ || (phase == PHASE_READ && req->failed_disk != -1)){
+    req->conns = disks_conns(0, num_disks - 1);
+  }
+  else{
+    req->conns = blocks_conns(req->first_block, req->last_block);
+    if (req->ahead_count > 0){
+      req->conns |= blocks_conns(req->ahead_first, req->ahead_first + req->ahead_count - 1);
+    }
+  }
+
+  return req;
+}
+
+//count the blocks a read or write touches in the access profile, under the layout it runs with
+static void profile_request(bool is_write, uint32_t first_block, uint32_t last_block) {
+  profile_call(first_block, last_block - first_block + 1);
+
+  for (uint32_t block_id = first_block; block_id <= last_block; block_id++){
+    uint32_t disk_num;
+    uint32_t block_num;
+
+    map_block(block_id, &disk_num, &block_num);
+    profile_access(is_write, disk_num, block_num);
+  }
+}
+
+//validate a request of at most |max_len| bytes and start it
+static int submit_request(request_phase_t phase, uint32_t addr, uint32_t len, uint8_t *buf, uint32_t max_len, mdadm_callback_t callback, void *arg) {
+  if (phase != PHASE_VERIFY){
+    trace_record(phase == PHASE_READ ? TRACE_READ : TRACE_WRITE, addr, len);
+  }
+
+  if (callback == NULL){
+    return -1;
+  }
+
+  //if len is 0, there is nothing to transfer
+  if (len == 0){
+    callback(0, arg);
+    return 1;
+  }
+
+  //Any potential error will result in -1 as failure
+  if (len > max_len || (buf == NULL && phase != PHASE_VERIFY) || len > array_blocks * JBOD_BLOCK_SIZE || addr > array_blocks * JBOD_BLOCK_SIZE - len){
+    return -1;
+  }
+
+  //a failed disk cannot sign its blocks
+  if (phase == PHASE_VERIFY && failed_disk != -1){
+    return -1;
+  }
+
+  if (!request_begin()){
+    return -1;
+  }
+  if (phase != PHASE_VERIFY && profile_enabled()){
+    profile_request(phase != PHASE_READ, addr / JBOD_BLOCK_SIZE, (addr + len - 1) / JBOD_BLOCK_SIZE);
+  }
+
+  pthread_mutex_lock(&inflight_lock);
+  if (phase == PHASE_WRITE_EDGES){
+    close_reads(addr / JBOD_BLOCK_SIZE, (addr + len - 1) / JBOD_BLOCK_SIZE);
+  }
+  mdadm_request_t *req = request_new(phase, addr, len, buf, callback, arg);
+  if (req != NULL && phase == PHASE_READ){
+    add_read(req);
+  }
+  pthread_mutex_unlock(&inflight_lock);
+
+  if (req == NULL){
+    request_end();
+    return -1;
+  }
+
+  acquire_conns(req);
+  return 1;
+}
+
+/* a caller of the synchronous functions waits on this until its request's callback ran */
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool done;
+  int result;
+} mdadm_waiter_t;
+
+static void waiter_init(mdadm_waiter_t *waiter) {
+  pthread_mutex_init(&waiter->lock, NULL);
+  pthread_cond_init(&waiter->cond, NULL);
+  waiter->done = false;
+  waiter->result = -1;
+}
+
+static void wake_waiter(int result, void *arg) {
+  mdadm_waiter_t *waiter = (mdadm_waiter_t*) arg;
+
+  pthread_mutex_lock(&waiter->lock);
+  waiter->result = result;
+  waiter->done = true;
+  pthread_cond_signal(&waiter->cond);
+  pthread_mutex_unlock(&waiter->lock);
+}
+
+//waits for the request started with |waiter| if |started| is 1, returns its result
+static int waiter_wait(mdadm_waiter_t *waiter, int started) {
+  if (started == 1){
+    pthread_mutex_lock(&waiter->lock);
+    while (!waiter->done){
+      pthread_cond_wait(&waiter->cond, &waiter->lock);
+    }
+    pthread_mutex_unlock(&waiter->lock);
+  }
+
+  pthread_cond_destroy(&waiter->cond);
+  pthread_mutex_destroy(&waiter->lock);
+  return started == 1 ? waiter->result : -1;
+}
+
+static int read_request(uint32_t addr, uint32_t len, uint8_t *buf, uint32_t max_len) {
+  mdadm_waiter_t waiter;
+
+  waiter_init(&waiter);
+  return waiter_wait(&waiter, submit_request(PHASE_READ, addr, len, buf, max_len, wake_waiter, &waiter));
+}
+
+static int write_request(uint32_t addr, uint32_t len, const uint8_t *buf, uint32_t max_len) {
+  mdadm_waiter_t waiter;
+
+  waiter_init(&waiter);
+  //the packet layer and the cache only read the caller's buffer
+  return waiter_wait(&waiter, submit_request(PHASE_WRITE_EDGES, addr, len, (uint8_t *) buf, max_len, wake_waiter, &waiter));
+}
+
+//runs a flush of the write-back cache for a caller that was already admitted
+static int flush_admitted(void) {
+  mdadm_waiter_t waiter;
+  mdadm_request_t *req = request_new(PHASE_FLUSH, 0, 0, NULL, wake_waiter, &waiter);
+
+  if (req == NULL){
+    request_end();
+    return -1;
+  }
+
+  waiter_init(&waiter);
+  acquire_conns(req);
+  return waiter_wait(&waiter, 1);
+}
+
+int mdadm_verify(uint32_t addr, uint32_t len) {
+  mdadm_waiter_t waiter;
+
+  waiter_init(&waiter);
+  return waiter_wait(&waiter, submit_request(PHASE_VERIFY, addr, len, NULL, MAX_ARRAY_SIZE, wake_waiter, &waiter));
+}
+
+int mdadm_verify_async(uint32_t addr, uint32_t len, mdadm_callback_t callback, void *arg) {
+  return submit_request(PHASE_VERIFY, addr, len, NULL, MAX_ARRAY_SIZE, callback, arg);
+}
+
+int mdadm_set_verify(bool enabled) {
+  int result = -1;
+
+  pthread_mutex_lock(&mount_lock);
+  if (isMounted == 0){
+    verify = enabled;
+    cache_set_checksums(enabled);
+    result = 1;
+  }
+  pthread_mutex_unlock(&mount_lock);
+
+  return result;
+}
+
+int mdadm_flush(void) {
+  if (!request_begin()){
+    return -1;
+  }
+  return flush_admitted();
+}
+
+int mdadm_mount(void) {
+  return mdadm_mount_layout(MDADM_LAYOUT_LINEAR, 0);
+}
+
+int mdadm_mount_layout(mdadm_layout_t layout, uint32_t stripe_unit) {
+  int result;
+
+  pthread_mutex_lock(&mount_lock);
+
+  //if isMounted is 1, then return -1 because the disk is already mounted
+  if (isMounted == 1){
+    result = -1;
+  }
+  //a stripe unit must divide the disks evenly
+  else if (layout != MDADM_LAYOUT_LINEAR && ((layout != MDADM_LAYOUT_RAID0 && layout != MDADM_LAYOUT_RAID5) || stripe_unit == 0 || JBOD_NUM_BLOCKS_PER_DISK % stripe_unit != 0)){
+    result = -1;
+  }
+  //the parity groups of RAID5 span the disks of one server
+  else if (layout == MDADM_LAYOUT_RAID5 && jbod_client_nodes() > 1){
+    result = -1;
+  }
+  //if there is no error after calling jbod_mount command then return 1 as true, or -1 as false
+  else if (jbod_client_operation(encode_operation(0, 0, JBOD_MOUNT), NULL) == 0){
+    //nothing is known about what the disks hold until it is written or read
+    memset(expected_crcs, 0, sizeof(expected_crcs));
+    array_layout = layout;
+    num_nodes = jbod_client_nodes();
+    num_disks = num_nodes * JBOD_NUM_DISKS;
+    stripe_blocks = layout == MDADM_LAYOUT_LINEAR ? JBOD_NUM_BLOCKS_PER_DISK : stripe_unit;
+    array_blocks = layout == MDADM_LAYOUT_RAID5 ? DATA_DISKS * JBOD_NUM_BLOCKS_PER_DISK : num_disks * JBOD_NUM_BLOCKS_PER_DISK;
+    failed_disk = -1;
+    pthread_mutex_lock(&request_lock);
+    isMounted = 1;
+    pthread_mutex_unlock(&request_lock);
+    result = 1;
+  }
+  else{
+    result = -1;
+  }
+
+  pthread_mutex_unlock(&mount_lock);
+  return result;
+}
+
+uint32_t mdadm_array_size(void) {
+  return array_blocks * JBOD_BLOCK_SIZE;
+}
+
+int mdadm_fail_disk(int disk_num) {
+  int result = -1;
+  int none = -1;
+
+  pthread_mutex_lock(&mount_lock);
+  if (isMounted == 1 && array_layout == MDADM_LAYOUT_RAID5 && disk_num >= 0 && disk_num < JBOD_NUM_DISKS &&
+      atomic_compare_exchange_strong(&failed_disk, &none, disk_num)){
+    result = 1;
+  }
+  pthread_mutex_unlock(&mount_lock);
+
+  return result;
+}
+
+int mdadm_unmount(void) {
+  int result;
+
+  pthread_mutex_lock(&mount_lock);
+
+  //if isMounted is 0, then return -1 because the disk is already unmounted
+  if (isMounted == 0){
+    pthread_mutex_unlock(&mount_lock);
+    return -1;
+  }
+
+  //let the requests already admitted finish, and admit the flush below in their place
+  pthread_mutex_lock(&request_lock);
+  unmounting = true;
+  while (num_requests > 0){
+    pthread_cond_wait(&requests_idle, &request_lock);
+  }
+  num_requests ++;
+  pthread_mutex_unlock(&request_lock);
+
+  //dirty blocks must reach the device first, otherwise stay mounted so they are not lost
+  if (flush_admitted() != 1){
+    result = -1;
+  }
+  //if there is no error after calling jbod_unmount command then return 1 as true, or -1 as false
+  else if (jbod_client_operation(encode_operation(0, 0, JBOD_UNMOUNT), NULL) == 0){
+    result = 1;
+  }
+  else{
+    result = -1;
+  }
+
+  pthread_mutex_lock(&request_lock);
+  if (result == 1){
+    isMounted = 0;
+  }
+  unmounting = false;
+  pthread_mutex_unlock(&request_lock);
+
+  //the profile covers everything up to the unmount, a failed dump does not undo it
+  if (result == 1 && profile_dump_file() != 1){
+    printf("error, failed to write the access profile");
+  }
+
+  pthread_mutex_unlock(&mount_lock);
+  return result;
+}
+
+int mdadm_read_async(uint32_t addr, uint32_t len, uint8_t *buf, mdadm_callback_t callback, void *arg) {
+  return submit_request(PHASE_READ, addr, len, buf, MAX_ARRAY_SIZE, callback, arg);
+}
+
+int mdadm_write_async(uint32_t addr, uint32_t len, const uint8_t *buf, mdadm_callback_t callback, void *arg) {
+  return submit_request(PHASE_WRITE_EDGES, addr, len, (uint8_t *) buf, MAX_ARRAY_SIZE, callback, arg);
+}
+
+int mdadm_read(uint32_t addr, uint32_t len, uint8_t *buf) {
+  return read_request(addr, len, buf, 1024);
+}
+
+int mdadm_write(uint32_t addr, uint32_t len, const uint8_t *buf) {
+  return write_request(addr, len, buf, 1024);
+}
+
+int mdadm_read_large(uint32_t addr, uint32_t len, uint8_t *buf) {
+  return read_request(addr, len, buf, MAX_ARRAY_SIZE);
+}
+
+int mdadm_write_large(uint32_t addr, uint32_t len, const uint8_t *buf) {
+  return write_request(addr, len, buf, MAX_ARRAY_SIZE);
+}
+
+/*
+a vectored call merges its extents into runs of the array that they cover
+without gaps and starts every run as an asynchronous request at once, those
+on lower disks and blocks first. requests that share a connection run in the
+order they were started, so each connection sweeps its disks upwards once,
+and runs on different connections overlap. a run of one extent transfers
+straight to its buffer, the others go through a buffer of their own. at most
+VECTOR_WINDOW runs are under way at a time, each holds a request's batch.
+*/
+#define VECTOR_WINDOW 64
+
+typedef struct {
+  uint32_t start;
+  uint32_t end;
+  uint32_t disk_num;   /* where the run starts, its place in the sweep */
+  uint32_t block_num;
+  uint8_t *buf;
+  bool owns_buf;
+} vector_run_t;
+
+//an extent of a vectored call by its place in the vector, sorted by address
+typedef struct {
+  uint32_t addr;
+  int index;
+} vector_key_t;
+
+/* the caller of a vectored call waits on this until the last of its runs is done */
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int pending;
+  bool failed;
+} vector_waiter_t;
+
+static void vector_run_done(int result, void *arg) {
+  vector_waiter_t *waiter = (vector_waiter_t*) arg;
+
+  pthread_mutex_lock(&waiter->lock);
+  if (result == -1){
+    waiter->failed = true;
+  }
+  waiter->pending --;
+  pthread_cond_signal(&waiter->cond);
+  pthread_mutex_unlock(&waiter->lock);
+}
+
+//address order, the extent that comes first in the vector first on a tie
+static int compare_keys(const void *a, const void *b) {
+  const vector_key_t *x = (const vector_key_t*) a;
+  const vector_key_t *y = (const vector_key_t*) b;
+
+  if (x->addr != y->addr){
+    return x->addr < y->addr ? -1 : 1;
+  }
+  return x->index - y->index;
+}
+
+//disk/block order of where the runs start
+static int compare_runs(const void *a, const void *b) {
+  const vector_run_t *x = *(vector_run_t *const *) a;
+  const vector_run_t *y = *(vector_run_t *const *) b;
+
+  if (x->disk_num != y->disk_num){
+    return x->disk_num < y->disk_num ? -1 : 1;
+  }
+  if (x->block_num != y->block_num){
+    return x->block_num < y->block_num ? -1 : 1;
+  }
+  return 0;
+}
+
+//runs the runs of a vectored call in sweep order and waits for them, returns 0 if all succeeded
+static int run_sweep(bool is_write, vector_run_t **sweep, int num_runs) {
+  vector_waiter_t waiter;
+
+  pthread_mutex_init(&waiter.lock, NULL);
+  pthread_cond_init(&waiter.cond, NULL);
+  //one count for the caller keeps the runs started so far from finishing the call
+  waiter.pending = 1;
+  waiter.failed = false;
+
+  for (int r = 0; r < num_runs; r++){
+    pthread_mutex_lock(&waiter.lock);
+    while (waiter.pending > VECTOR_WINDOW){
+      pthread_cond_wait(&waiter.cond, &waiter.lock);
+    }
+    waiter.pending ++;
+    pthread_mutex_unlock(&waiter.lock);
+
+    if (submit_request(is_write ? PHASE_WRITE_EDGES : PHASE_READ, sweep[r]->start, sweep[r]->end - sweep[r]->start, sweep[r]->buf, MAX_ARRAY_SIZE, vector_run_done, &waiter) != 1){
+      vector_run_done(-1, &waiter);
+    }
+  }
+
+  pthread_mutex_lock(&waiter.lock);
+  waiter.pending --;
+  while (waiter.pending > 0){
+    pthread_cond_wait(&waiter.cond, &waiter.lock);
+  }
+  pthread_mutex_unlock(&waiter.lock);
+
+  pthread_cond_destroy(&waiter.cond);
+  pthread_mutex_destroy(&waiter.lock);
+  return waiter.failed ? -1 : 0;
+}
+
+/* a vectored call's runs, |run_of| maps every extent to the run it joined and
+ * |sweep| is the order the runs start in */
+typedef struct {
+  vector_key_t *keys;
+  int *run_of;
+  vector_run_t *runs;
+  vector_run_t **sweep;
+  int num_runs;
+} vector_plan_t;
+
+//merge the |count| extents into runs and order them for the sweep, returns 0 on success and -1 on failure
+static int plan_runs(vector_plan_t *plan, bool is_write, const mdadm_extent_t *extents, int count) {
+  int num_keys = 0;
+
+  //empty extents transfer nothing and join no run
+  for (int i = 0; i < count; i++){
+    if (extents[i].len > 0){
+      plan->keys[num_keys] = (vector_key_t) { .addr = extents[i].addr, .index = i };
+      num_keys ++;
+    }
+  }
+  qsort(plan->keys, num_keys, sizeof(vector_key_t), compare_keys);
+
+  for (int k = 0; k < num_keys; k++){
+    const mdadm_extent_t *extent = &extents[plan->keys[k].index];
+    vector_run_t *last = plan->num_runs > 0 ? &plan->runs[plan->num_runs - 1] : NULL;
+
+    if (last != NULL && extent->addr <= last->end){
+      if (extent->addr + extent->len > last->end){
+        last->end = extent->addr + extent->len;
+      }
+      //more than one extent, the run gets a buffer of its own below
+      last->buf = NULL;
+      stats_count(STATS_EXTENTS_MERGED, 1);
+    }
+    else{
+      plan->runs[plan->num_runs] = (vector_run_t) { .start = extent->addr, .end = extent->addr + extent->len, .buf = extent->buf, .owns_buf = false };
+      plan->num_runs ++;
+    }
+    plan->run_of[plan->keys[k].index] = plan->num_runs - 1;
+  }
+
+  for (int r = 0; r < plan->num_runs; r++){
+    vector_run_t *run = &plan->runs[r];
+
+    if (run->buf == NULL){
+      run->buf = malloc(run->end - run->start);
+      if (run->buf == NULL){
+        return -1;
+      }
+      run->owns_buf = true;
+    }
+    map_block(run->start / JBOD_BLOCK_SIZE, &run->disk_num, &run->block_num);
+    plan->sweep[r] = run;
+  }
+  qsort(plan->sweep, plan->num_runs, sizeof(vector_run_t*), compare_runs);
+
+  //overlapping writes are laid down in vector order, so the last one wins
+  for (int i = 0; i < count && is_write; i++){
+    vector_run_t *run = &plan->runs[plan->run_of[i]];
+    if (extents[i].len > 0 && run->owns_buf){
+      memcpy(run->buf + (extents[i].addr - run->start), extents[i].buf, extents[i].len);
+    }
+  }
+  return 0;
+}
+
+static int vector_request(bool is_write, const mdadm_extent_t *extents, int count) {
+  uint32_t array_size = array_blocks * JBOD_BLOCK_SIZE;
+  uint64_t total = 0;
+  int result = -1;
+
+  if (count < 0 || (count > 0 && extents == NULL)){
+    return -1;
+  }
+  for (int i = 0; i < count; i++){
+    if ((extents[i].len > 0 && extents[i].buf == NULL) || extents[i].len > array_size || extents[i].addr > array_size - extents[i].len){
+      return -1;
+    }
+    total += extents[i].len;
+  }
+  //the byte count has to fit the result
+  if (total > INT32_MAX){
+    return -1;
+  }
+  stats_count(STATS_VECTOR_CALLS, 1);
+
+  vector_plan_t plan = {
+    .keys = malloc((count + 1) * sizeof(vector_key_t)),
+    .run_of = malloc((count + 1) * sizeof(int)),
+    .runs = malloc((count + 1) * sizeof(vector_run_t)),
+    .sweep = malloc((count + 1) * sizeof(vector_run_t*)),
+    .num_runs = 0,
+  };
+
+  if (plan.keys != NULL && plan.run_of != NULL && plan.runs != NULL && plan.sweep != NULL &&
+      plan_runs(&plan, is_write, extents, count) == 0 && run_sweep(is_write, plan.sweep, plan.num_runs) == 0){
+    //hand out what the merged runs read
+    for (int i = 0; i < count && !is_write; i++){
+      vector_run_t *run = &plan.runs[plan.run_of[i]];
+      if (extents[i].len > 0 && run->owns_buf){
+        memcpy(extents[i].buf, run->buf + (extents[i].addr - run->start), extents[i].len);
+      }
+    }
+    result = (int) total;
+  }
+
+  for (int r = 0; r < plan.num_runs; r++){
+    if (plan.runs[r].owns_buf){
+      free(plan.runs[r].buf);
+    }
+  }
+  free(plan.sweep);
+  free(plan.runs);
+  free(plan.run_of);
+  free(plan.keys);
+  return result;
+}
+
+int mdadm_readv(const mdadm_extent_t *extents, int count) {
+  return vector_request(false, extents, count);
+}
 
-  return len;
+int mdadm_writev(const mdadm_extent_t *extents, int count) {
+  return vector_request(true, extents, count);
 }
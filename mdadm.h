@@ -2,12 +2,56 @@
 #define MDADM_H_
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "jbod.h"
 
+/* the size of the array's address space, every block of every disk of one
+ * server */
+#define MDADM_ARRAY_SIZE (JBOD_NUM_DISKS * JBOD_DISK_SIZE)
+
+/* How the blocks of the array are spread over the disks. LINEAR puts the
+ * disks back to back. RAID0 deals the blocks out to the disks in turn, a
+ * stripe unit of consecutive blocks at a time, so a sequential transfer keeps
+ * many disks busy at once. RAID5 stripes like RAID0 over all disks but one in
+ * each row of units, which holds the XOR parity of the others, the parity
+ * moving one disk to the left from row to row. It holds the data of one disk
+ * less, and loses none of it when one disk fails (see mdadm_fail_disk).
+ *
+ * Connected to several servers with jbod_connect_nodes, the array spans the
+ * disks of all of them: LINEAR puts the servers back to back and RAID0 deals
+ * its stripe units out to the servers in turn, so a sequential transfer keeps
+ * all of them busy. RAID5 only works on a single server. */
+typedef enum {
+  MDADM_LAYOUT_LINEAR,
+  MDADM_LAYOUT_RAID0,
+  MDADM_LAYOUT_RAID5,
+} mdadm_layout_t;
+
 /* Return 1 on success and -1 on failure */
 int mdadm_mount(void);
 
-/* Return 1 on success and -1 on failure */
+/* Like mdadm_mount, with the array laid out as |layout| until the unmount.
+ * For RAID0 and RAID5 |stripe_blocks| is the stripe unit in blocks and must
+ * divide JBOD_NUM_BLOCKS_PER_DISK, LINEAR ignores it. Data only reads back the
+ * same under the layout and the servers it was written with. RAID5 writes go
+ * to the disks even with a write-back cache, so the parity never lags behind
+ * the data.
+ * mdadm_mount uses LINEAR. Return 1 on success and -1 on failure. */
+int mdadm_mount_layout(mdadm_layout_t layout, uint32_t stripe_blocks);
+
+/* Return the number of bytes the mounted array holds, addresses run from 0 to
+ * one less. That is MDADM_ARRAY_SIZE per server but for RAID5, whose parity
+ * takes a disk's worth of it. */
+uint32_t mdadm_array_size(void);
+
+/* Marks disk |disk_num| of a mounted RAID5 array as failed until the unmount.
+ * Its blocks are no longer read or written: a read rebuilds them from the
+ * other disks of their parity group, and writes keep the parity such that it
+ * still can. Only one disk may fail. Return 1 on success and -1 on failure. */
+int mdadm_fail_disk(int disk_num);
+
+/* Return 1 on success and -1 on failure. Writes the access profile to its
+ * file if profile_start was given one. */
 int mdadm_unmount(void);
 
 /* Return the number of bytes read on success, -1 on failure. */
@@ -16,4 +60,78 @@ int mdadm_read(uint32_t addr, uint32_t len, uint8_t *buf);
 /* Return the number of bytes written on success, -1 on failure. */
 int mdadm_write(uint32_t addr, uint32_t len, const uint8_t *buf);
 
+/* Like mdadm_read/mdadm_write without the 1024-byte limit: |len| may cover the
+ * whole array and span any number of disks. The transfer is streamed in
+ * bounded chunks. Return the number of bytes transferred, -1 on failure. */
+int mdadm_read_large(uint32_t addr, uint32_t len, uint8_t *buf);
+int mdadm_write_large(uint32_t addr, uint32_t len, const uint8_t *buf);
+
+/* One extent of a vectored transfer: |len| bytes at |addr| of the array, to or
+ * from |buf|. */
+typedef struct {
+  uint32_t addr;
+  uint32_t len;
+  uint8_t *buf;
+} mdadm_extent_t;
+
+/* Like calling mdadm_read_large/mdadm_write_large for each of the |count|
+ * extents, but scheduled together: extents that touch or overlap are merged
+ * and the merged ones run in the order of the disk and block they start at,
+ * so the device sweeps across the disks once instead of seeking back and forth
+ * between the calls. Overlapping writes leave what the last of them in
+ * |extents| wrote. Return the number of bytes of all extents on success, -1 on
+ * failure, in which case some of the extents may have been transferred. */
+int mdadm_readv(const mdadm_extent_t *extents, int count);
+int mdadm_writev(const mdadm_extent_t *extents, int count);
+
+/* Called once an asynchronous request has finished, with what the matching
+ * synchronous call would have returned. */
+typedef void (*mdadm_callback_t)(int result, void *arg);
+
+/* Start a read or write of |len| bytes at |addr| that may span any number of
+ * disks, like mdadm_read_large/mdadm_write_large, and return without waiting
+ * for the device. |buf| must stay valid until |callback| runs, which happens
+ * exactly once: on the client's event loop thread, or on the calling thread
+ * when the request needs no device I/O, possibly before the call returns. The
+ * callback must not block, and so must not call the synchronous functions.
+ * Requests touching the same disks are carried out in submission order.
+ * mdadm_read/mdadm_write and their _large variants wait for such a request.
+ * Return 1 if the request was started and -1 if it was rejected, in which
+ * case |callback| is not called. */
+int mdadm_read_async(uint32_t addr, uint32_t len, uint8_t *buf, mdadm_callback_t callback, void *arg);
+int mdadm_write_async(uint32_t addr, uint32_t len, const uint8_t *buf, mdadm_callback_t callback, void *arg);
+
+/* Enables readahead of up to |max_blocks| blocks (at most 64) past every
+ * sequential read stream into the cache, 0 disables it, which is the
+ * default. Has no effect without a cache. Return 1 on success and -1 on
+ * failure. */
+int mdadm_set_readahead(uint32_t max_blocks);
+
+/* Writes every dirty block of a write-back cache (see cache_set_write_back)
+ * to the device, in disk/block order. mdadm_unmount flushes as well, and so
+ * does a write that leaves half of a cache shard dirty (see cache_needs_flush).
+ * A dirty block that fails its checksum stays dirty and makes the flush fail
+ * (see cache_set_checksums). Return 1 on success and -1 on failure. */
+int mdadm_flush(void);
+
+/* Turns integrity checks on or off, off by default. While they are on the
+ * cache checksums its blocks (see cache_set_checksums), and every block read
+ * from the device is checked against the CRC32C of what this client last wrote
+ * to it or read from it since the mount, a mismatch fails the read. May only
+ * be called while unmounted. Return 1 on success and -1 on failure. */
+int mdadm_set_verify(bool enabled);
+
+/* Has the device sign every block of [addr, addr + len) with JBOD_SIGN_BLOCK
+ * and compares the signatures with the client's copies of the blocks: the
+ * clean cached copy, or one read along with the signature. A cached copy that
+ * disagrees is dropped. A RAID5 array with a failed disk cannot be verified.
+ * Return the number of blocks that disagreed, -1 on failure. The async variant runs like mdadm_read_async, so a caller can
+ * verify in the background. */
+int mdadm_verify(uint32_t addr, uint32_t len);
+int mdadm_verify_async(uint32_t addr, uint32_t len, mdadm_callback_t callback, void *arg);
+
+/* Return the number of seek commands skipped because the device was already
+ * positioned at the requested disk and block. */
+uint64_t mdadm_commands_saved(void);
+
 #endif
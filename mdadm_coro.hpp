@@ -0,0 +1,84 @@
+#ifndef MDADM_CORO_HPP_
+#define MDADM_CORO_HPP_
+
+/* C++20 awaitables over mdadm_read_async/mdadm_write_async, so a coroutine
+ * can write
+ *
+ *   int n = co_await mdadm::read(addr, len, buf);
+ *
+ * and get what mdadm_read_large would have returned. The coroutine is resumed
+ * on the client's event loop thread (or keeps running on its own thread when
+ * the request needs no device I/O), so until it moves elsewhere it must not
+ * block, in particular not call the synchronous mdadm functions. Any
+ * coroutine type can await these, the header brings no task type of its own. */
+
+#include <atomic>
+#include <coroutine>
+#include <cstdint>
+
+extern "C" {
+#include "mdadm.h"
+}
+
+namespace mdadm {
+
+class io_awaitable {
+ public:
+  io_awaitable(bool is_write, uint32_t addr, uint32_t len, uint8_t *buf)
+      : is_write_(is_write), addr_(addr), len_(len), buf_(buf) {}
+
+  io_awaitable(const io_awaitable &) = delete;
+  io_awaitable &operator=(const io_awaitable &) = delete;
+
+  bool await_ready() const noexcept { return false; }
+
+  /* the request may finish before mdadm_*_async returns or concurrently with
+   * the rest of this function, so whichever of the two sides gets here second
+   * is the one that resumes the coroutine */
+  bool await_suspend(std::coroutine_handle<> handle) noexcept {
+    handle_ = handle;
+
+    int started = is_write_ ? mdadm_write_async(addr_, len_, buf_, &io_awaitable::on_done, this)
+                            : mdadm_read_async(addr_, len_, buf_, &io_awaitable::on_done, this);
+    if (started != 1) {
+      result_ = -1;
+      return false;
+    }
+
+    return !finished_.exchange(true, std::memory_order_acq_rel);
+  }
+
+  int await_resume() const noexcept { return result_; }
+
+ private:
+  static void on_done(int result, void *arg) {
+    io_awaitable *self = static_cast<io_awaitable *>(arg);
+
+    self->result_ = result;
+    if (self->finished_.exchange(true, std::memory_order_acq_rel)) {
+      self->handle_.resume();
+    }
+  }
+
+  bool is_write_;
+  uint32_t addr_;
+  uint32_t len_;
+  uint8_t *buf_;
+  int result_ = -1;
+  std::atomic<bool> finished_{false};
+  std::coroutine_handle<> handle_;
+};
+
+/* |buf| must stay valid until the co_await completes */
+inline io_awaitable read(uint32_t addr, uint32_t len, uint8_t *buf) {
+  return io_awaitable(false, addr, len, buf);
+}
+
+inline io_awaitable write(uint32_t addr, uint32_t len, const uint8_t *buf) {
+  //mdadm_write_async only reads the buffer
+  return io_awaitable(true, addr, len, const_cast<uint8_t *>(buf));
+}
+
+}  // namespace mdadm
+
+#endif
@@ -4,257 +4,1024 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <errno.h>
+#include <endian.h>
 #include <err.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
 #include "net.h"
 #include "jbod.h"
+#include "stats.h"
+
+/*
+the client core is non-blocking. every socket is in O_NONBLOCK mode and is
+watched by one epoll instance that a background event loop thread waits on.
+a submitted batch is split into one pending entry per request and each entry
+is queued on the connection that serves its disk. the submitting thread sends
+what the socket takes right away, the event loop sends the rest when the socket
+becomes writable again, reads the responses as they arrive and matches them to
+the entries in the order they were sent. the callback of a batch runs once its
+last entry has been answered. jbod_client_operation and jbod_client_pipeline
+submit a batch and wait for it, so no caller ever blocks inside a socket call.
+*/
+
+typedef struct jbod_batch jbod_batch_t;
+
+/* one request of a batch on its way through a connection */
+typedef struct jbod_pending {
+  struct jbod_pending *next;
+  jbod_batch_t *batch;
+  jbod_request_t *req;
+  int conn_index;
+  uint64_t sent_at;
+} jbod_pending_t;
+
+struct jbod_batch {
+  jbod_callback_t callback;
+  void *arg;
+  atomic_int remaining; /* entries not answered yet, on all connections together */
+  atomic_int result;
+  jbod_batch_t *next_done;
+  jbod_pending_t pending[];
+};
+
+/* one connection of the pool. every connection has its own queues, its own
+receive buffer and its own view of where the device pointers are for commands
+sent on it. |io_lock| guards everything but |position| and is only held for
+the non-blocking socket calls, never across a wait. */
+typedef struct {
+  int fd; /* the client socket descriptor for the connection to the server */
+  pthread_mutex_t io_lock;
+  bool broken;     /* a socket call failed, every request on it fails from now on */
+  bool want_write; /* EPOLLOUT is armed because the socket did not take a whole window */
+
+  /* entries waiting to be sent, and entries sent and waiting for their response */
+  jbod_pending_t *queued_head;
+  jbod_pending_t *queued_tail;
+  jbod_pending_t *sent_head;
+  jbod_pending_t *sent_tail;
+  int num_sent;
+
+  /* the gathered headers (and zero masks) and iovecs of the window being sent,
+  tx_iov[tx_first] on is what the socket has not taken yet */
+  uint8_t tx_headers[JBOD_PIPELINE_DEPTH][HEADER_LEN + sizeof(uint64_t)];
+  struct iovec tx_iov[2 * JBOD_PIPELINE_DEPTH];
+  int tx_first;
+  int tx_count;
+
+  /* responses are drained from the socket into this buffer, so a whole window of
+  pipelined responses usually arrives with a single read instead of two reads
+  (header, then block) per packet. rx_start..rx_end is the unconsumed part. */
+  uint8_t rx_buf[JBOD_PIPELINE_DEPTH * (HEADER_LEN + JBOD_BLOCK_SIZE)];
+  int rx_start;
+  int rx_end;
+
+  bool ranges;       /* the server answered the range probe, see JBOD_READ_RANGE */
+  bool zero_elision; /* and the one for JBOD_RANGE_ZERO_ELIDE */
+  jbod_position_t position;
+} jbod_conn_t;
+
+/* a federation's connections are grouped by node, node n's |node_conns| ones
+come after those of the nodes before it */
+static jbod_conn_t conns[JBOD_MAX_NODES * JBOD_MAX_CONNECTIONS];
+static int num_conns = 0;
+static int num_nodes = 0;
+static int node_conns = 0;
+
+/* the event loop, it is told to stop through |stop_fd| */
+static int epoll_fd = -1;
+static int stop_fd = -1;
+static pthread_t loop_thread;
+static bool loop_started = false;
+#define STOP_EVENT (JBOD_MAX_NODES * JBOD_MAX_CONNECTIONS)
+/* one event for every connection of every node and one for |stop_fd| */
+#define LOOP_EVENTS (STOP_EVENT + 1)
+
+/* number of socket system calls issued by the packet layer */
+static atomic_uint_fast64_t num_syscalls = 0;
+
+//the device position is unknown until the next seek on this connection
+static void forget_position(jbod_conn_t *conn) {
+  conn->position.disk = -1;
+  conn->position.block = -1;
+}
+
+//requests are routed by their node and the disk id in bits 28-31 of the op, so a disk always talks to the same connection
+static int route(const jbod_request_t *req) {
+  return req->node * node_conns + (req->op >> 28) % node_conns;
+}
+
+//the connection that serves disk |disk_num| of the federation, -1 if there is none
+static int disk_conn(int disk_num) {
+  if (num_conns == 0 || disk_num < 0 || disk_num / JBOD_NUM_DISKS >= num_nodes){
+    return -1;
+  }
+  return disk_num / JBOD_NUM_DISKS * node_conns + disk_num % JBOD_NUM_DISKS % node_conns;
+}
+
+//the number of blocks the request for |op| carries, 1 for the single block commands
+static int op_blocks(uint32_t op) {
+  uint8_t op_cmd = ((op >> 14) & 0x3f);
+  return (op_cmd == JBOD_READ_RANGE || op_cmd == JBOD_WRITE_RANGE) ? (int) (op & JBOD_RANGE_COUNT_MASK) : 1;
+}
+
+//true if |op| is a range whose blocks go with a zero mask
+static bool op_elides_zeros(uint32_t op) {
+  uint8_t op_cmd = ((op >> 14) & 0x3f);
+  return (op_cmd == JBOD_READ_RANGE || op_cmd == JBOD_WRITE_RANGE) && (op & JBOD_RANGE_ZERO_ELIDE) != 0;
+}
+
+//the mask with a bit for each of the first |blocks| blocks of a range
+static uint64_t range_mask(int blocks) {
+  return blocks == 64 ? ~(uint64_t) 0 : ((uint64_t) 1 << blocks) - 1;
+}
+
+//the number of blocks a successful response to |op| carries
+static int response_blocks(uint32_t op) {
+  uint8_t op_cmd = ((op >> 14) & 0x3f);
+
+  if (op_cmd == JBOD_READ_BLOCK || op_cmd == JBOD_SIGN_BLOCK || op_cmd == JBOD_READ_RANGE){
+    return op_blocks(op);
+  }
+  return 0;
+}
+
 
-/* the client socket descriptor for the connection to the server */
-int fd = -1;
 
-/* attempts to read n (len) bytes from fd; returns true on success and false on failure. 
-It may need to call the system call "read" multiple times to reach the given size len. 
+/* Packs the request header for |op| into |header| and points |iov| at the
+header and, for JBOD_WRITE_BLOCK and JBOD_WRITE_RANGE, at the caller's blocks,
+so the payload is sent without being copied. A write range with
+JBOD_RANGE_ZERO_ELIDE only ever zeroes its blocks, so it is the header and a
+mask with every bit set, and |header| must have room for the mask. Returns the
+number of iovec entries used (1 or 2), or -1 if a write is missing its block.
+0-1 length, 2-5 opcode, 6-7 return code, 8 on the blocks, where needed
 */
+static int encode_packet(uint8_t *header, struct iovec *iov, uint32_t op, uint8_t *block) {
+  uint8_t op_cmd = ((op >> 14) & 0x3f); //getting the op command
+  uint16_t len = HEADER_LEN;
+  int iovcnt = 1;
 
-static bool nread(int fd, int len, uint8_t *buf) {
-  if (buf == NULL){
-    return false;
+  if (op_cmd == JBOD_WRITE_RANGE && op_elides_zeros(op)){
+    uint64_t net_zeros = htobe64(range_mask(op_blocks(op)));
+    memcpy(&header[HEADER_LEN], &net_zeros, sizeof(uint64_t));
+    len = HEADER_LEN + sizeof(uint64_t);
+    stats_count(STATS_ZERO_BLOCKS_ELIDED, op_blocks(op));
   }
-  
-  int bytes_read = 0;
-  
-  //implement non-blocking i/o functionality
-  while (bytes_read < len){
-    int curr_bytes = read(fd, buf + bytes_read, len - bytes_read);
-    if (curr_bytes < 0){
+  else if ((op_cmd == JBOD_WRITE_BLOCK || op_cmd == JBOD_WRITE_RANGE) && op_blocks(op) > 0){
+    if(block == NULL){//if the block(buffer) is null, return -1
+      return -1;
+    }
+    len = HEADER_LEN + op_blocks(op) * JBOD_BLOCK_SIZE;
+    iov[1].iov_base = block;
+    iov[1].iov_len = op_blocks(op) * JBOD_BLOCK_SIZE;
+    iovcnt = 2;
+  }
+
+  //convert op, len, ret with htons or htonl
+  uint16_t net_len = htons(len);
+  uint32_t net_op = htonl(op);
+  uint16_t net_ret = htons(0);
+
+  memcpy(&header[0], &net_len, sizeof(uint16_t));
+  memcpy(&header[2], &net_op, sizeof(uint32_t));
+  memcpy(&header[6], &net_ret, sizeof(uint16_t));
+
+  iov[0].iov_base = header;
+  iov[0].iov_len = iovcnt == 1 ? len : HEADER_LEN;
+
+  return iovcnt;
+}
+
+/* takes the blocks of a successful response to |req| from the |payload_len|
+bytes of |payload|; returns false if they are not what |req| asked for. a
+masked response has its zero blocks filled in here.
+*/
+static bool decode_blocks(jbod_request_t *req, const uint8_t *payload, int payload_len) {
+  int blocks = response_blocks(req->op);
+
+  if (blocks == 0 || !op_elides_zeros(req->op)){
+    if (payload_len != blocks * JBOD_BLOCK_SIZE){
       return false;
     }
-    else{
-      bytes_read += curr_bytes;
+    if (payload_len > 0 && req->block != NULL){
+      memcpy(req->block, payload, payload_len);
     }
+    return true;
+  }
+
+  uint64_t zeros;
+  if (payload_len < (int) sizeof(uint64_t)){
+    return false;
   }
+  memcpy(&zeros, payload, sizeof(uint64_t));
+  zeros = be64toh(zeros);
+  payload += sizeof(uint64_t);
 
+  int num_zeros = __builtin_popcountll(zeros);
+  if ((zeros & ~range_mask(blocks)) != 0 || payload_len != (int) sizeof(uint64_t) + (blocks - num_zeros) * JBOD_BLOCK_SIZE){
+    return false;
+  }
+
+  if (req->block != NULL){
+    for (int i = 0; i < blocks; i++){
+      if (zeros & ((uint64_t) 1 << i)){
+        memset(req->block + i * JBOD_BLOCK_SIZE, 0, JBOD_BLOCK_SIZE);
+      }
+      else{
+        memcpy(req->block + i * JBOD_BLOCK_SIZE, payload, JBOD_BLOCK_SIZE);
+        payload += JBOD_BLOCK_SIZE;
+      }
+    }
+  }
+  stats_count(STATS_ZERO_BLOCKS_ELIDED, num_zeros);
   return true;
 }
 
 
-/* attempts to write n bytes to fd; returns true on success and false on failure 
-It may need to call the system call "write" multiple times to reach the size len.
-*/
+//mark one entry answered, a batch whose last entry it was is pushed on |done|
+static void finish_pending(jbod_pending_t *pending, jbod_batch_t **done) {
+  jbod_batch_t *batch = pending->batch;
 
-static bool nwrite(int fd, int len, uint8_t *buf) {
-  if (buf == NULL) {
-    return false;
+  if (pending->req->ret == -1){
+    atomic_store(&batch->result, -1);
+  }
+  if (atomic_fetch_sub(&batch->remaining, 1) == 1){
+    batch->next_done = *done;
+    *done = batch;
+  }
+}
+
+//run the callbacks of the batches on |done|, with no connection locked
+static void run_done(jbod_batch_t *done) {
+  while (done != NULL){
+    jbod_batch_t *batch = done;
+    done = batch->next_done;
+
+    batch->callback(atomic_load(&batch->result), batch->arg);
+    free(batch);
+  }
+}
+
+//arm or disarm EPOLLOUT, which is only wanted while a window is stuck in the socket
+static void watch_write(jbod_conn_t *conn, bool want_write) {
+  if (conn->want_write == want_write){
+    return;
+  }
+
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN | (want_write ? EPOLLOUT : 0);
+  event.data.u32 = conn - conns;
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+  num_syscalls ++;
+  conn->want_write = want_write;
+}
+
+/* fails every entry queued on or sent over the connection, which is not used
+again. the server may have executed some of them, so nothing is known about
+the device anymore. */
+static void fail_conn(jbod_conn_t *conn, jbod_batch_t **done) {
+  if (!conn->broken){
+    conn->broken = true;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    num_syscalls ++;
   }
-  
-  int bytes_write = 0;
-  
-  //implement non-blocking i/o functionality
-  while (bytes_write < len){
-    int curr_bytes = write(fd, buf + bytes_write, len - bytes_write);
+
+  jbod_pending_t *lists[2] = { conn->sent_head, conn->queued_head };
+  for (int i = 0; i < 2; i++){
+    while (lists[i] != NULL){
+      jbod_pending_t *pending = lists[i];
+      lists[i] = pending->next;
+      pending->req->ret = -1;
+      finish_pending(pending, done);
+    }
+  }
+
+  conn->queued_head = conn->queued_tail = NULL;
+  conn->sent_head = conn->sent_tail = NULL;
+  conn->num_sent = 0;
+  conn->tx_count = 0;
+  conn->rx_start = conn->rx_end = 0;
+}
+
+/* sends as much of the connection's queue as its window and the socket take;
+returns true on success and false on failure. the queued entries are gathered
+into windows of up to JBOD_PIPELINE_DEPTH requests, each written with one
+sendmsg where possible, and a window only starts once the previous one is
+fully written. when the socket is full the rest waits for EPOLLOUT.
+*/
+static bool conn_send(jbod_conn_t *conn) {
+  while (true){
+    if (conn->tx_count == 0){
+      int window = 0;
+      uint64_t now = stats_now();
+
+      while (conn->queued_head != NULL && conn->num_sent < JBOD_PIPELINE_DEPTH){
+        jbod_pending_t *pending = conn->queued_head;
+        conn->queued_head = pending->next;
+        if (conn->queued_head == NULL){
+          conn->queued_tail = NULL;
+        }
+
+        conn->tx_count += encode_packet(conn->tx_headers[window], conn->tx_iov + conn->tx_count, pending->req->op, pending->req->block);
+        pending->sent_at = now;
+        pending->next = NULL;
+        if (conn->sent_tail != NULL){
+          conn->sent_tail->next = pending;
+        }
+        else{
+          conn->sent_head = pending;
+        }
+        conn->sent_tail = pending;
+        conn->num_sent ++;
+        window ++;
+      }
+
+      conn->tx_first = 0;
+      if (window == 0){
+        watch_write(conn, false);
+        return true;
+      }
+      stats_count(STATS_ROUND_TRIPS, 1);
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = conn->tx_iov + conn->tx_first;
+    msg.msg_iovlen = conn->tx_count;
+
+    ssize_t curr_bytes = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+    num_syscalls ++;
     if (curr_bytes < 0){
+      if (errno == EINTR){
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK){
+        watch_write(conn, true);
+        return true;
+      }
       return false;
     }
-    else{
-      bytes_write += curr_bytes;
+    stats_count(STATS_BYTES_SENT, curr_bytes);
+
+    //skip the entries that went out completely and trim the partial one
+    struct iovec *iov = conn->tx_iov + conn->tx_first;
+    while (conn->tx_count > 0 && (size_t) curr_bytes >= iov->iov_len){
+      curr_bytes -= iov->iov_len;
+      iov ++;
+      conn->tx_first ++;
+      conn->tx_count --;
+    }
+    if (conn->tx_count > 0){
+      iov->iov_base = (uint8_t *) iov->iov_base + curr_bytes;
+      iov->iov_len -= curr_bytes;
+    }
+  }
+}
+
+/* matches the complete responses in rx_buf to the entries sent, in order;
+returns false if the server answered something that was never sent or a packet
+that cannot be framed. the blocks of a successful response are copied to its
+request's block (see decode_blocks), a NULL block discards them.
+*/
+static bool parse_responses(jbod_conn_t *conn, jbod_batch_t **done) {
+  uint64_t now = stats_now();
+
+  while (conn->rx_end - conn->rx_start >= (int) HEADER_LEN){
+    uint8_t *header = conn->rx_buf + conn->rx_start;
+    uint16_t len;
+    uint32_t op;
+    uint16_t ret;
+
+    memcpy(&len, &header[0], sizeof(uint16_t));
+    len = ntohs(len);
+    memcpy(&op, &header[2], sizeof(uint32_t));
+    op = ntohl(op);//op code
+    memcpy(&ret, &header[6], sizeof(uint16_t));
+    ret = ntohs(ret);//return code
+
+    //whole blocks, maybe behind a zero mask, follow the header, never more than a range carries
+    int payload_len = len > HEADER_LEN ? len - HEADER_LEN : 0;
+    if (payload_len > (int) sizeof(uint64_t) + JBOD_RANGE_MAX_BLOCKS * JBOD_BLOCK_SIZE){
+      return false;
+    }
+    int packet_len = HEADER_LEN + payload_len;
+    if (conn->rx_end - conn->rx_start < packet_len){
+      break;
+    }
+
+    jbod_pending_t *pending = conn->sent_head;
+    if (pending == NULL){
+      return false;
+    }
+    conn->sent_head = pending->next;
+    if (conn->sent_head == NULL){
+      conn->sent_tail = NULL;
+    }
+    conn->num_sent --;
+
+    //if the return code is -1, or a read came back without its blocks, the operation is not successful
+    bool ok = (int16_t) ret != -1 && op == pending->req->op && decode_blocks(pending->req, header + HEADER_LEN, payload_len);
+    conn->rx_start += packet_len;
+
+    pending->req->ret = ok ? 0 : -1;
+    if (pending->req->ret == -1){
+      forget_position(conn);
     }
+    stats_record((pending->req->op >> 14) & 0x3f, now - pending->sent_at);
+    finish_pending(pending, done);
   }
 
   return true;
 }
 
+/* reads whatever the server has sent until the socket runs dry and handles the
+responses; returns true on success and false on failure. */
+static bool conn_receive(jbod_conn_t *conn, jbod_batch_t **done) {
+  while (true){
+    //move the unconsumed tail to the front so the read gets the most room
+    if (conn->rx_start > 0){
+      memmove(conn->rx_buf, conn->rx_buf + conn->rx_start, conn->rx_end - conn->rx_start);
+      conn->rx_end -= conn->rx_start;
+      conn->rx_start = 0;
+    }
 
-/* Through this function call the client attempts to receive a packet from sd 
-(i.e., receiving a response from the server.). It happens after the client previously 
-forwarded a jbod operation call via a request message to the server.  
-It returns true on success and false on failure. 
-The values of the parameters (including op, ret, block) will be returned to the caller of this function: 
+    int curr_bytes = read(conn->fd, conn->rx_buf + conn->rx_end, sizeof(conn->rx_buf) - conn->rx_end);
+    num_syscalls ++;
+    if (curr_bytes < 0){
+      if (errno == EINTR){
+        continue;
+      }
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    if (curr_bytes == 0){//the server closed the connection
+      return false;
+    }
+    conn->rx_end += curr_bytes;
+    stats_count(STATS_BYTES_RECEIVED, curr_bytes);
 
-op - the address to store the jbod "opcode"  
-ret - the address to store the return value of the server side calling the corresponding jbod_operation function.
-block - holds the received block content if existing (e.g., when the op command is JBOD_READ_BLOCK)
+    if (!parse_responses(conn, done)){
+      return false;
+    }
 
-In your implementation, you can read the packet header first (i.e., read HEADER_LEN bytes first), 
-and then use the length field in the header to determine whether it is needed to read 
-a block of data from the server. You may use the above nread function here.  
+    //a server without nodelay holds its next response until it sees our ack, so while responses are still due send it now rather than when the delayed ack fires
+    if (conn->num_sent > 0){
+      int quickack = 1;
+      setsockopt(conn->fd, IPPROTO_TCP, TCP_QUICKACK, &quickack, sizeof(quickack));
+      num_syscalls ++;
+    }
+  }
+}
+
+//handles the epoll |events| of one connection on the event loop thread
+static void conn_service(jbod_conn_t *conn, uint32_t events) {
+  jbod_batch_t *done = NULL;
+
+  pthread_mutex_lock(&conn->io_lock);
+  if (!conn->broken){
+    bool ok = true;
+
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)){
+      ok = conn_receive(conn, &done);
+    }
+    //answered requests make room in the window, and EPOLLOUT means the socket does
+    if (ok){
+      ok = conn_send(conn);
+    }
+    if (!ok){
+      fail_conn(conn, &done);
+    }
+  }
+  pthread_mutex_unlock(&conn->io_lock);
+
+  run_done(done);
+}
+
+static void *loop_main(void *arg) {
+  struct epoll_event events[LOOP_EVENTS];
+  (void) arg;
+
+  while (true){
+    int count = epoll_wait(epoll_fd, events, LOOP_EVENTS, -1);
+    num_syscalls ++;
+    if (count < 0){
+      if (errno == EINTR){
+        continue;
+      }
+      return NULL;
+    }
+
+    for (int i = 0; i < count; i++){
+      if (events[i].data.u32 == STOP_EVENT){
+        return NULL;
+      }
+      conn_service(&conns[events[i].data.u32], events[i].events);
+    }
+  }
+}
+
+
+
+/* queues all |count| operations in |reqs| on the connections that serve their
+disks and sends them without waiting for any response. within a connection
+the server answers in order, and every connection keeps up to
+JBOD_PIPELINE_DEPTH requests in flight, so independent disks are served
+concurrently and a batch of one window costs about one round trip.
+
+each reqs[i].ret is set to 0 or -1 like the return value of jbod_client_operation
+and |callback| gets 0 if every operation succeeded and -1 otherwise. |reqs|
+and the blocks must stay valid until then. the batches submitted to a
+connection are sent in submission order.
+return: 0 if the batch was submitted, -1 if it was rejected before anything was
+sent, in which case the callback is not called.
 */
+int jbod_client_pipeline_async(jbod_request_t *reqs, int count, jbod_callback_t callback, void *arg) {
+  bool used[JBOD_MAX_NODES * JBOD_MAX_CONNECTIONS] = { false };
+  int last_used = -1;
 
-static bool recv_packet(int sd, uint32_t *op, uint16_t *ret, uint8_t *block) {
-  
-  //if sd is -1, which means jbod server is not connected, return false
-  if (sd == -1){
-    return false;
+  if (num_conns == 0 || count < 0 || (count > 0 && reqs == NULL) || callback == NULL){//not connect jbod server
+    return -1;
   }
 
-  uint8_t header[8];//first create a header with size 8
-  if (!nread(sd, 8, header)){//nread
-    return false;
+  //reject a malformed batch before anything is sent, so no connection is left with unread responses
+  for (int i = 0; i < count; i++){
+    uint8_t op_cmd = ((reqs[i].op >> 14) & 0x3f);
+    if ((op_cmd == JBOD_WRITE_BLOCK || op_cmd == JBOD_WRITE_RANGE) && op_blocks(reqs[i].op) > 0 && !op_elides_zeros(reqs[i].op) && reqs[i].block == NULL){
+      return -1;
+    }
+    if (op_blocks(reqs[i].op) > JBOD_RANGE_MAX_BLOCKS || reqs[i].node < 0 || reqs[i].node >= num_nodes){
+      return -1;
+    }
   }
 
-  uint16_t len;//len
-  memcpy(&len, &header, sizeof(uint16_t));
-  len = ntohs(len);
-  
-  memcpy(op, &header[2], sizeof(uint32_t));
-  *op = ntohl(*op);//op code
+  jbod_batch_t *batch = (jbod_batch_t*) malloc(sizeof(jbod_batch_t) + count * sizeof(jbod_pending_t));
+  if (batch == NULL){
+    return -1;
+  }
+  batch->callback = callback;
+  batch->arg = arg;
+  atomic_init(&batch->remaining, count);
+  atomic_init(&batch->result, 0);
+  batch->next_done = NULL;
 
-  memcpy(ret, &header[6], sizeof(uint16_t));
-  *ret = ntohs(*ret);//return code
+  if (count == 0){
+    run_done(batch);
+    return 0;
+  }
 
-  if(len == 264){
-    if (!nread(sd, 256, block)){//if the len is 264, read the rest of the header
-      return false;
+  uint64_t blocks_written = 0;
+  for (int i = 0; i < count; i++){
+    uint8_t op_cmd = ((reqs[i].op >> 14) & 0x3f);
+
+    batch->pending[i].batch = batch;
+    batch->pending[i].req = &reqs[i];
+    batch->pending[i].conn_index = route(&reqs[i]);
+    used[batch->pending[i].conn_index] = true;
+    if (batch->pending[i].conn_index > last_used){
+      last_used = batch->pending[i].conn_index;
     }
-    else{
-      return true;
+    if (op_cmd == JBOD_WRITE_BLOCK || op_cmd == JBOD_WRITE_RANGE){
+      blocks_written += op_blocks(reqs[i].op);
     }
   }
+  stats_count(STATS_BLOCKS_WRITTEN, blocks_written);
 
-  return true;
+  /* the batch can complete as soon as its entries on the last connection are
+  queued, so neither |batch| nor |reqs| is touched after that */
+  for (int c = 0; c <= last_used; c++){
+    jbod_conn_t *conn = &conns[c];
+    jbod_batch_t *done = NULL;
+
+    if (!used[c]){
+      continue;
+    }
+
+    pthread_mutex_lock(&conn->io_lock);
+    for (int i = 0; i < count; i++){
+      jbod_pending_t *pending = &batch->pending[i];
+      if (pending->conn_index != c){
+        continue;
+      }
+      pending->next = NULL;
+      if (conn->queued_tail != NULL){
+        conn->queued_tail->next = pending;
+      }
+      else{
+        conn->queued_head = pending;
+      }
+      conn->queued_tail = pending;
+    }
+
+    if (conn->broken || !conn_send(conn)){
+      fail_conn(conn, &done);
+    }
+    pthread_mutex_unlock(&conn->io_lock);
+
+    run_done(done);
+  }
+
+  return 0;
 }
 
 
 
-/* The client attempts to send a jbod request packet to sd (i.e., the server socket here); 
-returns true on success and false on failure. 
+/* a caller of the synchronous functions waits on this until its batch is done */
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool done;
+  int result;
+} jbod_waiter_t;
+
+static void wake_waiter(int result, void *arg) {
+  jbod_waiter_t *waiter = (jbod_waiter_t*) arg;
 
-op - the opcode. 
-block- when the command is JBOD_WRITE_BLOCK, the block will contain data to write to the server jbod system;
-otherwise it is NULL.
+  pthread_mutex_lock(&waiter->lock);
+  waiter->result = result;
+  waiter->done = true;
+  pthread_cond_signal(&waiter->cond);
+  pthread_mutex_unlock(&waiter->lock);
+}
 
-The above information (when applicable) has to be wrapped into a jbod request packet (format specified in readme).
-You may call the above nwrite function to do the actual sending.  
+/* sends all |count| operations in |reqs| as one pipelined batch (see
+jbod_client_pipeline_async) and waits until every response has arrived.
+return: 0 if every operation succeeded, -1 otherwise.
 */
-static bool send_packet(int sd, uint32_t op, uint8_t *block) {
-  /*
-  assume the size of the header is 8 bytes, so use uint8_t
-  0-1 length, 2-5 opcode, 6-7 return code, 8 - 263 block, where needed
-  */
-
-  //if sd is -1, which means jbod server is not connected, return false
-  if (sd == -1){
-    return false;
+int jbod_client_pipeline(jbod_request_t *reqs, int count) {
+  jbod_waiter_t waiter = { .done = false, .result = -1 };
+
+  pthread_mutex_init(&waiter.lock, NULL);
+  pthread_cond_init(&waiter.cond, NULL);
+
+  if (jbod_client_pipeline_async(reqs, count, wake_waiter, &waiter) == 0){
+    pthread_mutex_lock(&waiter.lock);
+    while (!waiter.done){
+      pthread_cond_wait(&waiter.cond, &waiter.lock);
+    }
+    pthread_mutex_unlock(&waiter.lock);
   }
 
-  uint8_t op_cmd = ((op >> 14) & 0x3f); //getting the op command
-  
-  if (op_cmd == JBOD_WRITE_BLOCK){
-    if(block == NULL){//if the block(buffer) is null, return false
-      return false;
+  pthread_cond_destroy(&waiter.cond);
+  pthread_mutex_destroy(&waiter.lock);
+  return waiter.result;
+}
+
+
+
+/* sends the JBOD operation to the server and waits for the response.
+JBOD_MOUNT and JBOD_UNMOUNT go to every node of a federation, which only counts
+as mounted once all of them are: a mount that some node rejects is undone on
+the others. any other operation goes to node 0.
+
+The meaning of each parameter is the same as in the original jbod_operation function.
+return: 0 means success, -1 means failure.
+*/
+int jbod_client_operation(uint32_t op, uint8_t *block) {
+  uint8_t op_cmd = ((op >> 14) & 0x3f);
+  jbod_request_t reqs[JBOD_MAX_NODES];
+
+  if (num_conns == 0){//not connect jbod server
+    return -1;
+  }
+
+  if (op_cmd != JBOD_MOUNT && op_cmd != JBOD_UNMOUNT){
+    reqs[0] = (jbod_request_t) { .op = op, .block = block, .ret = -1, .node = 0 };
+    //if the operation is successful, return 0
+    return jbod_client_pipeline(reqs, 1);
+  }
+
+  //mounting or unmounting invalidates what we know about every connection
+  for (int i = 0; i < num_conns; i++){
+    forget_position(&conns[i]);
+  }
+
+  for (int node = 0; node < num_nodes; node++){
+    reqs[node] = (jbod_request_t) { .op = op, .block = block, .ret = -1, .node = node };
+  }
+  if (jbod_client_pipeline(reqs, num_nodes) == 0){
+    return 0;
+  }
+
+  if (op_cmd == JBOD_MOUNT){
+    int num_undone = 0;
+    for (int node = 0; node < num_nodes; node++){
+      if (reqs[node].ret == 0){
+        reqs[num_undone] = (jbod_request_t) { .op = (uint32_t) JBOD_UNMOUNT << 14, .block = NULL, .ret = -1, .node = node };
+        num_undone ++;
+      }
     }
+    jbod_client_pipeline(reqs, num_undone);
+  }
+  return -1;
+}
+
+/* returns the number of socket system calls made by the packet layer so far */
+uint64_t jbod_client_syscalls(void) {
+  return num_syscalls;
+}
+
 
-    //convert op, len, ret with htons or htonl
-    op = htonl(op);
-    uint16_t len = 264;
-    uint16_t ret = 0;
-    len = htons(len);
-    ret = htons(ret);
 
-    uint8_t header[264];//create a header with size 8 + 256
 
-    memcpy(&header, &len, sizeof(uint16_t));
-    memcpy(&header[2], &op, sizeof(uint32_t));
-    memcpy(&header[6], &ret, sizeof(uint16_t));
-    memcpy(&header[8], block, 256);//copy len, op, ret, block to header
+/* stops the event loop thread, no callback runs after it returns */
+static void stop_loop(void) {
+  if (loop_started){
+    uint64_t stop = 1;
+    if (write(stop_fd, &stop, sizeof(stop)) == sizeof(stop)){
+      pthread_join(loop_thread, NULL);
+    }
+    loop_started = false;
+  }
+}
+
+/* sends the |count| probes in |reqs| as one batch and waits for their responses
+ * for JBOD_CONNECT_TIMEOUT_MS at most; returns true if all arrived in time,
+ * each reqs[i].ret then holds its result. on a timeout the event loop is
+ * stopped and the batch failed, so only jbod_disconnect is left to call. */
+static bool probe_conns(jbod_request_t *reqs, int count) {
+  jbod_waiter_t waiter = { .done = false, .result = -1 };
+  pthread_condattr_t attr;
+  struct timespec deadline;
+  bool answered = false;
+
+  pthread_mutex_init(&waiter.lock, NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&waiter.cond, &attr);
+  pthread_condattr_destroy(&attr);
 
-    return nwrite(sd, 264, header);//nwrite
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += JBOD_CONNECT_TIMEOUT_MS / 1000;
+  deadline.tv_nsec += (long) (JBOD_CONNECT_TIMEOUT_MS % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000){
+    deadline.tv_sec ++;
+    deadline.tv_nsec -= 1000000000;
   }
-  else{
-    op = htonl(op);//convert op, len, ret with htons or htonl
-    uint16_t len = 8;
-    uint16_t ret = 0;
-    len = htons(len);
-    ret = htons(ret);
 
-    uint8_t header[8];//create a header with size 8
+  if (jbod_client_pipeline_async(reqs, count, wake_waiter, &waiter) == 0){
+    int wait_result = 0;
 
-    memcpy(&header, &len, sizeof(uint16_t));
-    memcpy(&header[2], &op, sizeof(uint32_t));
-    memcpy(&header[6], &ret, sizeof(uint16_t));//copy len, op, ret, block to header
+    pthread_mutex_lock(&waiter.lock);
+    while (!waiter.done && wait_result != ETIMEDOUT){
+      wait_result = pthread_cond_timedwait(&waiter.cond, &waiter.lock, &deadline);
+    }
+    answered = waiter.done;
+    pthread_mutex_unlock(&waiter.lock);
 
-    return nwrite(sd, 8, header);//nwrite
+    //nothing may call back into |waiter| once it is gone
+    if (!answered){
+      stop_loop();
+      for (int i = 0; i < num_conns; i++){
+        jbod_batch_t *done = NULL;
+        fail_conn(&conns[i], &done);
+        run_done(done);
+      }
+    }
   }
+
+  pthread_cond_destroy(&waiter.cond);
+  pthread_mutex_destroy(&waiter.lock);
+  return answered;
 }
 
 
 
+/* attempts to open |num_connections| sockets to the server at the given ip
+ * and port and starts the event loop; returns true if all of them connected
+ * and answered and false if not, in which case none is left open. requests for
+ * disk d go over connection d % num_connections, so independent disks are
+ * served over separate streams. the stock jbod_server serves one client at a
+ * time and never answers a second socket, so against it only a pool of 1
+ * works and a larger one fails after JBOD_CONNECT_TIMEOUT_MS; server.c serves
+ * every socket.
+*/
+bool jbod_connect_pool(const char *ip, uint16_t port, int num_connections) {
+  jbod_node_t node = { .ip = ip, .port = port };
+  return jbod_connect_nodes(&node, 1, num_connections);
+}
 
-/* attempts to connect to server and set the global fd variable to the
- * socket; returns true if successful and false if not. 
- * this function will be invoked by tester to connect to the server at given ip and port.
- * you will not call it in mdadm.c
+
+
+/* like jbod_connect_pool, for a federation of the |num_nodes_wanted| servers
+ * in |nodes|, which each hold JBOD_NUM_DISKS disks and get
+ * |connections_per_node| sockets of their own. the nodes' connections work side by side like those of one server, so
+ * requests to different nodes go out and are answered concurrently.
 */
-bool jbod_connect(const char *ip, uint16_t port) {
-  struct sockaddr_in s_addr;//jbod_connect, copied from presentation
+bool jbod_connect_nodes(const jbod_node_t *nodes, int num_nodes_wanted, int connections_per_node) {
+  struct sockaddr_in s_addrs[JBOD_MAX_NODES];//jbod_connect, copied from presentation
 
-  s_addr.sin_family = AF_INET;
-  s_addr.sin_port = htons(port);
-  if (inet_aton(ip, &s_addr.sin_addr) == 0){
+  if (num_conns != 0 || nodes == NULL || num_nodes_wanted < 1 || num_nodes_wanted > JBOD_MAX_NODES ||
+      connections_per_node < 1 || connections_per_node > JBOD_MAX_CONNECTIONS){
     return false;
   }
 
-  //create a socket
-  fd = socket(PF_INET, SOCK_STREAM, 0);
+  for (int node = 0; node < num_nodes_wanted; node++){
+    s_addrs[node].sin_family = AF_INET;
+    s_addrs[node].sin_port = htons(nodes[node].port);
+    if (nodes[node].ip == NULL || inet_aton(nodes[node].ip, &s_addrs[node].sin_addr) == 0){
+      return false;
+    }
+  }
 
-  if (fd == -1){
-    //printf("Socket creation failed");
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  stop_fd = eventfd(0, EFD_CLOEXEC);
+  if (epoll_fd == -1 || stop_fd == -1){
+    jbod_disconnect();
     return false;
   }
 
-  if( connect(fd, (const struct sockaddr *)&s_addr, sizeof(s_addr)) == -1){
-    //printf("Error on socket connect");
-    return false;
+  num_nodes = num_nodes_wanted;
+  node_conns = connections_per_node;
+
+  for (int i = 0; i < num_nodes * node_conns; i++){
+    jbod_conn_t *conn = &conns[i];
+    const struct sockaddr_in *s_addr = &s_addrs[i / node_conns];
+
+    pthread_mutex_init(&conn->io_lock, NULL);
+    conn->broken = false;
+    conn->want_write = false;
+    conn->queued_head = conn->queued_tail = NULL;
+    conn->sent_head = conn->sent_tail = NULL;
+    conn->num_sent = 0;
+    conn->tx_first = 0;
+    conn->tx_count = 0;
+    conn->rx_start = 0;
+    conn->rx_end = 0;
+    conn->ranges = false;
+    conn->zero_elision = false;
+    forget_position(conn);
+
+    //create a socket
+    conn->fd = socket(PF_INET, SOCK_STREAM, 0);
+    num_conns = i + 1;
+
+    if (conn->fd == -1 || connect(conn->fd, (const struct sockaddr *) s_addr, sizeof(*s_addr)) == -1){
+      jbod_disconnect();
+      return false;
+    }
+
+    //a pipelined batch is already written in one go, so never hold it back waiting for acks
+    int nodelay = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u32 = i;
+    if (fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK) == -1 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->fd, &event) == -1){
+      jbod_disconnect();
+      return false;
+    }
   }
 
-  return true;
-}
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.u32 = STOP_EVENT;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_fd, &event) == -1 || pthread_create(&loop_thread, NULL, loop_main, NULL) != 0){
+    jbod_disconnect();
+    return false;
+  }
+  loop_started = true;
 
+  /* ask every connection's server whether it knows the range commands and zero
+  elision, an empty range is a no-op for the ones that do. connection i of a
+  node serves its disk i. all connections are asked at once and a server that
+  leaves one unanswered fails the connect, see JBOD_CONNECT_TIMEOUT_MS. */
+  jbod_request_t probes[JBOD_MAX_NODES * JBOD_MAX_CONNECTIONS];
+  int probed[JBOD_MAX_NODES * JBOD_MAX_CONNECTIONS];
+  int num_probes = 0;
 
+  for (int i = 0; i < num_conns; i++){
+    probes[i] = (jbod_request_t) { .op = ((uint32_t) (i % node_conns) << 28) | ((uint32_t) JBOD_READ_RANGE << 14), .block = NULL, .ret = -1, .node = i / node_conns };
+  }
+  if (!probe_conns(probes, num_conns)){
+    jbod_disconnect();
+    return false;
+  }
 
-/* disconnects from the server and resets fd */
-void jbod_disconnect(void) {
-  if (fd != -1){
-    close(fd);
+  for (int i = 0; i < num_conns; i++){
+    conns[i].ranges = probes[i].ret == 0;
+    if (conns[i].ranges){
+      probes[num_probes] = probes[i];
+      probes[num_probes].op |= JBOD_RANGE_ZERO_ELIDE;
+      probes[num_probes].ret = -1;
+      probed[num_probes] = i;
+      num_probes ++;
+    }
+  }
+  if (!probe_conns(probes, num_probes)){
+    jbod_disconnect();
+    return false;
+  }
+  for (int i = 0; i < num_probes; i++){
+    conns[probed[i]].zero_elision = probes[i].ret == 0;
   }
-  fd = -1;
-  //printf("Have not established the connection");
+
+  return true;
 }
 
 
-/* sends the JBOD operation to the server (use the send_packet function) and receives 
-(use the recv_packet function) and processes the response. 
 
-The meaning of each parameter is the same as in the original jbod_operation function. 
-return: 0 means success, -1 means failure.
+/* attempts to connect to server with a single connection; returns true if
+ * successful and false if not.
+ * this function will be invoked by tester to connect to the server at given ip and port.
+ * you will not call it in mdadm.c
 */
+bool jbod_connect(const char *ip, uint16_t port) {
+  return jbod_connect_pool(ip, port, 1);
+}
 
 
-int jbod_client_operation(uint32_t op, uint8_t *block) {
-  uint16_t ret;//return code
-  uint32_t r_op;//op code
-  
-  if (fd == -1){//not connect jbod server
-    return -1;
-  }
 
-  //send the packet, return -1 if failure
-  if (send_packet(fd, op, block) == false){
-    return -1;
+/* stops the event loop and disconnects every connection of the pool, must
+ * not race with I/O */
+void jbod_disconnect(void) {
+  stop_loop();
+
+  for (int i = 0; i < num_conns; i++){
+    //only a connect that gave up on its probes leaves requests behind, they fail now
+    if (conns[i].sent_head != NULL || conns[i].queued_head != NULL){
+      jbod_batch_t *done = NULL;
+      fail_conn(&conns[i], &done);
+      run_done(done);
+    }
+    if (conns[i].fd != -1){
+      close(conns[i].fd);
+    }
+    conns[i].fd = -1;
+    conns[i].rx_start = 0;
+    conns[i].rx_end = 0;
+    forget_position(&conns[i]);
+    pthread_mutex_destroy(&conns[i].io_lock);
   }
+  num_conns = 0;
+  num_nodes = 0;
+  node_conns = 0;
 
-  //recive the packet, return -1 if failure
-  if (recv_packet(fd, &r_op, &ret, block) == false){
-    return -1;
+  if (stop_fd != -1){
+    close(stop_fd);
+    stop_fd = -1;
   }
-  else{
-    if (ret == -1){//if the return code is -1, this means the operation is not successful
-      return -1;
-    }
+  if (epoll_fd != -1){
+    close(epoll_fd);
+    epoll_fd = -1;
   }
+}
 
-  //if the operation is successful, return 0
-  return 0;
+
+/* returns the number of open connections in the pool, to all nodes together */
+int jbod_client_connections(void) {
+  return num_conns;
 }
 
+
+/* returns the number of servers connected to, 0 when not connected */
+int jbod_client_nodes(void) {
+  return num_nodes;
+}
+
+
+/* returns the index of the connection that serves |disk_num| */
+int jbod_client_route(int disk_num) {
+  return disk_conn(disk_num);
+}
+
+
+/* returns true if the server behind the connection that serves |disk_num|
+takes the range commands */
+bool jbod_client_ranges(int disk_num) {
+  return disk_conn(disk_num) != -1 && conns[disk_conn(disk_num)].ranges;
+}
+
+
+/* returns true if the server behind the connection that serves |disk_num|
+takes JBOD_RANGE_ZERO_ELIDE */
+bool jbod_client_zero_elision(int disk_num) {
+  return disk_conn(disk_num) != -1 && conns[disk_conn(disk_num)].zero_elision;
+}
+
+
+/* returns the device position tracked for the connection that serves
+|disk_num|, or NULL when not connected. only the caller that owns the
+connection may plan seeks from it and update it as it queues seeks and
+transfers, and it must keep owning the connection until the planned batch has
+completed, so no other batch moves the device in between. the packet layer
+resets it to unknown (-1) whenever a command on that connection fails and on
+mount/unmount.
+*/
+jbod_position_t *jbod_client_position(int disk_num) {
+  if (disk_conn(disk_num) == -1){
+    return NULL;
+  }
+  return &conns[disk_conn(disk_num)].position;
+}
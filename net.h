@@ -4,12 +4,88 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "jbod.h"
+
 #define HEADER_LEN (sizeof(uint16_t) + sizeof(uint32_t) + sizeof(uint16_t))
 #define JBOD_SERVER "127.0.0.1"
 #define JBOD_PORT 3333
 
+/* the most requests kept in flight at once on one connection */
+#define JBOD_PIPELINE_DEPTH 64
+
+/* the most sockets jbod_connect_pool may open to one server */
+#define JBOD_MAX_CONNECTIONS 16
+
+/* how long connecting waits for every socket's server to answer its first
+ * request before it gives up */
+#define JBOD_CONNECT_TIMEOUT_MS 1000
+
+/* the most servers jbod_connect_nodes may federate. disk d of node n is disk
+ * n * JBOD_NUM_DISKS + d of the federation, in the functions below that take
+ * a disk number. */
+#define JBOD_MAX_NODES 4
+
+/* a protocol extension past the jbod_cmd_t commands: a range command moves up
+ * to JBOD_RANGE_MAX_BLOCKS consecutive blocks of one disk in a single packet.
+ * the op carries the disk and the first block as usual and the number of
+ * blocks in bits 0-7. it positions the device by itself, afterwards the block
+ * pointer is just past the range. a range of 0 blocks does nothing and is
+ * answered with 0 by servers that support ranges, older servers answer the
+ * unknown command with -1, which is how the client tells them apart.
+ *
+ * with JBOD_RANGE_ZERO_ELIDE set in the op, the blocks of the range, the read
+ * response's or the write request's, are sent as a big-endian 64-bit mask
+ * whose bit i is set if block i is all zeros, followed by only the blocks that
+ * are not. a server without zero elision rejects such an op, so an empty range
+ * with the flag probes for it the same way. */
+#define JBOD_READ_RANGE JBOD_NUM_CMDS
+#define JBOD_WRITE_RANGE (JBOD_NUM_CMDS + 1)
+#define JBOD_RANGE_COUNT_MASK 0xff
+#define JBOD_RANGE_ZERO_ELIDE 0x2000
+#define JBOD_RANGE_MAX_BLOCKS 64
+
+/* where a connection's device pointers are, -1 when unknown */
+typedef struct {
+  int disk;
+  int block;
+} jbod_position_t;
+
+/* one operation of a pipelined batch. |block| is used as in
+ * jbod_client_operation, |ret| receives that operation's result. |node| is
+ * the server it goes to, always 0 without a federation. */
+typedef struct {
+  uint32_t op;
+  uint8_t *block;
+  int ret;
+  int node;
+} jbod_request_t;
+
+/* a server to connect to, see jbod_connect_nodes */
+typedef struct {
+  const char *ip;
+  uint16_t port;
+} jbod_node_t;
+
+/* called once a batch submitted with jbod_client_pipeline_async has been
+ * answered, with 0 if every operation succeeded and -1 otherwise. it runs on
+ * the client's event loop thread, or on the submitting thread when the batch
+ * fails before anything is sent, and must not block: calling the synchronous
+ * functions from it deadlocks. */
+typedef void (*jbod_callback_t)(int result, void *arg);
+
 int jbod_client_operation(uint32_t op, uint8_t *block);
+int jbod_client_pipeline(jbod_request_t *reqs, int count);
+int jbod_client_pipeline_async(jbod_request_t *reqs, int count, jbod_callback_t callback, void *arg);
+uint64_t jbod_client_syscalls(void);
 bool jbod_connect(const char *ip, uint16_t port);
+bool jbod_connect_pool(const char *ip, uint16_t port, int num_connections);
+bool jbod_connect_nodes(const jbod_node_t *nodes, int num_nodes, int connections_per_node);
 void jbod_disconnect(void);
+int jbod_client_connections(void);
+int jbod_client_nodes(void);
+int jbod_client_route(int disk_num);
+bool jbod_client_ranges(int disk_num);
+bool jbod_client_zero_elision(int disk_num);
+jbod_position_t *jbod_client_position(int disk_num);
 
 #endif
@@ -0,0 +1,256 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "profile.h"
+#include "net.h"
+
+/*
+the per-block counters are relaxed atomics indexed by disk_num *
+JBOD_NUM_BLOCKS_PER_DISK + block_num, like the ids of the cache, so counting an
+access takes no lock. |last_access| holds the value of |num_accesses| at a block's
+last access, 0 if it has none, which is where the reuse distance comes from.
+only the run lengths depend on the order of the calls, they are kept under a
+lock.
+*/
+#define PROFILE_DISKS (JBOD_MAX_NODES * JBOD_NUM_DISKS)
+#define PROFILE_BLOCKS (PROFILE_DISKS * JBOD_NUM_BLOCKS_PER_DISK)
+
+static atomic_bool enabled = false;
+static atomic_uint_fast32_t reads[PROFILE_BLOCKS];
+static atomic_uint_fast32_t writes[PROFILE_BLOCKS];
+static atomic_uint_fast64_t last_access[PROFILE_BLOCKS];
+static atomic_uint_fast64_t num_accesses = 0;
+static atomic_uint_fast64_t reuse_histogram[PROFILE_REUSE_BUCKETS];
+
+/* the open run ends at block |run_end|, it is |run_blocks| long */
+static pthread_mutex_t run_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t run_end = 0;
+static uint64_t run_blocks = 0;
+static uint64_t run_histogram[PROFILE_RUN_BUCKETS];
+static uint64_t sequential_calls = 0;
+static uint64_t random_calls = 0;
+
+/* profile_start and profile_stop are serialized by this lock, the hot path never takes it */
+static pthread_mutex_t control_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *unmount_path = NULL;
+
+
+//the power of two bucket of |n|, 0 and 1 both go to the first one
+static int bucket_of(uint64_t n, int num_buckets) {
+  int bucket = 0;
+
+  while (n > 1 && bucket < num_buckets - 1){
+    n >>= 1;
+    bucket ++;
+  }
+  return bucket;
+}
+
+int profile_start(const char *path) {
+  int result = -1;
+
+  pthread_mutex_lock(&control_lock);
+  if (!enabled){
+    free(unmount_path);
+    unmount_path = path != NULL ? strdup(path) : NULL;
+
+    if (path == NULL || unmount_path != NULL){
+      for (int i = 0; i < PROFILE_BLOCKS; i++){
+        atomic_store_explicit(&reads[i], 0, memory_order_relaxed);
+        atomic_store_explicit(&writes[i], 0, memory_order_relaxed);
+        atomic_store_explicit(&last_access[i], 0, memory_order_relaxed);
+      }
+      for (int i = 0; i < PROFILE_REUSE_BUCKETS; i++){
+        atomic_store_explicit(&reuse_histogram[i], 0, memory_order_relaxed);
+      }
+      atomic_store_explicit(&num_accesses, 0, memory_order_relaxed);
+
+      pthread_mutex_lock(&run_lock);
+      memset(run_histogram, 0, sizeof(run_histogram));
+      run_blocks = 0;
+      sequential_calls = 0;
+      random_calls = 0;
+      pthread_mutex_unlock(&run_lock);
+
+      enabled = true;
+      result = 1;
+    }
+  }
+  pthread_mutex_unlock(&control_lock);
+
+  return result;
+}
+
+int profile_stop(void) {
+  int result = -1;
+
+  pthread_mutex_lock(&control_lock);
+  if (enabled){
+    enabled = false;
+    result = 1;
+  }
+  pthread_mutex_unlock(&control_lock);
+
+  return result;
+}
+
+bool profile_enabled(void) {
+  return atomic_load_explicit(&enabled, memory_order_relaxed);
+}
+
+void profile_call(uint32_t first_block, uint32_t num_blocks) {
+  if (!profile_enabled() || num_blocks == 0){
+    return;
+  }
+
+  pthread_mutex_lock(&run_lock);
+  //a call that starts in the last block of the run or right after it continues the run
+  if (run_blocks > 0 && (first_block == run_end || first_block == run_end + 1)){
+    run_blocks += first_block + num_blocks - 1 - run_end;
+    sequential_calls ++;
+  }
+  else{
+    if (run_blocks > 0){
+      run_histogram[bucket_of(run_blocks, PROFILE_RUN_BUCKETS)] ++;
+    }
+    run_blocks = num_blocks;
+    random_calls ++;
+  }
+  run_end = first_block + num_blocks - 1;
+  pthread_mutex_unlock(&run_lock);
+}
+
+void profile_access(bool is_write, uint32_t disk_num, uint32_t block_num) {
+  if (!profile_enabled() || disk_num >= PROFILE_DISKS || block_num >= JBOD_NUM_BLOCKS_PER_DISK){
+    return;
+  }
+
+  uint32_t id = disk_num * JBOD_NUM_BLOCKS_PER_DISK + block_num;
+  atomic_fetch_add_explicit(is_write ? &writes[id] : &reads[id], 1, memory_order_relaxed);
+
+  uint64_t now = atomic_fetch_add_explicit(&num_accesses, 1, memory_order_relaxed) + 1;
+  uint64_t last = atomic_exchange_explicit(&last_access[id], now, memory_order_relaxed);
+  //another thread's access may have taken a later tick but stored it first
+  if (last != 0 && last < now){
+    atomic_fetch_add_explicit(&reuse_histogram[bucket_of(now - last - 1, PROFILE_REUSE_BUCKETS)], 1, memory_order_relaxed);
+  }
+}
+
+//the number of disks the dump covers: those of every server up to the highest disk accessed
+static int dumped_disks(void) {
+  int num_disks = JBOD_NUM_DISKS;
+
+  for (int id = 0; id < PROFILE_BLOCKS; id++){
+    if (atomic_load_explicit(&last_access[id], memory_order_relaxed) != 0 && id / JBOD_NUM_BLOCKS_PER_DISK >= num_disks){
+      num_disks = (id / JBOD_NUM_BLOCKS_PER_DISK / JBOD_NUM_DISKS + 1) * JBOD_NUM_DISKS;
+    }
+  }
+  return num_disks;
+}
+
+int profile_dump_csv(FILE *out) {
+  int num_disks = dumped_disks();
+  int result = 0;
+
+  if (out == NULL){
+    return -1;
+  }
+
+  result |= fprintf(out, "disk,block,reads,writes\n");
+  for (int id = 0; id < num_disks * JBOD_NUM_BLOCKS_PER_DISK && result >= 0; id++){
+    result |= fprintf(out, "%d,%d,%u,%u\n", id / JBOD_NUM_BLOCKS_PER_DISK, id % JBOD_NUM_BLOCKS_PER_DISK,
+                      (unsigned) atomic_load_explicit(&reads[id], memory_order_relaxed),
+                      (unsigned) atomic_load_explicit(&writes[id], memory_order_relaxed));
+  }
+
+  return result < 0 ? -1 : 1;
+}
+
+//one disk's counters as a JSON array
+static int dump_disk(FILE *out, atomic_uint_fast32_t *counters, int disk_num) {
+  int result = fprintf(out, "%s[", disk_num == 0 ? "" : ", ");
+
+  for (int block_num = 0; block_num < JBOD_NUM_BLOCKS_PER_DISK; block_num++){
+    result |= fprintf(out, "%s%u", block_num == 0 ? "" : ", ",
+                      (unsigned) atomic_load_explicit(&counters[disk_num * JBOD_NUM_BLOCKS_PER_DISK + block_num], memory_order_relaxed));
+  }
+  return result | fprintf(out, "]");
+}
+
+int profile_dump_json(FILE *out) {
+  uint64_t runs[PROFILE_RUN_BUCKETS];
+  uint64_t num_sequential;
+  uint64_t num_random;
+  uint64_t blocks_touched = 0;
+  int num_disks = dumped_disks();
+  int result = 0;
+
+  if (out == NULL){
+    return -1;
+  }
+
+  //the open run counts as if it ended now
+  pthread_mutex_lock(&run_lock);
+  memcpy(runs, run_histogram, sizeof(runs));
+  if (run_blocks > 0){
+    runs[bucket_of(run_blocks, PROFILE_RUN_BUCKETS)] ++;
+  }
+  num_sequential = sequential_calls;
+  num_random = random_calls;
+  pthread_mutex_unlock(&run_lock);
+
+  for (int id = 0; id < PROFILE_BLOCKS; id++){
+    if (atomic_load_explicit(&last_access[id], memory_order_relaxed) != 0){
+      blocks_touched ++;
+    }
+  }
+
+  result |= fprintf(out, "{\"accesses\": %llu, \"blocks_touched\": %llu, \"sequential_calls\": %llu, \"random_calls\": %llu, \"run_lengths\": [",
+                    (unsigned long long) atomic_load_explicit(&num_accesses, memory_order_relaxed), (unsigned long long) blocks_touched,
+                    (unsigned long long) num_sequential, (unsigned long long) num_random);
+  for (int bucket = 0; bucket < PROFILE_RUN_BUCKETS; bucket++){
+    result |= fprintf(out, "%s%llu", bucket == 0 ? "" : ", ", (unsigned long long) runs[bucket]);
+  }
+  result |= fprintf(out, "], \"reuse_distances\": [");
+  for (int bucket = 0; bucket < PROFILE_REUSE_BUCKETS; bucket++){
+    result |= fprintf(out, "%s%llu", bucket == 0 ? "" : ", ", (unsigned long long) atomic_load_explicit(&reuse_histogram[bucket], memory_order_relaxed));
+  }
+
+  result |= fprintf(out, "], \"heatmap\": {\"disks\": %d, \"reads\": [", num_disks);
+  for (int disk_num = 0; disk_num < num_disks; disk_num++){
+    result |= dump_disk(out, reads, disk_num);
+  }
+  result |= fprintf(out, "], \"writes\": [");
+  for (int disk_num = 0; disk_num < num_disks; disk_num++){
+    result |= dump_disk(out, writes, disk_num);
+  }
+  result |= fprintf(out, "]}}\n");
+
+  return result < 0 ? -1 : 1;
+}
+
+int profile_dump_file(void) {
+  int result = 1;
+
+  pthread_mutex_lock(&control_lock);
+  if (unmount_path != NULL){
+    size_t path_len = strlen(unmount_path);
+    bool json = path_len >= 5 && strcmp(unmount_path + path_len - 5, ".json") == 0;
+    FILE *out = fopen(unmount_path, "w");
+
+    if (out == NULL){
+      result = -1;
+    }
+    else{
+      result = json ? profile_dump_json(out) : profile_dump_csv(out);
+      if (fclose(out) != 0){
+        result = -1;
+      }
+    }
+  }
+  pthread_mutex_unlock(&control_lock);
+
+  return result;
+}
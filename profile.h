@@ -0,0 +1,54 @@
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+/* The profile counts every block of every mdadm read and write, cache hits
+ * included, by the disk and block it lives on. Run lengths are the number of
+ * blocks of a sequential stream, calls that each start in or right after the
+ * last block of the call before them, in buckets of powers of two: bucket i
+ * holds the runs of 2^i to 2^(i+1) - 1 blocks, the last bucket all longer ones.
+ * The reuse distance of a block is the number of block accesses since it was
+ * last accessed, bucketed the same way with 0 in the first bucket. It bounds
+ * the number of distinct blocks in between, so an LRU cache of more entries
+ * than that would have kept the block. */
+#define PROFILE_RUN_BUCKETS 16
+#define PROFILE_REUSE_BUCKETS 24
+
+/* Returns 1 on success and -1 on failure. Clears the profile and starts
+ * counting. If |unmount_path| is not NULL, every mdadm_unmount writes the
+ * profile to that file, as JSON if its name ends in ".json" and as CSV
+ * otherwise. Fails if the profiler is already running. */
+int profile_start(const char *unmount_path);
+
+/* Returns 1 on success and -1 on failure. Stops counting, the profile stays
+ * available to the dump functions until the next profile_start. */
+int profile_stop(void);
+
+/* Returns true while the profiler is counting. */
+bool profile_enabled(void);
+
+/* Counts one call of |num_blocks| blocks starting at block |first_block| of
+ * the array towards the run lengths. */
+void profile_call(uint32_t first_block, uint32_t num_blocks);
+
+/* Counts one access to block |block_num| of disk |disk_num|. */
+void profile_access(bool is_write, uint32_t disk_num, uint32_t block_num);
+
+/* Returns 1 on success and -1 on failure. Writes the heatmap as CSV, one
+ * "disk,block,reads,writes" row per block of every disk up to the highest one
+ * accessed. */
+int profile_dump_csv(FILE *out);
+
+/* Returns 1 on success and -1 on failure. Writes the heatmap, as one array of
+ * reads and one of writes per disk, the run length and reuse distance
+ * histograms and the number of distinct blocks accessed as a JSON object. */
+int profile_dump_json(FILE *out);
+
+/* Returns 1 on success and -1 on failure. Writes the profile to the file
+ * given to profile_start, does nothing if there is none. */
+int profile_dump_file(void);
+
+#endif
@@ -0,0 +1,281 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "mdadm.h"
+#include "net.h"
+#include "profile.h"
+#include "stats.h"
+#include "trace.h"
+
+/* replays a trace recorded with trace_start against jbod_server and reports
+ * throughput, latency percentiles and the cache hit rate. written blocks get
+ * contents derived from their address, so every replay of a trace leaves the
+ * device in the same state. */
+
+static uint8_t buf[JBOD_MAX_NODES * MDADM_ARRAY_SIZE];
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [-a] [-c cache_entries] [-p lru|clock|2q|arc] [-n connections] [-e ip:port]... [-s stripe_blocks] [-5] [-f disk] [-j] [-H profile_file] trace_file\n"
+          "  -a  replay as fast as possible instead of at the recorded speed\n"
+          "  -c  cache size in entries, 0 (the default) disables the cache\n"
+          "  -p  cache eviction policy, lru by default\n"
+          "  -n  number of connections to each server, 1 by default, more need server.c,\n"
+          "      the stock jbod_server serves a single one\n"
+          "  -e  federate this server with the ones of the other -e options, up to 4,\n"
+          "      instead of using the one at the default address\n"
+          "  -s  stripe the array over the disks (RAID0) in units of this many blocks,\n"
+          "      the linear layout by default\n"
+          "  -5  lay the array out as RAID5 instead, in stripe units of -s blocks (16 by default)\n"
+          "  -f  replay with this disk of the RAID5 array failed\n"
+          "  -j  also print the statistics as JSON\n"
+          "  -H  profile the blocks the replay accesses into this file, as JSON if it\n"
+          "      ends in .json and as a CSV heatmap otherwise\n", prog);
+}
+
+static int parse_policy(const char *name, cache_policy_t *policy) {
+  const char *names[] = { "lru", "clock", "2q", "arc" };
+  const cache_policy_t policies[] = { CACHE_POLICY_LRU, CACHE_POLICY_CLOCK, CACHE_POLICY_2Q, CACHE_POLICY_ARC };
+
+  for (int i = 0; i < 4; i++){
+    if (strcasecmp(name, names[i]) == 0){
+      *policy = policies[i];
+      return 1;
+    }
+  }
+  return -1;
+}
+
+//split |arg| of the form ip:port into |node|, which keeps pointing into |arg|
+static int parse_node(char *arg, jbod_node_t *node) {
+  char *colon = strrchr(arg, ':');
+
+  if (colon == NULL || atoi(colon + 1) <= 0 || atoi(colon + 1) > 65535){
+    return -1;
+  }
+  *colon = '\0';
+  node->ip = arg;
+  node->port = (uint16_t) atoi(colon + 1);
+  return 1;
+}
+
+static void sleep_until(uint64_t deadline_ns) {
+  uint64_t now = stats_now();
+
+  if (deadline_ns > now){
+    struct timespec pause = { (time_t) ((deadline_ns - now) / 1000000000ull), (long) ((deadline_ns - now) % 1000000000ull) };
+    nanosleep(&pause, NULL);
+  }
+}
+
+//the contents a replayed write puts at [addr, addr + len)
+static void fill_pattern(uint32_t addr, uint32_t len) {
+  for (uint32_t i = 0; i < len; i++){
+    uint32_t byte_addr = addr + i;
+    buf[i] = (uint8_t) (byte_addr ^ (byte_addr >> 8) ^ (byte_addr >> 16));
+  }
+}
+
+static void print_latency(const char *name, const stats_latency_t *latency) {
+  printf("%-6s %8llu calls  p50 %8.1f us  p99 %8.1f us  p999 %8.1f us  max %8.1f us\n", name,
+         (unsigned long long) latency->count, latency->p50_ns / 1000.0, latency->p99_ns / 1000.0,
+         latency->p999_ns / 1000.0, latency->max_ns / 1000.0);
+}
+
+int main(int argc, char *argv[]) {
+  bool as_fast_as_possible = false;
+  bool json = false;
+  const char *profile_path = NULL;
+  int cache_entries = 0;
+  int connections = 1;
+  jbod_node_t nodes[JBOD_MAX_NODES];
+  int num_nodes = 0;
+  int stripe_blocks = 0;
+  bool raid5 = false;
+  int failed_disk = -1;
+  cache_policy_t policy = CACHE_POLICY_LRU;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "ac:p:n:e:s:5f:jH:")) != -1){
+    switch (opt){
+      case 'a':
+        as_fast_as_possible = true;
+        break;
+      case 'c':
+        cache_entries = atoi(optarg);
+        break;
+      case 'p':
+        if (parse_policy(optarg, &policy) != 1){
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'n':
+        connections = atoi(optarg);
+        break;
+      case 'e':
+        if (num_nodes == JBOD_MAX_NODES || parse_node(optarg, &nodes[num_nodes]) != 1){
+          usage(argv[0]);
+          return 1;
+        }
+        num_nodes ++;
+        break;
+      case 's':
+        stripe_blocks = atoi(optarg);
+        if (stripe_blocks <= 0){
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case '5':
+        raid5 = true;
+        break;
+      case 'f':
+        failed_disk = atoi(optarg);
+        break;
+      case 'j':
+        json = true;
+        break;
+      case 'H':
+        profile_path = optarg;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (optind != argc - 1){
+    usage(argv[0]);
+    return 1;
+  }
+
+  FILE *in = trace_open(argv[optind]);
+  if (in == NULL){
+    fprintf(stderr, "error, %s is not a readable trace\n", argv[optind]);
+    return 1;
+  }
+
+  if (num_nodes == 0){
+    nodes[0] = (jbod_node_t) { .ip = JBOD_SERVER, .port = JBOD_PORT };
+    num_nodes = 1;
+  }
+  if (!jbod_connect_nodes(nodes, num_nodes, connections)){
+    fprintf(stderr, "error, failed to connect to %s:%d\n", nodes[0].ip, nodes[0].port);
+    return 1;
+  }
+
+  if (cache_entries > 0 && cache_create_with_policy(cache_entries, policy) != 1){
+    fprintf(stderr, "error, failed to create a cache of %d entries\n", cache_entries);
+    return 1;
+  }
+
+  int mounted;
+  if (raid5){
+    mounted = mdadm_mount_layout(MDADM_LAYOUT_RAID5, stripe_blocks > 0 ? stripe_blocks : 16);
+  }
+  else{
+    mounted = stripe_blocks > 0 ? mdadm_mount_layout(MDADM_LAYOUT_RAID0, stripe_blocks) : mdadm_mount();
+  }
+  if (mounted != 1){
+    fprintf(stderr, "error, failed to mount\n");
+    return 1;
+  }
+
+  if (failed_disk != -1 && mdadm_fail_disk(failed_disk) != 1){
+    fprintf(stderr, "error, failed to fail disk %d\n", failed_disk);
+    return 1;
+  }
+
+  //only the replay itself is measured
+  stats_reset();
+  if (profile_path != NULL && profile_start(profile_path) != 1){
+    fprintf(stderr, "error, failed to start the profile\n");
+    return 1;
+  }
+
+  trace_record_t record;
+  uint64_t num_ops = 0;
+  uint64_t num_failed = 0;
+  uint64_t num_bytes = 0;
+  uint64_t start = stats_now();
+  int status;
+
+  while ((status = trace_next(in, &record)) == 1){
+    int result;
+
+    if (!as_fast_as_possible){
+      sleep_until(start + record.timestamp_ns);
+    }
+
+    //the _large calls take any length, a len the original call rejected is rejected here too
+    if (record.op == TRACE_WRITE){
+      if (record.len <= sizeof(buf)){
+        fill_pattern(record.addr, record.len);
+      }
+      result = record.len <= 1024 ? mdadm_write(record.addr, record.len, buf) : mdadm_write_large(record.addr, record.len, buf);
+    }
+    else{
+      result = record.len <= 1024 ? mdadm_read(record.addr, record.len, buf) : mdadm_read_large(record.addr, record.len, buf);
+    }
+
+    num_ops ++;
+    if (result == -1){
+      num_failed ++;
+    }
+    else{
+      num_bytes += result;
+    }
+  }
+
+  double elapsed = (stats_now() - start) / 1e9;
+  fclose(in);
+
+  if (status == -1){
+    fprintf(stderr, "warning, the trace ends with a truncated record\n");
+  }
+
+  stats_snapshot_t snapshot;
+  stats_snapshot(&snapshot);
+
+  printf("replayed %llu calls (%llu failed) in %.3f s: %.0f calls/s, %.2f MiB/s\n",
+         (unsigned long long) num_ops, (unsigned long long) num_failed, elapsed,
+         elapsed > 0 ? num_ops / elapsed : 0.0, elapsed > 0 ? num_bytes / elapsed / (1024 * 1024) : 0.0);
+  print_latency("read", &snapshot.latency[STATS_MDADM_READ]);
+  print_latency("write", &snapshot.latency[STATS_MDADM_WRITE]);
+  printf("round trips %llu, seeks issued %llu, seeks avoided %llu\n",
+         (unsigned long long) snapshot.counters[STATS_ROUND_TRIPS],
+         (unsigned long long) snapshot.counters[STATS_SEEKS_ISSUED],
+         (unsigned long long) snapshot.counters[STATS_SEEKS_AVOIDED]);
+  if (raid5){
+    printf("parity groups full %llu, read-modify-write %llu, reconstructed %llu, blocks rebuilt %llu\n",
+           (unsigned long long) snapshot.counters[STATS_PARITY_FULL_STRIPES],
+           (unsigned long long) snapshot.counters[STATS_PARITY_RMW],
+           (unsigned long long) snapshot.counters[STATS_PARITY_RECONSTRUCTS],
+           (unsigned long long) snapshot.counters[STATS_BLOCKS_REBUILT]);
+  }
+
+  if (cache_enabled()){
+    fflush(stdout);
+    cache_print_hit_rate();
+  }
+
+  if (json){
+    fflush(stdout);
+    stats_dump_json(stdout);
+  }
+
+  mdadm_unmount();
+  if (cache_enabled()){
+    cache_destroy();
+  }
+  jbod_disconnect();
+
+  return 0;
+}
@@ -0,0 +1,730 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <openssl/sha.h>
+
+#include "block.h"
+#include "jbod.h"
+#include "net.h"
+
+/*
+a stand-in for jbod_server that speaks the same protocol as net.c: every
+packet is an 8-byte header (length, opcode, return code) optionally followed by
+a 256-byte block, or by up to JBOD_RANGE_MAX_BLOCKS of them for the range
+commands (see net.h), which may leave out the all-zero ones. one epoll loop serves any number of clients. the disks and
+the mount state are shared by all clients, the disk and block pointers belong
+to each connection, so every client seeks on its own.
+
+the latency model charges every command a service time on the disk it
+addresses: JBOD_SEEK_TO_DISK costs -D, JBOD_SEEK_TO_BLOCK costs -S plus -P per
+block of distance from the connection's block pointer, and every block read,
+written or signed costs -T. a range command costs the seeks it replaces plus
+-T per block. a disk serves one command at a time, so commands
+for the same disk queue behind each other, whatever connection they come from,
+and a connection's responses stay in order. a response is held back until its
+command's service time has passed. with the defaults, all 0, every response
+goes out right away.
+*/
+
+#define SERVER_BACKLOG 128
+#define PACKET_LEN (HEADER_LEN + JBOD_BLOCK_SIZE)
+#define MAX_PACKET_LEN (HEADER_LEN + sizeof(uint64_t) + JBOD_RANGE_MAX_BLOCKS * JBOD_BLOCK_SIZE)
+
+/* the commands counted in the summary, the last slot counts unknown ones */
+#define NUM_COMMANDS (JBOD_WRITE_RANGE + 1)
+
+/* a client whose responses pile up is not read until it catches up */
+#define MAX_QUEUED_RESPONSES 4096
+
+/* a range of the output buffer that may only be sent once |due| has passed */
+typedef struct {
+  size_t end;
+  uint64_t due;
+} response_mark_t;
+
+typedef struct client {
+  int fd;
+  struct client *prev;
+  struct client *next;
+
+  /* the connection's seek state */
+  int disk;
+  int block;
+
+  uint8_t in[2 * MAX_PACKET_LEN];
+  size_t in_len;
+  bool reading;
+
+  /* encoded responses, out_sent..out_len is not sent yet and out_due..out_len
+  is not due yet */
+  uint8_t *out;
+  size_t out_sent;
+  size_t out_due;
+  size_t out_len;
+  size_t out_cap;
+  bool want_write;
+
+  /* when each queued response is due, marks_first..marks_len are pending */
+  response_mark_t *marks;
+  size_t marks_first;
+  size_t marks_len;
+  size_t marks_cap;
+  uint64_t last_due;
+} client_t;
+
+typedef struct {
+  uint64_t seek_disk_ns;
+  uint64_t seek_block_ns;
+  uint64_t seek_distance_ns;
+  uint64_t transfer_ns;
+} latency_model_t;
+
+static uint8_t disks[JBOD_NUM_DISKS][JBOD_NUM_BLOCKS_PER_DISK][JBOD_BLOCK_SIZE];
+static bool mounted = false;
+static uint64_t disk_free_at[JBOD_NUM_DISKS];
+static latency_model_t model;
+
+static client_t *clients = NULL;
+static int epoll_fd = -1;
+static int timer_fd = -1;
+static uint64_t timer_due = 0;
+
+static uint64_t num_commands[NUM_COMMANDS + 1];
+static uint64_t num_failed = 0;
+static uint64_t num_zeros_elided = 0;
+static uint64_t num_clients = 0;
+
+static volatile sig_atomic_t stop = 0;
+
+static uint64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000ull + (uint64_t) now.tv_nsec;
+}
+
+static void on_signal(int signo) {
+  (void) signo;
+  stop = 1;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [-p port] [-D usec] [-S usec] [-P nsec] [-T usec]\n"
+          "  -p  port to listen on, %d by default\n"
+          "  -D  service time of JBOD_SEEK_TO_DISK\n"
+          "  -S  service time of JBOD_SEEK_TO_BLOCK\n"
+          "  -P  additional seek time per block of seek distance\n"
+          "  -T  service time of reading, writing or signing one block\n"
+          "every time is 0 by default\n", prog, JBOD_PORT);
+}
+
+//the SHA1 of a block in the text format jbod_server answers JBOD_SIGN_BLOCK with
+static void sign_block(int disk, int block, uint8_t *out) {
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  char *text = (char *) out;
+  int used;
+
+  SHA1(disks[disk][block], JBOD_BLOCK_SIZE, digest);
+
+  memset(out, 0, JBOD_BLOCK_SIZE);
+  used = snprintf(text, JBOD_BLOCK_SIZE, "SIG(disk,block) %2d %3d : ", disk, block);
+  for (int i = 0; i < SHA_DIGEST_LENGTH; i++){
+    used += snprintf(text + used, JBOD_BLOCK_SIZE - used, "0x%02x ", digest[i]);
+  }
+  snprintf(text + used, JBOD_BLOCK_SIZE - used, "\n");
+}
+
+/* the blocks of a range with JBOD_RANGE_ZERO_ELIDE travel as a mask of the
+ * all-zero ones followed by the others */
+
+//packs |count| blocks into |out| and returns the length
+static size_t pack_range(const uint8_t *blocks, int count, uint8_t *out) {
+  uint64_t zeros = 0;
+  size_t len = sizeof(uint64_t);
+
+  for (int i = 0; i < count; i++){
+    if (block_is_zero(blocks + i * JBOD_BLOCK_SIZE)){
+      zeros |= (uint64_t) 1 << i;
+      num_zeros_elided ++;
+    }
+    else{
+      memcpy(out + len, blocks + i * JBOD_BLOCK_SIZE, JBOD_BLOCK_SIZE);
+      len += JBOD_BLOCK_SIZE;
+    }
+  }
+
+  uint64_t net_zeros = htobe64(zeros);
+  memcpy(out, &net_zeros, sizeof(uint64_t));
+  return len;
+}
+
+//unpacks the |count| blocks of a write range, returns false if the payload does not hold them
+static bool unpack_range(const uint8_t *payload, size_t payload_len, int count, bool elide, uint8_t *blocks) {
+  if (!elide){
+    if (payload_len != (size_t) count * JBOD_BLOCK_SIZE){
+      return false;
+    }
+    memcpy(blocks, payload, payload_len);
+    return true;
+  }
+
+  uint64_t zeros;
+  if (payload_len < sizeof(uint64_t)){
+    return false;
+  }
+  memcpy(&zeros, payload, sizeof(uint64_t));
+  zeros = be64toh(zeros);
+
+  int num_zeros = __builtin_popcountll(zeros);
+  if ((count < 64 && (zeros >> count) != 0) || payload_len != sizeof(uint64_t) + (size_t) (count - num_zeros) * JBOD_BLOCK_SIZE){
+    return false;
+  }
+
+  payload += sizeof(uint64_t);
+  for (int i = 0; i < count; i++){
+    if (zeros & ((uint64_t) 1 << i)){
+      memset(blocks + i * JBOD_BLOCK_SIZE, 0, JBOD_BLOCK_SIZE);
+    }
+    else{
+      memcpy(blocks + i * JBOD_BLOCK_SIZE, payload, JBOD_BLOCK_SIZE);
+      payload += JBOD_BLOCK_SIZE;
+    }
+  }
+  num_zeros_elided += num_zeros;
+  return true;
+}
+
+/* carries out one command for |client| with the |payload_len| bytes that
+ * followed its header. returns the jbod return code and sets the disk the
+ * command occupies and for how long, -1 if it needs no disk. */
+static int execute(client_t *client, uint32_t op, const uint8_t *payload, size_t payload_len, uint8_t *block, int *disk, uint64_t *service_ns) {
+  int cmd = (op >> 14) & 0x3f;
+  int op_block = (op >> 20) & 0xff;
+  int op_disk = (op >> 28) & 0xf;
+  int count = op & JBOD_RANGE_COUNT_MASK;
+
+  *disk = -1;
+  *service_ns = 0;
+
+  //an empty range is how clients find out that ranges are supported, so it succeeds whatever the mount state
+  if ((cmd == JBOD_READ_RANGE || cmd == JBOD_WRITE_RANGE) && count == 0){
+    return 0;
+  }
+
+  if (cmd != JBOD_MOUNT && !mounted){
+    return -1;
+  }
+
+  switch (cmd){
+    case JBOD_MOUNT:
+      if (mounted){
+        return -1;
+      }
+      //a fresh mount starts with empty disks, like jbod_server
+      memset(disks, 0, sizeof(disks));
+      mounted = true;
+      return 0;
+
+    case JBOD_UNMOUNT:
+      mounted = false;
+      return 0;
+
+    case JBOD_SEEK_TO_DISK:
+      client->disk = op_disk;
+      client->block = 0;
+      *disk = op_disk;
+      *service_ns = model.seek_disk_ns;
+      return 0;
+
+    case JBOD_SEEK_TO_BLOCK:
+      *disk = client->disk;
+      *service_ns = model.seek_block_ns + model.seek_distance_ns * (uint64_t) abs(op_block - client->block);
+      client->block = op_block;
+      return 0;
+
+    case JBOD_READ_BLOCK:
+      if (client->block >= JBOD_NUM_BLOCKS_PER_DISK){
+        return -1;
+      }
+      memcpy(block, disks[client->disk][client->block], JBOD_BLOCK_SIZE);
+      *disk = client->disk;
+      *service_ns = model.transfer_ns;
+      client->block ++;
+      return 0;
+
+    case JBOD_WRITE_BLOCK:
+      if (client->block >= JBOD_NUM_BLOCKS_PER_DISK || payload_len != JBOD_BLOCK_SIZE){
+        return -1;
+      }
+      memcpy(disks[client->disk][client->block], payload, JBOD_BLOCK_SIZE);
+      *disk = client->disk;
+      *service_ns = model.transfer_ns;
+      client->block ++;
+      return 0;
+
+    case JBOD_SIGN_BLOCK:
+      sign_block(op_disk, op_block, block);
+      *disk = op_disk;
+      *service_ns = model.transfer_ns;
+      return 0;
+
+    case JBOD_READ_RANGE:
+    case JBOD_WRITE_RANGE:
+      if (count > JBOD_RANGE_MAX_BLOCKS || op_block + count > JBOD_NUM_BLOCKS_PER_DISK){
+        return -1;
+      }
+      if (cmd == JBOD_WRITE_RANGE && !unpack_range(payload, payload_len, count, (op & JBOD_RANGE_ZERO_ELIDE) != 0, block)){
+        return -1;
+      }
+
+      //the range positions the connection itself, at the cost of the seeks it saves the client
+      if (client->disk != op_disk){
+        *service_ns += model.seek_disk_ns;
+        client->disk = op_disk;
+        client->block = 0;
+      }
+      if (client->block != op_block){
+        *service_ns += model.seek_block_ns + model.seek_distance_ns * (uint64_t) abs(op_block - client->block);
+      }
+
+      for (int i = 0; i < count; i++){
+        if (cmd == JBOD_READ_RANGE){
+          memcpy(block + i * JBOD_BLOCK_SIZE, disks[op_disk][op_block + i], JBOD_BLOCK_SIZE);
+        }
+        else{
+          memcpy(disks[op_disk][op_block + i], block + i * JBOD_BLOCK_SIZE, JBOD_BLOCK_SIZE);
+        }
+      }
+      *disk = op_disk;
+      *service_ns += model.transfer_ns * count;
+      client->block = op_block + count;
+      return 0;
+
+    default:
+      return -1;
+  }
+}
+
+//make room for |extra| more bytes of output and one more mark
+static bool reserve_output(client_t *client, size_t extra) {
+  //drop what was sent once it is at least half of the buffer, so compacting stays cheap
+  if (client->out_sent > 0 && client->out_sent * 2 >= client->out_len){
+    size_t shift = client->out_sent;
+    memmove(client->out, client->out + shift, client->out_len - shift);
+    for (size_t i = client->marks_first; i < client->marks_len; i++){
+      client->marks[i].end -= shift;
+    }
+    client->out_len -= shift;
+    client->out_due -= shift;
+    client->out_sent = 0;
+  }
+  if (client->marks_first > 0 && client->marks_first * 2 >= client->marks_len){
+    memmove(client->marks, client->marks + client->marks_first, (client->marks_len - client->marks_first) * sizeof(response_mark_t));
+    client->marks_len -= client->marks_first;
+    client->marks_first = 0;
+  }
+
+  if (client->out_len + extra > client->out_cap){
+    size_t cap = client->out_cap == 0 ? 4096 : client->out_cap;
+    while (cap < client->out_len + extra){
+      cap *= 2;
+    }
+    uint8_t *out = realloc(client->out, cap);
+    if (out == NULL){
+      return false;
+    }
+    client->out = out;
+    client->out_cap = cap;
+  }
+
+  if (client->marks_len == client->marks_cap){
+    size_t cap = client->marks_cap == 0 ? 64 : client->marks_cap * 2;
+    response_mark_t *marks = realloc(client->marks, cap * sizeof(response_mark_t));
+    if (marks == NULL){
+      return false;
+    }
+    client->marks = marks;
+    client->marks_cap = cap;
+  }
+
+  return true;
+}
+
+//handles one complete request packet, returns false if the client must be dropped
+static bool handle_packet(client_t *client, const uint8_t *packet, size_t len) {
+  uint32_t op;
+  uint8_t block[JBOD_RANGE_MAX_BLOCKS * JBOD_BLOCK_SIZE];
+  uint8_t packed[sizeof(uint64_t) + JBOD_RANGE_MAX_BLOCKS * JBOD_BLOCK_SIZE];
+  int disk;
+  uint64_t service_ns;
+
+  memcpy(&op, &packet[2], sizeof(uint32_t));
+  op = ntohl(op);
+
+  int cmd = (op >> 14) & 0x3f;
+  int ret = execute(client, op, packet + HEADER_LEN, len - HEADER_LEN, block, &disk, &service_ns);
+  num_commands[cmd < NUM_COMMANDS ? cmd : NUM_COMMANDS] ++;
+  if (ret == -1){
+    num_failed ++;
+  }
+
+  //a command starts once its disk is free and the connection's previous response is out
+  uint64_t due = now_ns();
+  if (client->last_due > due){
+    due = client->last_due;
+  }
+  if (disk != -1){
+    if (disk_free_at[disk] > due){
+      due = disk_free_at[disk];
+    }
+    due += service_ns;
+    disk_free_at[disk] = due;
+  }
+  client->last_due = due;
+
+  //reads and signatures always carry a block, like jbod_server's, a range read only carries its blocks when it succeeded
+  const uint8_t *payload = block;
+  size_t payload_len = (cmd == JBOD_READ_BLOCK || cmd == JBOD_SIGN_BLOCK) ? JBOD_BLOCK_SIZE : 0;
+  if (ret == -1 && payload_len > 0){
+    memset(block, 0, JBOD_BLOCK_SIZE);
+  }
+  if (cmd == JBOD_READ_RANGE && ret == 0 && (op & JBOD_RANGE_COUNT_MASK) > 0){
+    if (op & JBOD_RANGE_ZERO_ELIDE){
+      payload = packed;
+      payload_len = pack_range(block, op & JBOD_RANGE_COUNT_MASK, packed);
+    }
+    else{
+      payload_len = (op & JBOD_RANGE_COUNT_MASK) * JBOD_BLOCK_SIZE;
+    }
+  }
+  uint16_t out_len = HEADER_LEN + payload_len;
+  if (!reserve_output(client, out_len)){
+    return false;
+  }
+
+  uint16_t net_len = htons(out_len);
+  uint32_t net_op = htonl(op);
+  uint16_t net_ret = htons((uint16_t) ret);
+  uint8_t *out = client->out + client->out_len;
+
+  memcpy(&out[0], &net_len, sizeof(uint16_t));
+  memcpy(&out[2], &net_op, sizeof(uint32_t));
+  memcpy(&out[6], &net_ret, sizeof(uint16_t));
+  memcpy(&out[HEADER_LEN], payload, payload_len);
+  client->out_len += out_len;
+
+  client->marks[client->marks_len].end = client->out_len;
+  client->marks[client->marks_len].due = due;
+  client->marks_len ++;
+  return true;
+}
+
+static void watch(client_t *client, bool reading, bool want_write) {
+  if (client->reading == reading && client->want_write == want_write){
+    return;
+  }
+
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = (reading ? EPOLLIN : 0) | (want_write ? EPOLLOUT : 0);
+  event.data.ptr = client;
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &event);
+  client->reading = reading;
+  client->want_write = want_write;
+}
+
+static void drop_client(client_t *client) {
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+  close(client->fd);
+
+  if (client->prev != NULL){
+    client->prev->next = client->next;
+  }
+  else{
+    clients = client->next;
+  }
+  if (client->next != NULL){
+    client->next->prev = client->prev;
+  }
+
+  free(client->out);
+  free(client->marks);
+  free(client);
+}
+
+/* sends the responses that are due, returns false if the client must be
+ * dropped. sets *next_due to when the next held back response is due, or
+ * leaves it alone if there is none. */
+static bool send_due(client_t *client, uint64_t now, uint64_t *next_due) {
+  while (client->marks_first < client->marks_len && client->marks[client->marks_first].due <= now){
+    client->out_due = client->marks[client->marks_first].end;
+    client->marks_first ++;
+  }
+
+  while (client->out_sent < client->out_due){
+    ssize_t sent = send(client->fd, client->out + client->out_sent, client->out_due - client->out_sent, MSG_NOSIGNAL);
+    if (sent < 0){
+      if (errno == EINTR){
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK){
+        break;
+      }
+      return false;
+    }
+    client->out_sent += sent;
+  }
+
+  if (client->marks_first < client->marks_len && client->marks[client->marks_first].due < *next_due){
+    *next_due = client->marks[client->marks_first].due;
+  }
+
+  size_t queued = client->marks_len - client->marks_first;
+  watch(client, queued < MAX_QUEUED_RESPONSES, client->out_sent < client->out_due);
+  return true;
+}
+
+//reads and handles whatever the client sent, returns false if it must be dropped
+static bool receive(client_t *client) {
+  while (client->marks_len - client->marks_first < MAX_QUEUED_RESPONSES){
+    ssize_t got = read(client->fd, client->in + client->in_len, sizeof(client->in) - client->in_len);
+    if (got < 0){
+      if (errno == EINTR){
+        continue;
+      }
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    if (got == 0){
+      return false;
+    }
+    client->in_len += got;
+
+    size_t used = 0;
+    while (client->in_len - used >= HEADER_LEN){
+      uint16_t len;
+      memcpy(&len, client->in + used, sizeof(uint16_t));
+      len = ntohs(len);
+
+      //anything but a header followed by whole blocks, at most a range of them behind a zero mask, is not our protocol
+      if (len < HEADER_LEN || len > MAX_PACKET_LEN || ((len - HEADER_LEN) % JBOD_BLOCK_SIZE != 0 && (len - HEADER_LEN) % JBOD_BLOCK_SIZE != sizeof(uint64_t))){
+        return false;
+      }
+      if (client->in_len - used < len){
+        break;
+      }
+      if (!handle_packet(client, client->in + used, len)){
+        return false;
+      }
+      used += len;
+    }
+
+    memmove(client->in, client->in + used, client->in_len - used);
+    client->in_len -= used;
+  }
+
+  return true;
+}
+
+static void accept_clients(int listen_fd) {
+  while (true){
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd == -1){
+      return;
+    }
+
+    client_t *client = calloc(1, sizeof(client_t));
+    if (client == NULL || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1){
+      free(client);
+      close(fd);
+      continue;
+    }
+
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    client->fd = fd;
+    client->reading = true;
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = client;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1){
+      free(client);
+      close(fd);
+      continue;
+    }
+
+    client->next = clients;
+    if (clients != NULL){
+      clients->prev = client;
+    }
+    clients = client;
+    num_clients ++;
+  }
+}
+
+//wake the loop up when the earliest held back response is due
+static void arm_timer(uint64_t next_due) {
+  if (next_due == timer_due){
+    return;
+  }
+  timer_due = next_due;
+
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  if (next_due != UINT64_MAX){
+    spec.it_value.tv_sec = next_due / 1000000000ull;
+    spec.it_value.tv_nsec = next_due % 1000000000ull;
+  }
+  timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+static void print_summary(void) {
+  const char *names[NUM_COMMANDS + 1] = { "mount", "unmount", "seek_to_disk", "seek_to_block", "read_block", "write_block", "sign_block",
+                                          "read_range", "write_range", "invalid" };
+
+  printf("served %llu clients, %llu commands failed\n", (unsigned long long) num_clients, (unsigned long long) num_failed);
+  for (int cmd = 0; cmd <= NUM_COMMANDS; cmd++){
+    printf("%-14s %llu\n", names[cmd], (unsigned long long) num_commands[cmd]);
+  }
+  printf("zero blocks elided %llu\n", (unsigned long long) num_zeros_elided);
+}
+
+int main(int argc, char *argv[]) {
+  int port = JBOD_PORT;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "p:D:S:P:T:")) != -1){
+    switch (opt){
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 'D':
+        model.seek_disk_ns = strtoull(optarg, NULL, 10) * 1000;
+        break;
+      case 'S':
+        model.seek_block_ns = strtoull(optarg, NULL, 10) * 1000;
+        break;
+      case 'P':
+        model.seek_distance_ns = strtoull(optarg, NULL, 10);
+        break;
+      case 'T':
+        model.transfer_ns = strtoull(optarg, NULL, 10) * 1000;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  struct sockaddr_in s_addr;
+  memset(&s_addr, 0, sizeof(s_addr));
+  s_addr.sin_family = AF_INET;
+  s_addr.sin_port = htons(port);
+  inet_aton(JBOD_SERVER, &s_addr.sin_addr);
+
+  int listen_fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  int reuse = 1;
+  if (listen_fd == -1 || setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1 ||
+      bind(listen_fd, (const struct sockaddr *) &s_addr, sizeof(s_addr)) == -1 || listen(listen_fd, SERVER_BACKLOG) == -1){
+    fprintf(stderr, "error, failed to listen on %s:%d\n", JBOD_SERVER, port);
+    return 1;
+  }
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (epoll_fd == -1 || timer_fd == -1){
+    fprintf(stderr, "error, failed to set up the event loop\n");
+    return 1;
+  }
+
+  //the listener and the timer are told apart from the clients by these two addresses
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.ptr = &listen_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+  event.data.ptr = &timer_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &event);
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = on_signal;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  printf("jbod server listening on %s:%d\n", JBOD_SERVER, port);
+  fflush(stdout);
+
+  while (!stop){
+    struct epoll_event events[64];
+    int count = epoll_wait(epoll_fd, events, 64, -1);
+    if (count < 0){
+      if (errno == EINTR){
+        continue;
+      }
+      break;
+    }
+
+    for (int i = 0; i < count; i++){
+      if (events[i].data.ptr == &listen_fd){
+        accept_clients(listen_fd);
+      }
+      else if (events[i].data.ptr == &timer_fd){
+        uint64_t expirations;
+        if (read(timer_fd, &expirations, sizeof(expirations)) == -1){
+          continue;
+        }
+        timer_due = 0;
+      }
+      else if (events[i].data.ptr != NULL){
+        client_t *client = (client_t *) events[i].data.ptr;
+        if ((events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && !receive(client)){
+          drop_client(client);
+          //a dropped client may have more events in this round
+          for (int j = i + 1; j < count; j++){
+            if (events[j].data.ptr == client){
+              events[j].data.ptr = NULL;
+            }
+          }
+        }
+      }
+    }
+
+    //send what is due everywhere and sleep until the next held back response
+    uint64_t now = now_ns();
+    uint64_t next_due = UINT64_MAX;
+    for (client_t *client = clients; client != NULL;){
+      client_t *next = client->next;
+      if (!send_due(client, now, &next_due)){
+        drop_client(client);
+      }
+      client = next;
+    }
+    arm_timer(next_due);
+  }
+
+  print_summary();
+
+  while (clients != NULL){
+    drop_client(clients);
+  }
+  close(timer_fd);
+  close(epoll_fd);
+  close(listen_fd);
+  return 0;
+}
@@ -0,0 +1,193 @@
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+#include "stats.h"
+
+/* latencies are binned in a log-linear histogram: values below
+ * STATS_SUB_BUCKETS get a bucket each, above that every power of two is split
+ * into STATS_SUB_BUCKETS buckets of equal width. recording is one relaxed
+ * atomic add per bucket and counter, with no locks, so the hot paths can
+ * record every command. */
+#define STATS_SUB_BITS 4
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_NUM_BUCKETS (STATS_SUB_BUCKETS + (64 - STATS_SUB_BITS) * STATS_SUB_BUCKETS)
+
+typedef struct {
+  atomic_uint_fast64_t buckets[STATS_NUM_BUCKETS];
+  atomic_uint_fast64_t sum_ns;
+  atomic_uint_fast64_t min_ns;
+  atomic_uint_fast64_t max_ns;
+} stats_histogram_data_t;
+
+static stats_histogram_data_t histograms[STATS_NUM_HISTOGRAMS];
+static atomic_uint_fast64_t counters[STATS_NUM_COUNTERS];
+
+static const char *histogram_names[STATS_NUM_HISTOGRAMS] = {
+  "mount", "unmount", "seek_to_disk", "seek_to_block", "read_block", "write_block", "sign_block",
+  "read_range", "write_range", "mdadm_read", "mdadm_write",
+};
+
+static const char *counter_names[STATS_NUM_COUNTERS] = {
+  "round_trips", "bytes_sent", "bytes_received",
+  "cache_hits", "cache_misses", "cache_inserts", "cache_evictions",
+  "seeks_issued", "seeks_avoided", "blocks_coalesced",
+  "zero_blocks_elided", "zero_blocks_cached", "checksum_errors", "signature_mismatches",
+  "parity_full_stripes", "parity_rmw", "parity_reconstructs", "blocks_rebuilt",
+  "vector_calls", "extents_merged", "reads_coalesced", "blocks_written",
+};
+
+
+static int bucket_of(uint64_t ns) {
+  if (ns < STATS_SUB_BUCKETS){
+    return (int) ns;
+  }
+
+  int exponent = 63 - __builtin_clzll(ns);
+  int sub = (int) (ns >> (exponent - STATS_SUB_BITS)) & (STATS_SUB_BUCKETS - 1);
+  return STATS_SUB_BUCKETS + (exponent - STATS_SUB_BITS) * STATS_SUB_BUCKETS + sub;
+}
+
+//the middle of the range of values that land in |bucket|
+static uint64_t bucket_value(int bucket) {
+  if (bucket < STATS_SUB_BUCKETS){
+    return bucket;
+  }
+
+  int exponent = (bucket - STATS_SUB_BUCKETS) / STATS_SUB_BUCKETS + STATS_SUB_BITS;
+  uint64_t sub = (bucket - STATS_SUB_BUCKETS) % STATS_SUB_BUCKETS;
+  uint64_t width = 1ull << (exponent - STATS_SUB_BITS);
+  return (1ull << exponent) + sub * width + width / 2;
+}
+
+uint64_t stats_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000ull + (uint64_t) now.tv_nsec;
+}
+
+void stats_record(int histogram, uint64_t ns) {
+  if (histogram < 0 || histogram >= STATS_NUM_HISTOGRAMS){
+    return;
+  }
+
+  stats_histogram_data_t *data = &histograms[histogram];
+  atomic_fetch_add_explicit(&data->buckets[bucket_of(ns)], 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&data->sum_ns, ns, memory_order_relaxed);
+
+  //0 means no record yet, so the first one always sets the minimum
+  uint_fast64_t min = atomic_load_explicit(&data->min_ns, memory_order_relaxed);
+  while ((min == 0 || ns < min) && !atomic_compare_exchange_weak_explicit(&data->min_ns, &min, ns, memory_order_relaxed, memory_order_relaxed)){
+  }
+  uint_fast64_t max = atomic_load_explicit(&data->max_ns, memory_order_relaxed);
+  while (ns > max && !atomic_compare_exchange_weak_explicit(&data->max_ns, &max, ns, memory_order_relaxed, memory_order_relaxed)){
+  }
+}
+
+void stats_count(stats_counter_t counter, uint64_t n) {
+  if (counter < STATS_NUM_COUNTERS){
+    atomic_fetch_add_explicit(&counters[counter], n, memory_order_relaxed);
+  }
+}
+
+static void snapshot_histogram(stats_histogram_data_t *data, stats_latency_t *latency) {
+  uint64_t buckets[STATS_NUM_BUCKETS];
+  uint64_t count = 0;
+
+  memset(latency, 0, sizeof(*latency));
+
+  //sum the buckets themselves, so the percentiles agree with what was copied
+  for (int bucket = 0; bucket < STATS_NUM_BUCKETS; bucket++){
+    buckets[bucket] = atomic_load_explicit(&data->buckets[bucket], memory_order_relaxed);
+    count += buckets[bucket];
+  }
+  if (count == 0){
+    return;
+  }
+
+  latency->count = count;
+  latency->min_ns = atomic_load_explicit(&data->min_ns, memory_order_relaxed);
+  latency->max_ns = atomic_load_explicit(&data->max_ns, memory_order_relaxed);
+  latency->mean_ns = atomic_load_explicit(&data->sum_ns, memory_order_relaxed) / count;
+
+  //the rank of each percentile, rounded up so p999 of a few samples is the largest one
+  uint64_t ranks[3] = { (count * 500 + 999) / 1000, (count * 990 + 999) / 1000, (count * 999 + 999) / 1000 };
+  uint64_t *values[3] = { &latency->p50_ns, &latency->p99_ns, &latency->p999_ns };
+  uint64_t seen = 0;
+  int next = 0;
+
+  for (int bucket = 0; bucket < STATS_NUM_BUCKETS && next < 3; bucket++){
+    seen += buckets[bucket];
+    while (next < 3 && seen >= ranks[next]){
+      *values[next] = bucket_value(bucket);
+      next ++;
+    }
+  }
+
+  //a bucket's middle can lie outside what was actually recorded
+  for (int i = 0; i < 3; i++){
+    if (*values[i] < latency->min_ns){
+      *values[i] = latency->min_ns;
+    }
+    if (*values[i] > latency->max_ns){
+      *values[i] = latency->max_ns;
+    }
+  }
+}
+
+void stats_snapshot(stats_snapshot_t *snapshot) {
+  if (snapshot == NULL){
+    return;
+  }
+
+  for (int histogram = 0; histogram < STATS_NUM_HISTOGRAMS; histogram++){
+    snapshot_histogram(&histograms[histogram], &snapshot->latency[histogram]);
+  }
+  for (int counter = 0; counter < STATS_NUM_COUNTERS; counter++){
+    snapshot->counters[counter] = atomic_load_explicit(&counters[counter], memory_order_relaxed);
+  }
+}
+
+int stats_dump_json(FILE *out) {
+  stats_snapshot_t snapshot;
+  int result = 0;
+
+  if (out == NULL){
+    return -1;
+  }
+
+  stats_snapshot(&snapshot);
+
+  result |= fprintf(out, "{\"latency_ns\": {");
+  for (int histogram = 0; histogram < STATS_NUM_HISTOGRAMS; histogram++){
+    stats_latency_t *latency = &snapshot.latency[histogram];
+    result |= fprintf(out, "%s\"%s\": {\"count\": %llu, \"min\": %llu, \"mean\": %llu, \"p50\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu}",
+                      histogram == 0 ? "" : ", ", histogram_names[histogram],
+                      (unsigned long long) latency->count, (unsigned long long) latency->min_ns, (unsigned long long) latency->mean_ns,
+                      (unsigned long long) latency->p50_ns, (unsigned long long) latency->p99_ns, (unsigned long long) latency->p999_ns,
+                      (unsigned long long) latency->max_ns);
+  }
+
+  result |= fprintf(out, "}, \"counters\": {");
+  for (int counter = 0; counter < STATS_NUM_COUNTERS; counter++){
+    result |= fprintf(out, "%s\"%s\": %llu", counter == 0 ? "" : ", ", counter_names[counter], (unsigned long long) snapshot.counters[counter]);
+  }
+  result |= fprintf(out, "}}\n");
+
+  //fprintf returns a negative number on failure, which keeps the sign bit set in |result|
+  return result < 0 ? -1 : 1;
+}
+
+void stats_reset(void) {
+  for (int histogram = 0; histogram < STATS_NUM_HISTOGRAMS; histogram++){
+    stats_histogram_data_t *data = &histograms[histogram];
+    for (int bucket = 0; bucket < STATS_NUM_BUCKETS; bucket++){
+      atomic_store_explicit(&data->buckets[bucket], 0, memory_order_relaxed);
+    }
+    atomic_store_explicit(&data->sum_ns, 0, memory_order_relaxed);
+    atomic_store_explicit(&data->min_ns, 0, memory_order_relaxed);
+    atomic_store_explicit(&data->max_ns, 0, memory_order_relaxed);
+  }
+  for (int counter = 0; counter < STATS_NUM_COUNTERS; counter++){
+    atomic_store_explicit(&counters[counter], 0, memory_order_relaxed);
+  }
+}
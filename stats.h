@@ -0,0 +1,86 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "jbod.h"
+
+/* The latency histograms. Histograms 0 to JBOD_NUM_CMDS - 1 time the jbod
+ * commands by their jbod_cmd_t, from the moment the request is sent until its
+ * response arrives, and the range ones do the same for JBOD_READ_RANGE and
+ * JBOD_WRITE_RANGE (see net.h). The mdadm ones time whole mdadm_read/mdadm_write
+ * calls, the _large and async variants included. */
+typedef enum {
+  STATS_READ_RANGE = JBOD_NUM_CMDS,
+  STATS_WRITE_RANGE,
+  STATS_MDADM_READ,
+  STATS_MDADM_WRITE,
+  STATS_NUM_HISTOGRAMS,
+} stats_histogram_t;
+
+typedef enum {
+  STATS_ROUND_TRIPS,     /* request windows sent and answered */
+  STATS_BYTES_SENT,      /* bytes written to the server sockets */
+  STATS_BYTES_RECEIVED,  /* bytes read from the server sockets */
+  STATS_CACHE_HITS,
+  STATS_CACHE_MISSES,
+  STATS_CACHE_INSERTS,
+  STATS_CACHE_EVICTIONS,
+  STATS_SEEKS_ISSUED,    /* JBOD_SEEK_TO_DISK and JBOD_SEEK_TO_BLOCK commands queued by mdadm */
+  STATS_SEEKS_AVOIDED,   /* seeks mdadm skipped because the device was already positioned */
+  STATS_BLOCKS_COALESCED, /* blocks mdadm added to an already queued range command instead of sending on their own */
+  STATS_ZERO_BLOCKS_ELIDED, /* all-zero blocks that crossed the socket as a bit instead of a payload */
+  STATS_ZERO_BLOCKS_CACHED, /* all-zero blocks the cache stored without touching their payload slot */
+  STATS_CHECKSUM_ERRORS, /* blocks whose CRC32C did not match, in the cache or read from the device */
+  STATS_SIGNATURE_MISMATCHES, /* blocks mdadm_verify found the device's JBOD_SIGN_BLOCK disagreeing with */
+  STATS_PARITY_FULL_STRIPES, /* RAID5 parity groups written whole, their parity computed without reading */
+  STATS_PARITY_RMW,      /* RAID5 parity groups updated from their old parity and the old contents of the blocks written */
+  STATS_PARITY_RECONSTRUCTS, /* RAID5 parity groups updated by reading the blocks that were not written */
+  STATS_BLOCKS_REBUILT,  /* blocks of a failed RAID5 disk rebuilt from the rest of their parity group */
+  STATS_VECTOR_CALLS,    /* mdadm_readv and mdadm_writev calls */
+  STATS_EXTENTS_MERGED,  /* extents of those calls that joined another one they touched or overlapped */
+  STATS_READS_COALESCED, /* blocks a read copied from another read fetching them instead of fetching them too */
+  STATS_BLOCKS_WRITTEN,  /* blocks sent to the servers by write commands */
+  STATS_NUM_COUNTERS,
+} stats_counter_t;
+
+/* Latencies are in nanoseconds. The percentiles come from a log-linear
+ * histogram and are within 1/16 of the exact value. */
+typedef struct {
+  uint64_t count;
+  uint64_t min_ns;
+  uint64_t max_ns;
+  uint64_t mean_ns;
+  uint64_t p50_ns;
+  uint64_t p99_ns;
+  uint64_t p999_ns;
+} stats_latency_t;
+
+typedef struct {
+  stats_latency_t latency[STATS_NUM_HISTOGRAMS];
+  uint64_t counters[STATS_NUM_COUNTERS];
+} stats_snapshot_t;
+
+/* Returns a monotonic timestamp in nanoseconds. */
+uint64_t stats_now(void);
+
+/* Records one latency of |ns| nanoseconds in |histogram|, a jbod_cmd_t or a
+ * stats_histogram_t. Safe to call from any thread. */
+void stats_record(int histogram, uint64_t ns);
+
+/* Adds |n| to |counter|. Safe to call from any thread. */
+void stats_count(stats_counter_t counter, uint64_t n);
+
+/* Fills |snapshot| with the current statistics. Updates made while it runs
+ * may be partially included. */
+void stats_snapshot(stats_snapshot_t *snapshot);
+
+/* Returns 1 on success and -1 on failure. Writes the current statistics to
+ * |out| as a JSON object. */
+int stats_dump_json(FILE *out);
+
+/* Clears every histogram and counter. */
+void stats_reset(void);
+
+#endif
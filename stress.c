@@ -0,0 +1,348 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "mdadm.h"
+#include "net.h"
+#include "stats.h"
+
+/* hammers the array of jbod_server with mdadm_read and mdadm_write from 1, 2,
+ * 4, 8 and 16 threads and checks every byte read against what was written.
+ * the array is cut into slices of SLICE_LEN bytes dealt out to the threads in
+ * turn, and a thread only writes its own slices. slices do not line up with
+ * blocks, so threads write different bytes of the same blocks side by side and
+ * a lost update shows up as a mismatch. every run ends by reading the whole
+ * array back. exits with 1 on the first mismatch or failed call.
+ *
+ * with a write-back cache (-w) smaller than the array, writes keep flushing
+ * and evicting the dirty blocks of the others while they are read. the runs
+ * are followed by two checks that nothing dirty got lost: the device itself,
+ * read past the cache, must hold every byte once mdadm_flush returns, and
+ * after one more run the unmount must write every block left dirty. the
+ * servers start every mount with empty disks, so what the unmount wrote cannot
+ * be read back, its writes are counted instead. */
+
+#define SLICE_LEN 700
+#define MAX_THREADS 16
+
+/* what the array should hold, a thread only touches the bytes of its slices */
+static uint8_t expected[MDADM_ARRAY_SIZE];
+static uint8_t readback[MDADM_ARRAY_SIZE];
+static int num_ops = 4000;
+static int num_threads_max = MAX_THREADS;
+
+typedef struct {
+  pthread_t thread;
+  int index;
+  int num_threads;
+  uint32_t state;
+  uint64_t bytes;
+  int failures;
+} worker_t;
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [-c cache_entries] [-w] [-p lru|clock|2q|arc] [-n connections] [-e ip:port] [-t threads] [-o ops]\n"
+          "  -c  cache size in entries, 0 (the default) disables the cache\n"
+          "  -w  put the cache in write-back mode and check that no dirty block is lost\n"
+          "  -p  cache eviction policy, lru by default\n"
+          "  -n  number of connections to the server, 1 by default, more need server.c\n"
+          "  -e  use the server at this address instead of the default one\n"
+          "  -t  the most threads to run with, 16 by default\n"
+          "  -o  calls per thread and run, 4000 by default\n", prog);
+}
+
+static int parse_policy(const char *name, cache_policy_t *policy) {
+  const char *names[] = { "lru", "clock", "2q", "arc" };
+  const cache_policy_t policies[] = { CACHE_POLICY_LRU, CACHE_POLICY_CLOCK, CACHE_POLICY_2Q, CACHE_POLICY_ARC };
+
+  for (int i = 0; i < 4; i++){
+    if (strcasecmp(name, names[i]) == 0){
+      *policy = policies[i];
+      return 1;
+    }
+  }
+  return -1;
+}
+
+//split |arg| of the form ip:port into |node|, which keeps pointing into |arg|
+static int parse_node(char *arg, jbod_node_t *node) {
+  char *colon = strrchr(arg, ':');
+
+  if (colon == NULL || atoi(colon + 1) <= 0 || atoi(colon + 1) > 65535){
+    return -1;
+  }
+  *colon = '\0';
+  node->ip = arg;
+  node->port = (uint16_t) atoi(colon + 1);
+  return 1;
+}
+
+//xorshift, every worker has its own state
+static uint32_t next_random(uint32_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+//prints where |got| first differs from what [addr, addr + len) should hold, returns true if it does not
+static bool check_bytes(uint32_t addr, uint32_t len, const uint8_t *got) {
+  for (uint32_t i = 0; i < len; i++){
+    if (got[i] != expected[addr + i]){
+      fprintf(stderr, "error, byte %u reads 0x%02x, 0x%02x was written\n", addr + i, got[i], expected[addr + i]);
+      return false;
+    }
+  }
+  return true;
+}
+
+static void *worker_main(void *arg) {
+  worker_t *worker = (worker_t*) arg;
+  uint8_t data[1024];
+  int num_slices = (MDADM_ARRAY_SIZE + SLICE_LEN - 1) / SLICE_LEN;
+  int owned = (num_slices - worker->index + worker->num_threads - 1) / worker->num_threads;
+
+  for (int op = 0; op < num_ops && worker->failures == 0; op++){
+    uint32_t slice = worker->index + (next_random(&worker->state) % owned) * worker->num_threads;
+    uint32_t slice_len = slice == (uint32_t) num_slices - 1 ? MDADM_ARRAY_SIZE - slice * SLICE_LEN : SLICE_LEN;
+    uint32_t offset = next_random(&worker->state) % slice_len;
+    uint32_t addr = slice * SLICE_LEN + offset;
+    uint32_t len = 1 + next_random(&worker->state) % (slice_len - offset);
+
+    if (next_random(&worker->state) % 2 == 0){
+      for (uint32_t i = 0; i < len; i++){
+        data[i] = (uint8_t) next_random(&worker->state);
+      }
+      if (mdadm_write(addr, len, data) != (int) len){
+        fprintf(stderr, "error, thread %d failed to write %u bytes at %u\n", worker->index, len, addr);
+        worker->failures ++;
+      }
+      memcpy(expected + addr, data, len);
+    }
+    else if (mdadm_read(addr, len, data) != (int) len){
+      fprintf(stderr, "error, thread %d failed to read %u bytes at %u\n", worker->index, len, addr);
+      worker->failures ++;
+    }
+    else if (!check_bytes(addr, len, data)){
+      worker->failures ++;
+    }
+    worker->bytes += len;
+  }
+  return NULL;
+}
+
+//one run with |num_threads| threads, returns the MiB/s or -1 on a mismatch or failure
+static double run_threads(int num_threads) {
+  worker_t workers[MAX_THREADS];
+  uint64_t bytes = 0;
+  int failures = 0;
+
+  uint64_t start = stats_now();
+  for (int i = 0; i < num_threads; i++){
+    workers[i] = (worker_t) { .index = i, .num_threads = num_threads, .state = 2463534242u + 7919u * (num_threads * MAX_THREADS + i) };
+    if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0){
+      fprintf(stderr, "error, failed to start thread %d\n", i);
+      return -1;
+    }
+  }
+  for (int i = 0; i < num_threads; i++){
+    pthread_join(workers[i].thread, NULL);
+    bytes += workers[i].bytes;
+    failures += workers[i].failures;
+  }
+  double elapsed = (stats_now() - start) / 1e9;
+
+  if (failures > 0){
+    return -1;
+  }
+  //the threads are done, so every byte must read as last written
+  if (mdadm_read_large(0, MDADM_ARRAY_SIZE, readback) != MDADM_ARRAY_SIZE){
+    fprintf(stderr, "error, failed to read the array back\n");
+    return -1;
+  }
+  if (!check_bytes(0, MDADM_ARRAY_SIZE, readback)){
+    return -1;
+  }
+  return bytes / elapsed / (1024 * 1024);
+}
+
+static uint32_t stress_op(int disk_num, int block_num, jbod_cmd_t cmd) {
+  return (uint32_t) cmd << 14 | (uint32_t) block_num << 20 | (uint32_t) disk_num << 28;
+}
+
+//reads every block straight from the device, past the cache, and checks it
+static bool check_device(void) {
+  for (int disk_num = 0; disk_num < JBOD_NUM_DISKS; disk_num++){
+    if (jbod_client_operation(stress_op(disk_num, 0, JBOD_SEEK_TO_DISK), NULL) != 0 ||
+        jbod_client_operation(stress_op(disk_num, 0, JBOD_SEEK_TO_BLOCK), NULL) != 0){
+      fprintf(stderr, "error, failed to seek to disk %d\n", disk_num);
+      return false;
+    }
+    for (int block_num = 0; block_num < JBOD_NUM_BLOCKS_PER_DISK; block_num++){
+      uint32_t addr = disk_num * JBOD_DISK_SIZE + block_num * JBOD_BLOCK_SIZE;
+
+      if (jbod_client_operation(stress_op(disk_num, block_num, JBOD_READ_BLOCK), readback + addr) != 0){
+        fprintf(stderr, "error, failed to read block %d of disk %d\n", block_num, disk_num);
+        return false;
+      }
+    }
+  }
+  return check_bytes(0, MDADM_ARRAY_SIZE, readback);
+}
+
+//the checks of -w, see the top of the file
+static int check_write_back(void) {
+  if (mdadm_flush() != 1){
+    fprintf(stderr, "error, failed to flush\n");
+    return 1;
+  }
+  if (!check_device()){
+    fprintf(stderr, "error, the flushed device lost a write\n");
+    return 1;
+  }
+  printf("the flushed device holds every byte written\n");
+
+  if (run_threads(num_threads_max) < 0){
+    fprintf(stderr, "error, the run before the unmount failed\n");
+    return 1;
+  }
+  int num_dirty = cache_num_dirty();
+  stats_snapshot_t snapshot;
+
+  stats_reset();
+  if (mdadm_unmount() != 1){
+    fprintf(stderr, "error, failed to unmount\n");
+    return 1;
+  }
+  stats_snapshot(&snapshot);
+  if (cache_num_dirty() != 0 || snapshot.counters[STATS_BLOCKS_WRITTEN] != (uint64_t) num_dirty){
+    fprintf(stderr, "error, the unmount wrote %llu of %d dirty blocks and left %d dirty\n",
+            (unsigned long long) snapshot.counters[STATS_BLOCKS_WRITTEN], num_dirty, cache_num_dirty());
+    return 1;
+  }
+  printf("the unmount wrote all %d blocks left dirty\n", num_dirty);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  int cache_entries = 0;
+  int connections = 1;
+  bool write_back = false;
+  jbod_node_t node = { .ip = JBOD_SERVER, .port = JBOD_PORT };
+  cache_policy_t policy = CACHE_POLICY_LRU;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "c:wp:n:e:t:o:")) != -1){
+    switch (opt){
+      case 'c':
+        cache_entries = atoi(optarg);
+        break;
+      case 'w':
+        write_back = true;
+        break;
+      case 'p':
+        if (parse_policy(optarg, &policy) != 1){
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'n':
+        connections = atoi(optarg);
+        break;
+      case 'e':
+        if (parse_node(optarg, &node) != 1){
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 't':
+        num_threads_max = atoi(optarg);
+        if (num_threads_max < 1 || num_threads_max > MAX_THREADS){
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'o':
+        num_ops = atoi(optarg);
+        if (num_ops < 1){
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (optind != argc || (write_back && cache_entries <= 0)){
+    usage(argv[0]);
+    return 1;
+  }
+
+  if (!jbod_connect_nodes(&node, 1, connections)){
+    fprintf(stderr, "error, failed to connect to %s:%d\n", node.ip, node.port);
+    return 1;
+  }
+  if (cache_entries > 0 && cache_create_with_policy(cache_entries, policy) != 1){
+    fprintf(stderr, "error, failed to create a cache of %d entries\n", cache_entries);
+    return 1;
+  }
+  if (write_back && cache_set_write_back(true) != 1){
+    fprintf(stderr, "error, failed to switch the cache to write-back\n");
+    return 1;
+  }
+  if (mdadm_mount() != 1){
+    fprintf(stderr, "error, failed to mount\n");
+    return 1;
+  }
+
+  //start from a known array
+  if (mdadm_write_large(0, MDADM_ARRAY_SIZE, expected) != MDADM_ARRAY_SIZE){
+    fprintf(stderr, "error, failed to clear the array\n");
+    return 1;
+  }
+
+  int status = 0;
+  double base = 0;
+  printf("%-8s %10s %8s\n", "threads", "MiB/s", "scaling");
+  for (int num_threads = 1; num_threads <= num_threads_max && status == 0; num_threads *= 2){
+    double rate = run_threads(num_threads);
+
+    if (rate < 0){
+      fprintf(stderr, "error, the run with %d threads failed\n", num_threads);
+      status = 1;
+      break;
+    }
+    if (num_threads == 1){
+      base = rate;
+    }
+    printf("%-8d %10.2f %7.1fx\n", num_threads, rate, rate / base);
+    fflush(stdout);
+  }
+
+  if (status == 0 && write_back){
+    status = check_write_back();
+  }
+  if (status == 0){
+    printf("no mismatches\n");
+  }
+
+  //the checks of -w leave the array unmounted
+  if (!write_back || status != 0){
+    mdadm_unmount();
+  }
+  if (cache_enabled()){
+    cache_destroy();
+  }
+  jbod_disconnect();
+
+  return status;
+}
@@ -0,0 +1,270 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "trace.h"
+#include "stats.h"
+
+/*
+records go through a bounded multi-producer ring (Vyukov's queue): a producer
+claims a slot by advancing enqueue_pos with a compare-and-swap, fills it and
+publishes it by storing the slot's sequence number. only the writer thread
+consumes, so it needs no atomics on its side beyond reading the sequence. a
+producer never waits: when the ring is full the record is dropped.
+*/
+#define TRACE_RING_SIZE 65536
+#define TRACE_POLL_NS 1000000
+
+typedef struct {
+  atomic_size_t sequence;
+  trace_record_t record;
+} trace_slot_t;
+
+static trace_slot_t *ring = NULL;
+static atomic_size_t enqueue_pos = 0;
+static size_t dequeue_pos = 0;
+
+static atomic_bool active = false;
+static atomic_int producers = 0;
+static atomic_bool stopping = false;
+static atomic_uint_fast64_t num_dropped = 0;
+
+static FILE *trace_file = NULL;
+static bool write_failed = false;
+static uint64_t trace_epoch = 0;
+static pthread_t writer;
+
+/* trace_start and trace_stop are serialized by this lock, the hot path never takes it */
+static pthread_mutex_t control_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void encode_record(uint8_t *out, const trace_record_t *record) {
+  for (int i = 0; i < 8; i++){
+    out[i] = (uint8_t) (record->timestamp_ns >> (8 * i));
+  }
+  for (int i = 0; i < 4; i++){
+    out[8 + i] = (uint8_t) (record->addr >> (8 * i));
+    out[12 + i] = (uint8_t) (record->len >> (8 * i));
+  }
+  out[16] = record->op;
+}
+
+static void decode_record(const uint8_t *in, trace_record_t *record) {
+  memset(record, 0, sizeof(*record));
+  for (int i = 0; i < 8; i++){
+    record->timestamp_ns |= (uint64_t) in[i] << (8 * i);
+  }
+  for (int i = 0; i < 4; i++){
+    record->addr |= (uint32_t) in[8 + i] << (8 * i);
+    record->len |= (uint32_t) in[12 + i] << (8 * i);
+  }
+  record->op = in[16];
+}
+
+//take the next published record off the ring, returns false if there is none
+static bool ring_pop(trace_record_t *record) {
+  trace_slot_t *slot = &ring[dequeue_pos & (TRACE_RING_SIZE - 1)];
+
+  if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != dequeue_pos + 1){
+    return false;
+  }
+
+  *record = slot->record;
+  //hand the slot back to the producers for the next lap
+  atomic_store_explicit(&slot->sequence, dequeue_pos + TRACE_RING_SIZE, memory_order_release);
+  dequeue_pos ++;
+  return true;
+}
+
+//drains the ring into the file until trace_stop asks it to finish
+static void *writer_main(void *arg) {
+  (void) arg;
+
+  while (true){
+    bool finishing = atomic_load(&stopping);
+    trace_record_t record;
+    int drained = 0;
+
+    while (ring_pop(&record)){
+      uint8_t encoded[TRACE_RECORD_SIZE];
+      encode_record(encoded, &record);
+      if (fwrite(encoded, TRACE_RECORD_SIZE, 1, trace_file) != 1){
+        write_failed = true;
+      }
+      drained ++;
+    }
+
+    //stopping was seen before this pass, and no producer is left, so the ring is empty for good
+    if (finishing){
+      break;
+    }
+
+    if (drained == 0){
+      struct timespec pause = { 0, TRACE_POLL_NS };
+      nanosleep(&pause, NULL);
+    }
+  }
+
+  return NULL;
+}
+
+int trace_start(const char *path) {
+  int result = -1;
+
+  if (path == NULL){
+    return -1;
+  }
+
+  pthread_mutex_lock(&control_lock);
+
+  if (!atomic_load(&active)){
+    ring = (trace_slot_t*) malloc(TRACE_RING_SIZE * sizeof(trace_slot_t));
+    trace_file = fopen(path, "wb");
+
+    if (ring != NULL && trace_file != NULL && fwrite(TRACE_MAGIC, 8, 1, trace_file) == 1){
+      for (size_t i = 0; i < TRACE_RING_SIZE; i++){
+        atomic_init(&ring[i].sequence, i);
+      }
+      atomic_store(&enqueue_pos, 0);
+      dequeue_pos = 0;
+      atomic_store(&num_dropped, 0);
+      atomic_store(&stopping, false);
+      write_failed = false;
+      trace_epoch = stats_now();
+
+      if (pthread_create(&writer, NULL, writer_main, NULL) == 0){
+        atomic_store(&active, true);
+        result = 1;
+      }
+    }
+
+    if (result == -1){
+      free(ring);
+      ring = NULL;
+      if (trace_file != NULL){
+        fclose(trace_file);
+        trace_file = NULL;
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&control_lock);
+  return result;
+}
+
+int trace_stop(void) {
+  int result = -1;
+
+  pthread_mutex_lock(&control_lock);
+
+  if (atomic_load(&active)){
+    atomic_store(&active, false);
+
+    //a producer that saw |active| before it was cleared may still be filling a slot
+    while (atomic_load(&producers) > 0){
+      sched_yield();
+    }
+
+    atomic_store(&stopping, true);
+    pthread_join(writer, NULL);
+
+    result = write_failed ? -1 : 1;
+    if (fclose(trace_file) != 0){
+      result = -1;
+    }
+    trace_file = NULL;
+    free(ring);
+    ring = NULL;
+  }
+
+  pthread_mutex_unlock(&control_lock);
+  return result;
+}
+
+void trace_record(trace_op_t op, uint32_t addr, uint32_t len) {
+  //the common case, no trace being recorded, costs one load
+  if (!atomic_load_explicit(&active, memory_order_relaxed)){
+    return;
+  }
+
+  atomic_fetch_add(&producers, 1);
+  if (!atomic_load(&active)){
+    atomic_fetch_sub(&producers, 1);
+    return;
+  }
+
+  size_t pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+  trace_slot_t *slot;
+
+  while (true){
+    slot = &ring[pos & (TRACE_RING_SIZE - 1)];
+    size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    intptr_t diff = (intptr_t) sequence - (intptr_t) pos;
+
+    if (diff == 0){
+      if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)){
+        break;
+      }
+    }
+    else if (diff < 0){
+      //the writer is a whole lap behind
+      num_dropped ++;
+      atomic_fetch_sub(&producers, 1);
+      return;
+    }
+    else{
+      pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+    }
+  }
+
+  slot->record.timestamp_ns = stats_now() - trace_epoch;
+  slot->record.addr = addr;
+  slot->record.len = len;
+  slot->record.op = (uint8_t) op;
+  atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+
+  atomic_fetch_sub(&producers, 1);
+}
+
+uint64_t trace_dropped(void) {
+  return num_dropped;
+}
+
+FILE *trace_open(const char *path) {
+  char magic[8];
+  FILE *in = fopen(path, "rb");
+
+  if (in == NULL){
+    return NULL;
+  }
+
+  if (fread(magic, 8, 1, in) != 1 || memcmp(magic, TRACE_MAGIC, 8) != 0){
+    fclose(in);
+    return NULL;
+  }
+
+  return in;
+}
+
+int trace_next(FILE *in, trace_record_t *record) {
+  uint8_t encoded[TRACE_RECORD_SIZE];
+
+  if (in == NULL || record == NULL){
+    return -1;
+  }
+
+  size_t got = fread(encoded, 1, TRACE_RECORD_SIZE, in);
+  if (got == 0 && feof(in)){
+    return 0;
+  }
+  //a truncated last record means the trace was cut short
+  if (got != TRACE_RECORD_SIZE){
+    return -1;
+  }
+
+  decode_record(encoded, record);
+  return 1;
+}
@@ -0,0 +1,50 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* A trace file starts with the 8 bytes of TRACE_MAGIC, followed by one
+ * TRACE_RECORD_SIZE byte record per call, little endian: the timestamp in
+ * nanoseconds since trace_start (8 bytes), addr (4), len (4) and op (1). */
+#define TRACE_MAGIC "JBODTRC1"
+#define TRACE_RECORD_SIZE 17
+
+typedef enum {
+  TRACE_READ,
+  TRACE_WRITE,
+} trace_op_t;
+
+typedef struct {
+  uint64_t timestamp_ns;
+  uint32_t addr;
+  uint32_t len;
+  uint8_t op;
+} trace_record_t;
+
+/* Returns 1 on success and -1 on failure. Starts recording every mdadm read
+ * and write to the file at |path|, which is truncated. Fails if a trace is
+ * already being recorded. */
+int trace_start(const char *path);
+
+/* Returns 1 on success and -1 on failure. Stops recording, writes out the
+ * records still buffered and closes the file. */
+int trace_stop(void);
+
+/* Records one call if a trace is being recorded. It never blocks: the record
+ * goes into a lock-free ring that a background thread writes out, and it is
+ * dropped when the ring is full (see trace_dropped). */
+void trace_record(trace_op_t op, uint32_t addr, uint32_t len);
+
+/* Returns the number of records dropped since trace_start. */
+uint64_t trace_dropped(void);
+
+/* Opens the trace file at |path| for reading. Returns NULL if it cannot be
+ * opened or is not a trace. */
+FILE *trace_open(const char *path);
+
+/* Returns 1 and fills |record| with the next record of |in|, 0 at the end of
+ * the trace and -1 on failure. */
+int trace_next(FILE *in, trace_record_t *record);
+
+#endif